@@ -0,0 +1,160 @@
+#include "mio.h"
+
+/*
+ * Scratch memory for loaders. Each thread has its own arena, a bump
+ * allocator that is emptied when the outermost arena_begin/arena_end scope
+ * ends. Running out of room chains on another block; at the end of the
+ * scope the blocks are merged into one big enough for the whole load, so
+ * the next load of the same size makes no calls to malloc at all.
+ *
+ * Outside of a scope, and for pointers that did not come from the arena,
+ * the functions fall through to malloc, realloc and free. That way code
+ * such as stb_image can use them unconditionally.
+ */
+
+#define ALIGN 16
+#define BLOCK_SIZE (1 << 20)
+#define KEEP_SIZE (8 << 20) /* larger blocks are given back after use */
+
+struct block {
+	struct block *prev;
+	int size, used;
+};
+
+#define BLOCK_HEADER ((sizeof(struct block) + ALIGN - 1) & ~(ALIGN - 1))
+#define BLOCK_DATA(b) ((unsigned char*)(b) + BLOCK_HEADER)
+
+static __thread struct block *arena = NULL;
+static __thread unsigned char *arena_last = NULL; /* may be grown or popped in place */
+static __thread int arena_depth = 0;
+
+static struct block *new_block(struct block *prev, int size)
+{
+	struct block *b = malloc(BLOCK_HEADER + size);
+	b->prev = prev;
+	b->size = size;
+	b->used = 0;
+	return b;
+}
+
+static struct block *find_block(const void *p)
+{
+	struct block *b;
+	for (b = arena; b; b = b->prev)
+		if ((const unsigned char*)p >= BLOCK_DATA(b) && (const unsigned char*)p < BLOCK_DATA(b) + b->used)
+			return b;
+	return NULL;
+}
+
+/* Every allocation is preceded by its size, padded to keep the alignment. */
+static int alloc_size(const unsigned char *p)
+{
+	return *(const int*)(p - ALIGN);
+}
+
+void arena_begin(void)
+{
+	arena_depth++;
+}
+
+void arena_end(void)
+{
+	struct block *b;
+	int total = 0;
+
+	if (--arena_depth > 0)
+		return;
+
+	if (arena && arena->prev) {
+		while (arena) {
+			b = arena->prev;
+			total += arena->size;
+			free(arena);
+			arena = b;
+		}
+		if (total <= KEEP_SIZE)
+			arena = new_block(NULL, total);
+	} else if (arena && arena->size > KEEP_SIZE) {
+		free(arena);
+		arena = NULL;
+	}
+
+	if (arena)
+		arena->used = 0;
+	arena_last = NULL;
+}
+
+void *arena_alloc(int size)
+{
+	unsigned char *p;
+	int need = ALIGN + ((size + ALIGN - 1) & ~(ALIGN - 1));
+
+	if (arena_depth == 0)
+		return malloc(size);
+
+	if (!arena || arena->used + need > arena->size)
+		arena = new_block(arena, MAX(need, arena ? arena->size * 2 : BLOCK_SIZE));
+
+	p = BLOCK_DATA(arena) + arena->used + ALIGN;
+	*(int*)(p - ALIGN) = size;
+	arena->used += need;
+	arena_last = p;
+	return p;
+}
+
+void *arena_calloc(int count, int size)
+{
+	void *p = arena_alloc(count * size);
+	memset(p, 0, count * size);
+	return p;
+}
+
+void *arena_realloc(void *ptr, int size)
+{
+	unsigned char *p = ptr, *q;
+
+	if (!p)
+		return arena_alloc(size);
+
+	if (!find_block(p))
+		return realloc(p, size);
+
+	if (p == arena_last) {
+		int need = ALIGN + ((size + ALIGN - 1) & ~(ALIGN - 1));
+		int start = p - ALIGN - BLOCK_DATA(arena);
+		if (start + need <= arena->size) {
+			*(int*)(p - ALIGN) = size;
+			arena->used = start + need;
+			return p;
+		}
+	}
+
+	q = arena_alloc(size);
+	memcpy(q, p, MIN(size, alloc_size(p)));
+	return q;
+}
+
+/* Only the most recent allocation is actually given back before the scope ends. */
+void arena_free(void *ptr)
+{
+	unsigned char *p = ptr;
+
+	if (!p)
+		return;
+
+	if (!find_block(p)) {
+		free(p);
+		return;
+	}
+
+	if (p == arena_last) {
+		arena->used = p - ALIGN - BLOCK_DATA(arena);
+		arena_last = NULL;
+	}
+}
+
+char *arena_strdup(const char *s)
+{
+	int n = strlen(s) + 1;
+	return memcpy(arena_alloc(n), s, n);
+}
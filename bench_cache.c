@@ -0,0 +1,155 @@
+/*
+ * bench_cache -- compare the resource cache against the AA-tree it replaced.
+ *
+ * Builds a set of asset-like path names, inserts them into both, and looks
+ * each of them up a number of times in a shuffled order.
+ */
+
+#include "mio.h"
+
+#include <time.h>
+
+#define NUM_KEYS 50000
+#define ROUNDS 20
+
+struct tree
+{
+	char *key;
+	void *value;
+	struct tree *left, *right;
+	int level;
+};
+
+static struct tree sentinel = { "", NULL, &sentinel, &sentinel, 0 };
+
+static void *tree_lookup(struct tree *node, const char *key)
+{
+	if (node) {
+		while (node != &sentinel) {
+			int c = strcmp(key, node->key);
+			if (c == 0)
+				return node->value;
+			else if (c < 0)
+				node = node->left;
+			else
+				node = node->right;
+		}
+	}
+	return NULL;
+}
+
+static struct tree *skew(struct tree *node)
+{
+	if (node->left->level == node->level) {
+		struct tree *save = node;
+		node = node->left;
+		save->left = node->right;
+		node->right = save;
+	}
+	return node;
+}
+
+static struct tree *split(struct tree *node)
+{
+	if (node->right->right->level == node->level) {
+		struct tree *save = node;
+		node = node->right;
+		save->right = node->left;
+		node->left = save;
+		node->level++;
+	}
+	return node;
+}
+
+static struct tree *tree_insert(struct tree *node, const char *key, void *value)
+{
+	if (node && node != &sentinel) {
+		int c = strcmp(key, node->key);
+		if (c < 0)
+			node->left = tree_insert(node->left, key, value);
+		else
+			node->right = tree_insert(node->right, key, value);
+		node = skew(node);
+		node = split(node);
+		return node;
+	}
+	node = malloc(sizeof(struct tree));
+	node->key = strdup(key);
+	node->value = value;
+	node->left = node->right = &sentinel;
+	node->level = 1;
+	return node;
+}
+
+static const char *dirs[] = {
+	"data/models/characters/", "data/models/props/", "data/models/architecture/",
+	"data/textures/characters/", "data/textures/props/", "data/textures/terrain/",
+};
+
+static const char *exts[] = { ".iqm", ".obj", ".png", ".dds", "_normal.png", "_specular.png" };
+
+static char *keys[NUM_KEYS];
+static char *probes[NUM_KEYS];
+
+static double now(void)
+{
+	return (double)clock() / CLOCKS_PER_SEC * 1000;
+}
+
+int main(int argc, char **argv)
+{
+	struct tree *tree = NULL;
+	struct cache *cache = NULL;
+	char buf[256];
+	double t0, t1, t2, t3, t4;
+	intptr_t sum = 0;
+	int i, k;
+
+	srand(1);
+	for (i = 0; i < NUM_KEYS; i++) {
+		snprintf(buf, sizeof buf, "%s%s_%04d/lod%d%s",
+			dirs[rand() % nelem(dirs)], i & 1 ? "crate" : "barrel",
+			i / 8, i % 8, exts[rand() % nelem(exts)]);
+		keys[i] = strdup(buf);
+	}
+
+	/* look up copies of the keys, as callers pass freshly built paths */
+	for (i = 0; i < NUM_KEYS; i++)
+		probes[i] = strdup(keys[i]);
+	for (i = NUM_KEYS - 1; i > 0; i--) {
+		char *tmp;
+		k = rand() % (i + 1);
+		tmp = probes[i];
+		probes[i] = probes[k];
+		probes[k] = tmp;
+	}
+
+	t0 = now();
+	for (i = 0; i < NUM_KEYS; i++)
+		tree = tree_insert(tree, keys[i], (void*)(intptr_t)(i + 1));
+	t1 = now();
+	for (k = 0; k < ROUNDS; k++)
+		for (i = 0; i < NUM_KEYS; i++)
+			sum += (intptr_t)tree_lookup(tree, probes[i]);
+	t2 = now();
+	for (i = 0; i < NUM_KEYS; i++)
+		cache = insert(cache, keys[i], (void*)(intptr_t)(i + 1));
+	t3 = now();
+	for (k = 0; k < ROUNDS; k++)
+		for (i = 0; i < NUM_KEYS; i++)
+			sum -= (intptr_t)lookup(cache, probes[i]);
+	t4 = now();
+
+	if (sum != 0) {
+		fprintf(stderr, "bench_cache: lookups disagree\n");
+		return 1;
+	}
+
+	printf("%d keys, %d lookup rounds\n", NUM_KEYS, ROUNDS);
+	printf("aa-tree:    insert %7.2f ms  lookup %7.2f ms (%.0f ns/lookup)\n",
+		t1 - t0, t2 - t1, (t2 - t1) * 1e6 / ((double)NUM_KEYS * ROUNDS));
+	printf("hash table: insert %7.2f ms  lookup %7.2f ms (%.0f ns/lookup)\n",
+		t3 - t2, t4 - t3, (t4 - t3) * 1e6 / ((double)NUM_KEYS * ROUNDS));
+
+	return 0;
+}
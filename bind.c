@@ -119,13 +119,42 @@ void run_function(const char *fun)
 	}
 }
 
-static void *checktag(lua_State *L, int n, int tag)
+/*
+ * Meshes, animations and fonts are passed to Lua as handles in light
+ * userdata. Each handle holds one reference to its resource; once it has
+ * been released it resolves to NULL, which the functions below treat as
+ * an empty resource.
+ */
+
+static struct mesh empty_mesh = { TAG_MESH };
+
+static void pushhandle(lua_State *L, int tag, void *ptr)
+{
+	if (ptr)
+		lua_pushlightuserdata(L, (void*)(uintptr_t)new_handle(tag, ptr));
+	else
+		lua_pushnil(L);
+}
+
+static uintptr_t tohandle(lua_State *L, int n)
 {
 	luaL_checktype(L, n, LUA_TLIGHTUSERDATA);
-	enum tag *p = lua_touserdata(L, n);
-	if (!p || *p != tag)
+	return (uintptr_t)lua_touserdata(L, n);
+}
+
+static void *checktag(lua_State *L, int n, int tag)
+{
+	uintptr_t handle = tohandle(L, n);
+	int t = handle_tag(handle);
+	if (t && t != tag)
 		luaL_argerror(L, n, "wrong userdata type");
-	return p;
+	return get_handle(handle, tag);
+}
+
+static struct mesh *checkmesh(lua_State *L, int n)
+{
+	struct mesh *mesh = checktag(L, n, TAG_MESH);
+	return mesh ? mesh : &empty_mesh;
 }
 
 /* Misc */
@@ -142,13 +171,98 @@ static int ffi_register_directory(lua_State *L)
 	return 0;
 }
 
+static int ffi_rescan_directories(lua_State *L)
+{
+	rescan_directories();
+	return 0;
+}
+
+static int ffi_set_file_cache_budget(lua_State *L)
+{
+	set_file_cache_budget(luaL_checkinteger(L, 1));
+	return 0;
+}
+
+static int ffi_file_cache_stats(lua_State *L)
+{
+	int hits, misses, bytes, budget;
+	file_cache_stats(&hits, &misses, &bytes, &budget);
+	lua_pushinteger(L, hits);
+	lua_pushinteger(L, misses);
+	lua_pushinteger(L, bytes);
+	lua_pushinteger(L, budget);
+	return 4;
+}
+
+static int ffi_vfs_stats(lua_State *L)
+{
+	struct vfs_stats list[64];
+	int i, n = vfs_stats(list, nelem(list));
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		lua_createtable(L, 0, 7);
+		lua_pushstring(L, list[i].name);
+		lua_setfield(L, -2, "name");
+		lua_pushinteger(L, list[i].opens);
+		lua_setfield(L, -2, "opens");
+		lua_pushinteger(L, list[i].failed);
+		lua_setfield(L, -2, "failed");
+		lua_pushnumber(L, list[i].bytes_read);
+		lua_setfield(L, -2, "bytes_read");
+		lua_pushnumber(L, list[i].compressed);
+		lua_setfield(L, -2, "compressed");
+		lua_pushnumber(L, list[i].uncompressed);
+		lua_setfield(L, -2, "uncompressed");
+		lua_pushnumber(L, list[i].decode_time);
+		lua_setfield(L, -2, "decode_time");
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+static int ffi_print_vfs_stats(lua_State *L)
+{
+	print_vfs_stats();
+	return 0;
+}
+
+static int ffi_reset_vfs_stats(lua_State *L)
+{
+	reset_vfs_stats();
+	return 0;
+}
+
+static int ffi_dump_vfs_log(lua_State *L)
+{
+	lua_pushboolean(L, dump_vfs_log(luaL_checkstring(L, 1)) == 0);
+	return 1;
+}
+
+static int ffi_prefetch_file(lua_State *L)
+{
+	prefetch_file(luaL_checkstring(L, 1));
+	return 0;
+}
+
+static int ffi_prefetch_files(lua_State *L)
+{
+	lua_pushboolean(L, prefetch_files(luaL_checkstring(L, 1)) == 0);
+	return 1;
+}
+
+static int ffi_set_cook_directory(lua_State *L)
+{
+	set_cook_directory(luaL_optstring(L, 1, NULL));
+	return 0;
+}
+
 static int ffi_load_font(lua_State *L)
 {
 	const char *name = luaL_checkstring(L, 1);
 	struct font *font = load_font(name);
 	if (!font)
 		return luaL_error(L, "cannot load font: %s", name);
-	lua_pushlightuserdata(L, font);
+	pushhandle(L, TAG_FONT, font);
 	return 1;
 }
 
@@ -160,7 +274,93 @@ static int ffi_new_mesh(lua_State *L)
 	struct mesh *mesh = load_mesh(name);
 	if (!mesh)
 		return luaL_error(L, "cannot load mesh: %s", name);
-	lua_pushlightuserdata(L, mesh);
+	pushhandle(L, TAG_MESH, mesh);
+	return 1;
+}
+
+static int ffi_new_mesh_async(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	pushhandle(L, TAG_MESH, load_mesh_async(name));
+	return 1;
+}
+
+static int ffi_load_texture_async(lua_State *L)
+{
+	char *name = (char*)luaL_checkstring(L, 1);
+	int srgb = lua_isnone(L, 2) ? 1 : lua_toboolean(L, 2);
+	lua_pushinteger(L, load_texture_async(name, srgb));
+	return 1;
+}
+
+static int ffi_release_mesh(lua_State *L)
+{
+	release_mesh(free_handle(tohandle(L, 1), TAG_MESH));
+	return 0;
+}
+
+static int ffi_release_texture(lua_State *L)
+{
+	release_texture(luaL_checkinteger(L, 1));
+	return 0;
+}
+
+static int ffi_set_vertex_quantization(lua_State *L)
+{
+	set_vertex_quantization(luaL_checkinteger(L, 1));
+	return 0;
+}
+
+static int ffi_set_mesh_splitting(lua_State *L)
+{
+	set_mesh_splitting(lua_toboolean(L, 1));
+	return 0;
+}
+
+static int ffi_set_mesh_optimization(lua_State *L)
+{
+	set_mesh_optimization(lua_toboolean(L, 1), lua_toboolean(L, 2));
+	return 0;
+}
+
+static int ffi_set_mesh_clusters(lua_State *L)
+{
+	set_mesh_clusters(lua_toboolean(L, 1));
+	return 0;
+}
+
+static int ffi_set_mesh_lods(lua_State *L)
+{
+	set_mesh_lods(luaL_checkinteger(L, 1));
+	return 0;
+}
+
+static int ffi_set_lod_bias(lua_State *L)
+{
+	set_lod_bias(luaL_checknumber(L, 1));
+	return 0;
+}
+
+static int ffi_set_resource_budget(lua_State *L)
+{
+	set_resource_budget(luaL_checkinteger(L, 1));
+	return 0;
+}
+
+static int ffi_resource_stats(lua_State *L)
+{
+	int count, bytes, unused, budget;
+	resource_stats(&count, &bytes, &unused, &budget);
+	lua_pushinteger(L, count);
+	lua_pushinteger(L, bytes);
+	lua_pushinteger(L, unused);
+	lua_pushinteger(L, budget);
+	return 4;
+}
+
+static int ffi_pending_jobs(lua_State *L)
+{
+	lua_pushinteger(L, pending_jobs());
 	return 1;
 }
 
@@ -172,14 +372,20 @@ static int ffi_new_anim(lua_State *L)
 	struct anim *anim = load_anim(name);
 	if (!anim)
 		return luaL_error(L, "cannot load anim: %s", name);
-	lua_pushlightuserdata(L, anim);
+	pushhandle(L, TAG_ANIM, anim);
 	return 1;
 }
 
+static int ffi_release_anim(lua_State *L)
+{
+	release_anim(free_handle(tohandle(L, 1), TAG_ANIM));
+	return 0;
+}
+
 static int ffi_anim_len(lua_State *L)
 {
 	struct anim *anim = checktag(L, 1, TAG_ANIM);
-	lua_pushnumber(L, anim->frames - 1);
+	lua_pushnumber(L, anim ? anim->frames - 1 : 0);
 	return 1;
 }
 
@@ -282,12 +488,22 @@ static int ffi_skel_animate(lua_State *L)
 	struct anim *anim = checktag(L, 2, TAG_ANIM);
 	float frame = luaL_checknumber(L, 3);
 	float blend = luaL_checknumber(L, 4);
-	animate_skelpose(skelpose, anim, frame, blend);
+	if (anim)
+		animate_skelpose(skelpose, anim, frame, blend);
+	return 0;
+}
+
+static int ffi_skel_gc(lua_State *L)
+{
+	struct skelpose *skelpose = luaL_checkudata(L, 1, "mio.skel");
+	release_skel(skelpose->skel);
+	skelpose->skel = NULL;
 	return 0;
 }
 
 static luaL_Reg ffi_skel_funs[] = {
 	{ "animate", ffi_skel_animate },
+	{ "__gc", ffi_skel_gc },
 	{ NULL, NULL }
 };
 
@@ -469,7 +685,7 @@ static int ffi_update_transform_parent_skel(lua_State *L)
 static int ffi_draw_mesh(lua_State *L)
 {
 	struct transform *tra = luaL_checkudata(L, 1, "mio.transform");
-	struct mesh *mesh = checktag(L, 2, TAG_MESH);
+	struct mesh *mesh = checkmesh(L, 2);
 	render_mesh(tra, mesh);
 	return 0;
 }
@@ -477,7 +693,7 @@ static int ffi_draw_mesh(lua_State *L)
 static int ffi_draw_mesh_skel(lua_State *L)
 {
 	struct transform *tra = luaL_checkudata(L, 1, "mio.transform");
-	struct mesh *mesh = checktag(L, 2, TAG_MESH);
+	struct mesh *mesh = checkmesh(L, 2);
 	struct skelpose *skelpose = luaL_checkudata(L, 3, "mio.skel");
 	render_mesh_skel(tra, mesh, skelpose);
 	return 0;
@@ -500,6 +716,16 @@ void init_lua(void)
 
 	lua_register(L, "register_archive", ffi_register_archive);
 	lua_register(L, "register_directory", ffi_register_directory);
+	lua_register(L, "rescan_directories", ffi_rescan_directories);
+	lua_register(L, "set_file_cache_budget", ffi_set_file_cache_budget);
+	lua_register(L, "file_cache_stats", ffi_file_cache_stats);
+	lua_register(L, "vfs_stats", ffi_vfs_stats);
+	lua_register(L, "print_vfs_stats", ffi_print_vfs_stats);
+	lua_register(L, "reset_vfs_stats", ffi_reset_vfs_stats);
+	lua_register(L, "dump_vfs_log", ffi_dump_vfs_log);
+	lua_register(L, "prefetch_file", ffi_prefetch_file);
+	lua_register(L, "prefetch_files", ffi_prefetch_files);
+	lua_register(L, "set_cook_directory", ffi_set_cook_directory);
 
 	/* draw */
 	lua_register(L, "load_font", ffi_load_font);
@@ -507,7 +733,21 @@ void init_lua(void)
 	/* model */
 	lua_register(L, "new_skel", ffi_new_skel);
 	lua_register(L, "new_mesh", ffi_new_mesh);
+	lua_register(L, "new_mesh_async", ffi_new_mesh_async);
+	lua_register(L, "load_texture_async", ffi_load_texture_async);
+	lua_register(L, "release_mesh", ffi_release_mesh);
+	lua_register(L, "release_texture", ffi_release_texture);
+	lua_register(L, "set_mesh_splitting", ffi_set_mesh_splitting);
+	lua_register(L, "set_vertex_quantization", ffi_set_vertex_quantization);
+	lua_register(L, "set_mesh_optimization", ffi_set_mesh_optimization);
+	lua_register(L, "set_mesh_clusters", ffi_set_mesh_clusters);
+	lua_register(L, "set_mesh_lods", ffi_set_mesh_lods);
+	lua_register(L, "set_lod_bias", ffi_set_lod_bias);
+	lua_register(L, "set_resource_budget", ffi_set_resource_budget);
+	lua_register(L, "resource_stats", ffi_resource_stats);
+	lua_register(L, "pending_jobs", ffi_pending_jobs);
 	lua_register(L, "new_anim", ffi_new_anim);
+	lua_register(L, "release_anim", ffi_release_anim);
 
 	lua_register(L, "anim_len", ffi_anim_len); // metatable!?
 
@@ -1,97 +1,369 @@
 #include "mio.h"
 
-/* Use an AA-tree to quickly look up resources. */
+#include <pthread.h>
 
-struct cache
+/*
+ * Use an open addressing hash table to quickly look up resources.
+ *
+ * Keys are interned, so each name is stored once no matter how many caches
+ * it is in, and the hash is kept next to it so probing only compares
+ * strings on a full hash match.
+ *
+ * Lookups take no lock and may run on any thread. Writers serialize on a
+ * mutex per cache, fill in a slot before publishing its key, and never
+ * move or reuse a published slot: removed entries become tombstones, and
+ * growing or clearing out tombstones builds a new table that replaces the
+ * old one. Lookups count themselves in and out, so a writer that sees no
+ * lookup in progress after publishing the new table can free the retired
+ * ones; otherwise they are kept until a later rebuild finds the cache idle.
+ */
+
+struct slot
 {
-	char *key;
+	unsigned int hash;
+	const char *key;
 	void *value;
-	struct cache *left, *right;
-	int level;
 };
 
-static struct cache sentinel = { "", NULL, &sentinel, &sentinel, 0 };
+struct table
+{
+	int cap, used; /* used counts tombstones */
+	struct table *old;
+	struct slot slots[1];
+};
+
+struct cache
+{
+	pthread_mutex_t lock;
+	struct table *table;
+	int len;
+	int readers; /* lookups in progress */
+};
+
+static const char tombstone[1] = "";
+#define TOMBSTONE tombstone
+
+#define STRING_BLOCK (64 << 10)
+
+static struct cache strings = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+static char *string_block = NULL;
+static int string_left = 0;
 
-static struct cache *make_node(const char *key, void *value)
+static unsigned int hash_key(const char *s)
 {
-	struct cache *node = malloc(sizeof(struct cache));
-	node->key = strdup(key);
-	node->value = value;
-	node->left = node->right = &sentinel;
-	node->level = 1;
-	return node;
+	unsigned int h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
 }
 
-void *lookup(struct cache *node, const char *key)
+/*
+ * Find the slot for key, or the empty slot to put it in; call with the
+ * lock held. Tombstones are not reused, so a reader that has seen a key
+ * in a slot can trust the hash next to it.
+ */
+static struct slot *find_slot(struct table *table, const char *key, unsigned int hash)
 {
-	if (node) {
-		while (node != &sentinel) {
-			int c = strcmp(key, node->key);
-			if (c == 0)
-				return node->value;
-			else if (c < 0)
-				node = node->left;
-			else
-				node = node->right;
+	int mask = table->cap - 1;
+	int i = hash & mask;
+	for (;;) {
+		struct slot *slot = table->slots + i;
+		if (!slot->key)
+			return slot;
+		if (slot->key != TOMBSTONE && slot->hash == hash && (slot->key == key || !strcmp(slot->key, key)))
+			return slot;
+		i = (i + 1) & mask;
+	}
+}
+
+static struct table *new_table(int cap)
+{
+	struct table *table = calloc(1, sizeof(struct table) + (cap - 1) * sizeof(struct slot));
+	table->cap = cap;
+	return table;
+}
+
+/* Make room for one more key; call with the lock held. */
+static void reserve_slot(struct cache *cache)
+{
+	struct table *old = cache->table;
+	struct table *table;
+	int i, cap;
+
+	if (old && (old->used + 1) * 4 <= old->cap * 3)
+		return;
+
+	cap = 64;
+	while ((cache->len + 1) * 2 > cap)
+		cap *= 2;
+
+	table = new_table(cap);
+	if (old) {
+		for (i = 0; i < old->cap; i++) {
+			struct slot *slot = old->slots + i;
+			if (slot->key && slot->key != TOMBSTONE) {
+				*find_slot(table, slot->key, slot->hash) = *slot;
+				table->used++;
+			}
+		}
+	}
+	table->old = old;
+	__atomic_store_n(&cache->table, table, __ATOMIC_SEQ_CST);
+
+	/* a lookup that starts after this sees the new table */
+	if (__atomic_load_n(&cache->readers, __ATOMIC_SEQ_CST) == 0) {
+		while (table->old) {
+			old = table->old;
+			table->old = old->old;
+			free(old);
 		}
 	}
-	return NULL;
 }
 
-static struct cache *skew(struct cache *node)
+/* Store value under key; call with the lock held. */
+static void store_slot(struct cache *cache, const char *key, unsigned int hash, void *value, const char *(*intern)(const char*, unsigned int))
 {
-	if (node->left->level == node->level) {
-		struct cache *save = node;
-		node = node->left;
-		save->left = node->right;
-		node->right = save;
+	struct slot *slot;
+
+	reserve_slot(cache);
+	slot = find_slot(cache->table, key, hash);
+	if (slot->key) {
+		__atomic_store_n(&slot->value, value, __ATOMIC_RELEASE);
+		return;
 	}
-	return node;
+
+	cache->table->used++;
+	cache->len++;
+	slot->hash = hash;
+	slot->value = value;
+	__atomic_store_n(&slot->key, intern ? intern(key, hash) : key, __ATOMIC_RELEASE);
 }
 
-static struct cache *split(struct cache *node)
+static const char *intern(const char *key, unsigned int hash)
 {
-	if (node->right->right->level == node->level) {
-		struct cache *save = node;
-		node = node->right;
-		save->right = node->left;
-		node->left = save;
-		node->level++;
+	const char *s;
+	int n;
+
+	pthread_mutex_lock(&strings.lock);
+
+	s = strings.table ? find_slot(strings.table, key, hash)->key : NULL;
+	if (s) {
+		pthread_mutex_unlock(&strings.lock);
+		return s;
+	}
+
+	n = strlen(key) + 1;
+	if (n > STRING_BLOCK / 4) {
+		s = strdup(key);
+	} else {
+		if (n > string_left) {
+			string_block = malloc(STRING_BLOCK);
+			string_left = STRING_BLOCK;
+		}
+		s = memcpy(string_block, key, n);
+		string_block += n;
+		string_left -= n;
 	}
-	return node;
+	store_slot(&strings, s, hash, NULL, NULL);
+
+	pthread_mutex_unlock(&strings.lock);
+	return s;
 }
 
-struct cache *insert(struct cache *node, const char *key, void *value)
+struct cache *new_cache(void)
 {
-	if (node && node != &sentinel) {
-		int c = strcmp(key, node->key);
-		if (c < 0)
-			node->left = insert(node->left, key, value);
-		else
-			node->right = insert(node->right, key, value);
-		node = skew(node);
-		node = split(node);
-		return node;
+	struct cache *cache = malloc(sizeof(struct cache));
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->table = NULL;
+	cache->len = 0;
+	cache->readers = 0;
+	return cache;
+}
+
+void *lookup(struct cache *cache, const char *key)
+{
+	struct table *table;
+	unsigned int hash;
+	void *value = NULL;
+	int i, mask;
+
+	if (!cache)
+		return NULL;
+
+	__atomic_add_fetch(&cache->readers, 1, __ATOMIC_SEQ_CST);
+	table = __atomic_load_n(&cache->table, __ATOMIC_SEQ_CST);
+	if (table) {
+		hash = hash_key(key);
+		mask = table->cap - 1;
+		i = hash & mask;
+		for (;;) {
+			struct slot *slot = table->slots + i;
+			const char *k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+			if (!k)
+				break;
+			if (k != TOMBSTONE && slot->hash == hash && !strcmp(k, key)) {
+				value = __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+				break;
+			}
+			i = (i + 1) & mask;
+		}
 	}
-	return make_node(key, value);
+	__atomic_sub_fetch(&cache->readers, 1, __ATOMIC_RELEASE);
+	return value;
 }
 
-static void print_cache_imp(struct cache *node, int level)
+/* Create the cache up front if more than one thread will insert into it. */
+struct cache *insert(struct cache *cache, const char *key, void *value)
 {
-	int i;
-	if (node->left != &sentinel)
-		print_cache_imp(node->left, level + 1);
-	for (i = 0; i < level; i++)
-		putchar(' ');
-	printf("%s = %p (%d)\n", node->key, node->value, node->level);
-	if (node->right != &sentinel)
-		print_cache_imp(node->right, level + 1);
+	if (!cache)
+		cache = new_cache();
+	pthread_mutex_lock(&cache->lock);
+	store_slot(cache, key, hash_key(key), value, intern);
+	pthread_mutex_unlock(&cache->lock);
+	return cache;
+}
+
+/*
+ * Return the value for key if there is one; otherwise insert value and
+ * return it. The first of several threads asking for the same key gets its
+ * own value back, and knows to do the loading; the others get the first
+ * one's value, typically a placeholder that is filled in when it is done.
+ */
+void *lookup_or_insert(struct cache *cache, const char *key, void *value)
+{
+	unsigned int hash = hash_key(key);
+	struct slot *slot;
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->table) {
+		slot = find_slot(cache->table, key, hash);
+		if (slot->key) {
+			value = slot->value;
+			pthread_mutex_unlock(&cache->lock);
+			return value;
+		}
+	}
+	store_slot(cache, key, hash, value, intern);
+	pthread_mutex_unlock(&cache->lock);
+	return value;
 }
 
-void print_cache(struct cache *root)
+void *remove_from_cache(struct cache *cache, const char *key)
 {
+	struct slot *slot;
+	void *value = NULL;
+
+	if (!cache)
+		return NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->table) {
+		slot = find_slot(cache->table, key, hash_key(key));
+		if (slot->key) {
+			value = slot->value;
+			__atomic_store_n(&slot->value, NULL, __ATOMIC_RELEASE);
+			__atomic_store_n(&slot->key, TOMBSTONE, __ATOMIC_RELEASE);
+			cache->len--;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return value;
+}
+
+void print_cache(struct cache *cache)
+{
+	struct table *table;
+	int i;
 	printf("--- cache dump ---\n");
-	if (root && root != &sentinel)
-		print_cache_imp(root, 0);
+	if (cache) {
+		pthread_mutex_lock(&cache->lock);
+		table = cache->table;
+		for (i = 0; table && i < table->cap; i++)
+			if (table->slots[i].key && table->slots[i].key != TOMBSTONE)
+				printf("%s = %p (%d)\n", table->slots[i].key, table->slots[i].value, i);
+		pthread_mutex_unlock(&cache->lock);
+	}
 	printf("---\n");
 }
+
+/*
+ * Reference counted resources. A resource that nobody holds stays loaded
+ * until the resident size goes over budget; then the least recently
+ * released ones are freed first. Unlike the caches, these are only
+ * touched from the main thread, since freeing them calls OpenGL.
+ */
+
+static TAILQ_HEAD(resource_list, resource) resource_lru = TAILQ_HEAD_INITIALIZER(resource_lru);
+static int resource_count = 0;
+static int resource_bytes = 0;
+static int resource_unused = 0;
+static int resource_budget = 256 << 20;
+
+static void trim_resources(void)
+{
+	struct resource *res;
+	while (resource_bytes > resource_budget && !TAILQ_EMPTY(&resource_lru)) {
+		res = TAILQ_LAST(&resource_lru, resource_list);
+		TAILQ_REMOVE(&resource_lru, res, lru);
+		resource_count--;
+		resource_bytes -= res->size;
+		resource_unused -= res->size;
+		res->free(res);
+	}
+}
+
+void init_resource(struct resource *res, const char *name, int size, void (*destroy)(struct resource *res))
+{
+	res->name = name ? intern(name, hash_key(name)) : NULL;
+	res->refs = 1;
+	res->size = size;
+	res->free = destroy;
+	resource_count++;
+	resource_bytes += size;
+	trim_resources();
+}
+
+void set_resource_size(struct resource *res, int size)
+{
+	resource_bytes += size - res->size;
+	if (res->refs == 0)
+		resource_unused += size - res->size;
+	res->size = size;
+	trim_resources();
+}
+
+void retain_resource(struct resource *res)
+{
+	if (res->refs++ == 0) {
+		TAILQ_REMOVE(&resource_lru, res, lru);
+		resource_unused -= res->size;
+	}
+}
+
+void release_resource(struct resource *res)
+{
+	if (res->refs <= 0) {
+		warn("resource released too many times: '%s'", res->name ? res->name : "(anonymous)");
+		return;
+	}
+	if (--res->refs == 0) {
+		TAILQ_INSERT_HEAD(&resource_lru, res, lru);
+		resource_unused += res->size;
+		trim_resources();
+	}
+}
+
+void set_resource_budget(int bytes)
+{
+	resource_budget = MAX(bytes, 0);
+	trim_resources();
+}
+
+void resource_stats(int *count, int *bytes, int *unused, int *budget)
+{
+	*count = resource_count;
+	*bytes = resource_bytes;
+	*unused = resource_unused;
+	*budget = resource_budget;
+}
@@ -0,0 +1,144 @@
+#include "mio.h"
+
+/*
+ * Split the parts of a static mesh into clusters of nearby triangles, so
+ * the renderer can skip the ones that are off screen or face away from the
+ * camera. The triangles have already been put in vertex cache order, so
+ * consecutive runs of them are compact; a cluster ends when it has used
+ * up its vertex or triangle budget.
+ *
+ * Each cluster has a bounding sphere and a cone that contains all its face
+ * normals. A camera inside the region the cone opens away from sees only
+ * back faces.
+ */
+
+#define MAX_CLUSTER_VERTICES 64
+#define MAX_CLUSTER_TRIANGLES 128
+
+static int clusters_enabled = 1;
+
+void set_mesh_clusters(int enable)
+{
+	clusters_enabled = enable;
+}
+
+static void compute_cluster_bounds(const struct mesh_data *mesh, const struct vertex_attrib *att,
+	const unsigned int *index, struct cluster *c)
+{
+	vec3 lo, hi, p, axis = { 0, 0, 0 };
+	float mindot = 1;
+	int i, k, n = 0;
+
+	vec_init(lo, 0, 0, 0);
+	vec_init(hi, 0, 0, 0);
+	for (i = 0; i < c->count; i++) {
+		get_vertex_position(mesh, att, index[i], p);
+		for (k = 0; k < 3; k++) {
+			if (i == 0 || p[k] < lo[k]) lo[k] = p[k];
+			if (i == 0 || p[k] > hi[k]) hi[k] = p[k];
+		}
+	}
+	vec_average(c->center, lo, hi);
+	c->radius = 0;
+	for (i = 0; i < c->count; i++) {
+		get_vertex_position(mesh, att, index[i], p);
+		c->radius = MAX(c->radius, vec_dist(c->center, p));
+	}
+
+	/* two passes: the mean of the face normals, then the widest angle from it */
+	for (k = 0; k < 2; k++) {
+		for (i = 0; i + 3 <= c->count; i += 3) {
+			vec3 a, b, d, nor;
+			float len;
+			get_vertex_position(mesh, att, index[i], a);
+			get_vertex_position(mesh, att, index[i+1], b);
+			get_vertex_position(mesh, att, index[i+2], d);
+			vec_face_normal(nor, a, b, d);
+			len = vec_length(nor);
+			if (len == 0)
+				continue; /* degenerate */
+			vec_scale(nor, nor, 1 / len);
+			if (k == 0) {
+				vec_add(axis, axis, nor);
+				n++;
+			} else {
+				mindot = MIN(mindot, vec_dot(nor, axis));
+			}
+		}
+		if (k == 0) {
+			if (n == 0 || vec_length(axis) < 1e-6f)
+				break;
+			vec_normalize(axis, axis);
+		}
+	}
+
+	memcpy(c->cone_axis, axis, sizeof(vec3));
+	if (n == 0 || mindot <= 0.1f)
+		c->cone_cutoff = 1;
+	else
+		c->cone_cutoff = sqrtf(1 - mindot * mindot);
+}
+
+static unsigned int get_index(const struct mesh_data *mesh, int i)
+{
+	if (mesh->index_size == 4)
+		return ((const unsigned int*)mesh->index_data)[i];
+	return ((const unsigned short*)mesh->index_data)[i];
+}
+
+void build_mesh_clusters(struct mesh_data *mesh)
+{
+	const struct vertex_attrib *position;
+	unsigned int *stamp, index[MAX_CLUSTER_TRIANGLES * 3];
+	int i, k, cap = 0;
+
+	mesh->cluster_count = 0;
+	mesh->cluster = NULL;
+
+	/* the bounds are for the bind pose, which skinning does not keep */
+	if (!clusters_enabled || mesh->skel)
+		return;
+	position = find_position_attrib(mesh);
+	if (!position)
+		return;
+
+	stamp = calloc(mesh->vertex_count, sizeof *stamp);
+
+	/* only the full detail level is worth culling finely */
+	for (k = 0; k < (mesh->lod_count ? mesh->lod[0].count : mesh->part_count); k++) {
+		int first = mesh->part[k].first;
+		int end = first + mesh->part[k].count / 3 * 3;
+		i = first;
+		while (i < end) {
+			struct cluster *c;
+			int vertex_count = 0;
+
+			if (mesh->cluster_count == cap) {
+				cap = cap ? cap * 2 : 64;
+				mesh->cluster = realloc(mesh->cluster, cap * sizeof *mesh->cluster);
+			}
+			c = mesh->cluster + mesh->cluster_count++;
+			c->first = i;
+			c->count = 0;
+
+			while (i < end && c->count < MAX_CLUSTER_TRIANGLES * 3) {
+				unsigned int a = get_index(mesh, i), b = get_index(mesh, i+1), d = get_index(mesh, i+2);
+				int added = (stamp[a] != mesh->cluster_count) + (stamp[b] != mesh->cluster_count) + (stamp[d] != mesh->cluster_count);
+				if (vertex_count + added > MAX_CLUSTER_VERTICES)
+					break;
+				vertex_count += added;
+				stamp[a] = stamp[b] = stamp[d] = mesh->cluster_count;
+				index[c->count++] = a;
+				index[c->count++] = b;
+				index[c->count++] = d;
+				i += 3;
+			}
+
+			compute_cluster_bounds(mesh, position, index, c);
+			if (mesh->part[k].double_sided)
+				c->cone_cutoff = 1; /* back faces are drawn too */
+		}
+	}
+
+	free(stamp);
+}
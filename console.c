@@ -1,5 +1,9 @@
 #include "mio.h"
 #include <ctype.h>
+#include <pthread.h>
+
+/* warnings can come from worker threads */
+static pthread_mutex_t console_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void warn(const char *fmt, ...)
 {
@@ -42,7 +46,7 @@ static void scrollup(void)
 	tail = 0;
 }
 
-void console_putc(int c)
+static void console_putc_imp(int c)
 {
 	putchar(c);
 	if (c == '\n') {
@@ -53,22 +57,33 @@ void console_putc(int c)
 	} else if (c == '\t') {
 		int n = TABSTOP - (tail % TABSTOP);
 		while (n--)
-			console_putc(' ');
+			console_putc_imp(' ');
 	} else {
 		screen[LAST][tail++] = c;
 	}
 	screen[LAST][tail] = 0;
 }
 
+void console_putc(int c)
+{
+	pthread_mutex_lock(&console_lock);
+	console_putc_imp(c);
+	pthread_mutex_unlock(&console_lock);
+}
+
 void console_print(const char *s)
 {
-	while (*s) console_putc(*s++);
+	pthread_mutex_lock(&console_lock);
+	while (*s) console_putc_imp(*s++);
+	pthread_mutex_unlock(&console_lock);
 }
 
 void console_printnl(const char *s)
 {
-	while (*s) console_putc(*s++);
-	console_putc('\n');
+	pthread_mutex_lock(&console_lock);
+	while (*s) console_putc_imp(*s++);
+	console_putc_imp('\n');
+	pthread_mutex_unlock(&console_lock);
 }
 
 void console_printf(const char *fmt, ...)
@@ -290,10 +305,12 @@ void console_draw(mat4 clip_from_view, mat4 view_from_world, struct font *font,
 
 	y = y0 + ascent;
 
+	pthread_mutex_lock(&console_lock);
 	for (i = 0; i < ROWS; i++) {
 		x = text_show(x0, y, screen[i]);
 		y += cellh;
 	}
+	pthread_mutex_unlock(&console_lock);
 	y -= cellh;
 	x = text_show(x, y, PS1);
 	x = text_show(x, y, input);
@@ -0,0 +1,136 @@
+#include "mio.h"
+
+#include <limits.h>
+
+/*
+ * Generational handles for resources that are held by Lua.
+ *
+ * A handle is a slot index and a generation packed into a pointer-sized
+ * integer: 32 bits of each on 64-bit targets, and 16 on 32-bit ones, where
+ * a light userdata holds no more. Freeing a handle bumps the generation of
+ * its slot, so a stale handle no longer matches and resolves to nothing
+ * instead of to freed memory. The pointers themselves are kept packed in a separate array,
+ * to walk the live resources without skipping holes.
+ */
+
+#define INDEX_BITS (sizeof(uintptr_t) * 4)
+#define INDEX_MASK (((uintptr_t)1 << INDEX_BITS) - 1) /* and of the generation */
+
+struct handle_slot
+{
+	uintptr_t gen;
+	int tag; /* zero when free */
+	int index; /* into the live list, or the next free slot */
+};
+
+static struct handle_slot *slots = NULL;
+static int slot_count = 0, slot_cap = 0;
+static int free_slot = -1;
+
+static void **live_ptr = NULL;
+static int *live_slot = NULL;
+static int live_count = 0, live_cap = 0;
+
+static struct handle_slot *find_handle(uintptr_t handle)
+{
+	uintptr_t i = handle & INDEX_MASK;
+	uintptr_t gen = handle >> INDEX_BITS;
+	if (i >= (uintptr_t)slot_count || slots[i].gen != gen || !slots[i].tag)
+		return NULL;
+	return slots + i;
+}
+
+uintptr_t new_handle(int tag, void *ptr)
+{
+	int i;
+
+	if (free_slot >= 0) {
+		i = free_slot;
+		free_slot = slots[i].index;
+	} else {
+		if ((uintptr_t)slot_count == INDEX_MASK || slot_count == INT_MAX) {
+			warn("error: out of resource handles");
+			return 0;
+		}
+		if (slot_count == slot_cap) {
+			slot_cap = slot_cap ? slot_cap * 2 : 256;
+			slots = realloc(slots, slot_cap * sizeof *slots);
+		}
+		i = slot_count++;
+		slots[i].gen = 1;
+	}
+
+	if (live_count == live_cap) {
+		live_cap = live_cap ? live_cap * 2 : 256;
+		live_ptr = realloc(live_ptr, live_cap * sizeof *live_ptr);
+		live_slot = realloc(live_slot, live_cap * sizeof *live_slot);
+	}
+
+	slots[i].tag = tag;
+	slots[i].index = live_count;
+	live_ptr[live_count] = ptr;
+	live_slot[live_count] = i;
+	live_count++;
+
+	return slots[i].gen << INDEX_BITS | i;
+}
+
+/* Returns the tag of a live handle, or zero for a stale one. */
+int handle_tag(uintptr_t handle)
+{
+	struct handle_slot *slot = find_handle(handle);
+	return slot ? slot->tag : 0;
+}
+
+void *get_handle(uintptr_t handle, int tag)
+{
+	struct handle_slot *slot = find_handle(handle);
+	if (slot && slot->tag == tag)
+		return live_ptr[slot->index];
+	return NULL;
+}
+
+/* Returns the pointer the handle stood for, or NULL if it was stale. */
+void *free_handle(uintptr_t handle, int tag)
+{
+	struct handle_slot *slot = find_handle(handle);
+	void *ptr;
+	int last;
+
+	if (!slot || slot->tag != tag)
+		return NULL;
+
+	ptr = live_ptr[slot->index];
+	last = live_count - 1;
+	live_ptr[slot->index] = live_ptr[last];
+	live_slot[slot->index] = live_slot[last];
+	slots[live_slot[last]].index = slot->index;
+	live_count--;
+
+	slot->gen = (slot->gen + 1) & INDEX_MASK;
+	if (slot->gen == 0)
+		slot->gen = 1;
+	slot->tag = 0;
+	slot->index = free_slot;
+	free_slot = slot - slots;
+
+	return ptr;
+}
+
+/* Point every live handle of old at new instead, as when reloading. */
+void replace_handles(int tag, void *old, void *new)
+{
+	int i;
+	for (i = 0; i < live_count; i++)
+		if (live_ptr[i] == old && slots[live_slot[i]].tag == tag)
+			live_ptr[i] = new;
+}
+
+int live_handles(int tag, void **list, int max)
+{
+	int i, n = 0;
+	for (i = 0; i < live_count; i++)
+		if (slots[live_slot[i]].tag == tag && n < max)
+			list[n++] = live_ptr[i];
+	return n;
+}
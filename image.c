@@ -1,25 +1,82 @@
 #include "mio.h"
 
 #define STBI_NO_HDR
+#define STBI_INFLATE_MALLOC inflate_malloc
+#define STBI_MALLOC(sz) arena_alloc(sz)
+#define STBI_REALLOC(p,sz) arena_realloc(p,sz)
+#define STBI_FREE(p) arena_free(p)
+#define STBI_MALLOC_IMAGE(sz) malloc(sz)
 #include "stb_image.c"
 
 static struct cache *texture_cache = NULL;
 static struct cache *texture_array_cache = NULL;
 
-int make_texture(unsigned char *data, int w, int h, int n, int srgb)
-{
+/*
+ * Loaded textures are reference counted resources. Callers get the GL
+ * texture name, so keep a table from names back to the resources.
+ */
+
+struct texture {
+	struct resource res;
 	unsigned int texid;
+	struct cache **cache;
+};
+
+static struct texture **texture_list = NULL;
+static int texture_list_cap = 0;
+
+static void free_texture(struct resource *res)
+{
+	struct texture *tex = (struct texture*)res;
+	if (lookup(*tex->cache, res->name) == tex)
+		remove_from_cache(*tex->cache, res->name);
+	texture_list[tex->texid] = NULL;
+	glDeleteTextures(1, &tex->texid);
+	free(tex);
+}
+
+static struct texture *add_texture(struct cache **cachep, const char *filename, unsigned int texid, int size)
+{
+	struct texture *tex = malloc(sizeof(struct texture));
+	init_resource(&tex->res, filename, size, free_texture);
+	tex->texid = texid;
+	tex->cache = cachep;
+	if (texid >= texture_list_cap) {
+		int cap = MAX(texid + 1, texture_list_cap * 2);
+		texture_list = realloc(texture_list, cap * sizeof *texture_list);
+		memset(texture_list + texture_list_cap, 0, (cap - texture_list_cap) * sizeof *texture_list);
+		texture_list_cap = cap;
+	}
+	texture_list[texid] = tex;
+	*cachep = insert(*cachep, filename, tex);
+	return tex;
+}
+
+static int find_texture(struct cache *cache, const char *filename)
+{
+	struct texture *tex = lookup(cache, filename);
+	if (tex) {
+		retain_resource(&tex->res);
+		return tex->texid;
+	}
+	return 0;
+}
+
+void release_texture(int texid)
+{
+	if (texid > 0 && texid < texture_list_cap && texture_list[texid])
+		release_resource(&texture_list[texid]->res);
+}
+
+/* Returns the number of bytes used, counting the mipmaps. */
+static int upload_texture(unsigned int texid, unsigned char *data, int w, int h, int n, int srgb)
+{
 	int intfmt, fmt;
 
 	if ((w & (w-1)) || (h & (h-1)))
 		warn("warning: non-power-of-two texture size (%dx%d)!", w, h);
 
-	glGenTextures(1, &texid);
-
 	glBindTexture(GL_TEXTURE_2D, texid);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 
 	if (n == 1) { intfmt = fmt = GL_RED; }
 	if (n == 2) { intfmt = fmt = GL_RG; }
@@ -32,6 +89,27 @@ int make_texture(unsigned char *data, int w, int h, int n, int srgb)
 	if (w > 1 || h > 1)
 		glGenerateMipmap(GL_TEXTURE_2D);
 
+	return w * h * n * 4 / 3;
+}
+
+static unsigned int gen_texture(void)
+{
+	unsigned int texid;
+
+	glGenTextures(1, &texid);
+
+	glBindTexture(GL_TEXTURE_2D, texid);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+
+	return texid;
+}
+
+int make_texture(unsigned char *data, int w, int h, int n, int srgb)
+{
+	unsigned int texid = gen_texture();
+	upload_texture(texid, data, w, h, n, srgb);
 	return texid;
 }
 
@@ -44,16 +122,16 @@ static int make_white_texture(void)
 	return white_texture;
 }
 
-static inline int getint(unsigned char *p)
+static inline int getint(const unsigned char *p)
 {
 	return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
 }
 
-static int load_dds_from_memory(char *filename, unsigned char *data, int srgb)
+static int parse_dds_header(char *filename, const unsigned char *data, int srgb,
+	int *wp, int *hp, int *mipsp, int *bsp, int *fmtp)
 {
-	unsigned int texid;
-	int h, w, mips, flags, size, bs, fmt, i;
-	unsigned char *four;
+	int h, w, mips, flags, bs, fmt;
+	const unsigned char *four;
 
 	if (memcmp(data, "DDS ", 4) || getint(data + 4) != 124) {
 		warn("error: not a DDS texture: '%s'", filename);
@@ -62,7 +140,7 @@ static int load_dds_from_memory(char *filename, unsigned char *data, int srgb)
 
 	h = getint(data + 3*4);
 	w = getint(data + 4*4);
-	mips = getint(data + 7*4);
+	mips = MAX(getint(data + 7*4), 1);
 
 	if ((w & (w-1)) || (h & (h-1)))
 		warn("warning: non-power-of-two DDS texture size (%dx%d): '%s'", w, h, filename);
@@ -105,69 +183,234 @@ static int load_dds_from_memory(char *filename, unsigned char *data, int srgb)
 		return 0;
 	}
 
-	glGenTextures(1, &texid);
+	*wp = w;
+	*hp = h;
+	*mipsp = mips;
+	*bsp = bs;
+	*fmtp = fmt;
+	return 1;
+}
+
+/* Returns the number of bytes used, or 0 on failure. */
+static int upload_dds(unsigned int texid, char *filename, const unsigned char *data, int srgb)
+{
+	int h, w, mips, size, bs, fmt, i, total = 0;
+
+	if (!parse_dds_header(filename, data, srgb, &w, &h, &mips, &bs, &fmt))
+		return 0;
 
 	glBindTexture(GL_TEXTURE_2D, texid);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 4);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 
 	size = MAX(4, w) / 4 * MAX(4, h) / 4 * bs;
 	data = data + 128;
 	for (i = 0; i < mips; i++) {
 		glCompressedTexImage2D(GL_TEXTURE_2D, i, fmt, w, h, 0, size, data);
 		data += size;
+		total += size;
 		w = (w + 1) >> 1;
 		h = (h + 1) >> 1;
 		size = MAX(4, w) / 4 * MAX(4, h) / 4 * bs;
 	}
 
+	return total;
+}
+
+static int load_dds_from_memory(char *filename, const unsigned char *data, int srgb, int *sizep)
+{
+	unsigned int texid = gen_texture();
+	*sizep = upload_dds(texid, filename, data, srgb);
+	if (!*sizep) {
+		glDeleteTextures(1, &texid);
+		return 0;
+	}
 	return texid;
 }
 
-static int load_texture_from_memory(char *filename, unsigned char *data, int len, int srgb)
+static int load_texture_from_memory(char *filename, const unsigned char *data, int len, int srgb, int *sizep)
 {
 	unsigned int texid;
 	unsigned char *image;
 	int w, h, n;
 
 	if (!memcmp(data, "DDS ", 4))
-		return load_dds_from_memory(filename, data, srgb);
+		return load_dds_from_memory(filename, data, srgb, sizep);
 
+	arena_begin();
 	image = stbi_load_from_memory(data, len, &w, &h, &n, 0);
 	if (!image) {
 		warn("error: cannot decode image '%s': %s", filename, stbi_failure_reason());
+		arena_end();
 		return 0;
 	}
-	texid = make_texture(image, w, h, n, srgb);
-	free(image);
+	texid = gen_texture();
+	*sizep = upload_texture(texid, image, w, h, n, srgb);
+	stbi_image_free(image);
+	arena_end();
+	return texid;
+}
+
+/* Read one mip level at a time, so the whole file is never in memory. */
+static int load_dds_from_stream(char *filename, struct vfs_stream *stm, int srgb, int *sizep)
+{
+	unsigned char header[128], *buf;
+	unsigned int texid;
+	int h, w, mips, size, bs, fmt, i;
+
+	if (vfs_read(stm, header, 128) != 128) {
+		warn("error: cannot read DDS header: '%s'", filename);
+		return 0;
+	}
+
+	if (!parse_dds_header(filename, header, srgb, &w, &h, &mips, &bs, &fmt))
+		return 0;
+
+	texid = gen_texture();
+	glBindTexture(GL_TEXTURE_2D, texid);
+
+	*sizep = 0;
+	size = MAX(4, w) / 4 * MAX(4, h) / 4 * bs;
+	buf = malloc(size);
+	for (i = 0; i < mips; i++) {
+		if (vfs_read(stm, buf, size) != size) {
+			warn("error: truncated DDS texture: '%s'", filename);
+			glDeleteTextures(1, &texid);
+			texid = 0;
+			break;
+		}
+		glCompressedTexImage2D(GL_TEXTURE_2D, i, fmt, w, h, 0, size, buf);
+		*sizep += size;
+		w = (w + 1) >> 1;
+		h = (h + 1) >> 1;
+		size = MAX(4, w) / 4 * MAX(4, h) / 4 * bs;
+	}
+	free(buf);
+
 	return texid;
 }
 
 int load_texture(char *filename, int srgb)
 {
 	intptr_t texid;
-	unsigned char *data;
-	int len;
+	const unsigned char *data;
+	struct vfs_stream *stm;
+	const char *suffix;
+	int len, size = 0;
 
-	texid = (intptr_t) lookup(texture_cache, filename);
+	texid = find_texture(texture_cache, filename);
 	if (texid)
 		return texid;
 
-	data = load_file(filename, &len);
+	/* go by the name, so each file is opened once; DDS data under another name still loads from memory */
+	suffix = strrchr(filename, '.');
+	if (suffix && (!strcmp(suffix, ".dds") || !strcmp(suffix, ".DDS"))) {
+		stm = vfs_open(filename);
+		if (stm) {
+			texid = load_dds_from_stream(filename, stm, srgb, &size);
+			vfs_close(stm);
+		} else {
+			warn("error: cannot load image file: '%s'", filename);
+		}
+		if (texid)
+			add_texture(&texture_cache, filename, texid, size);
+		return texid ? texid : srgb ? make_white_texture() : 0;
+	}
+
+	data = load_file_view(filename, &len);
 	if (data) {
-		texid = load_texture_from_memory(filename, data, len, srgb);
-		free(data);
+		texid = load_texture_from_memory(filename, data, len, srgb, &size);
+		release_file_view(data);
 	} else {
 		warn("error: cannot load image file: '%s'", filename);
 	}
 
 	if (texid)
-		texture_cache = insert(texture_cache, filename, (void*)texid);
+		add_texture(&texture_cache, filename, texid, size);
 
 	return texid ? texid : srgb ? make_white_texture() : 0;
 }
 
+/*
+ * Asynchronous texture loading. The texture object is created right away
+ * with a single white pixel, and replaced with the real image once it has
+ * been decoded on a worker thread.
+ */
+
+struct texture_job {
+	char *filename;
+	int srgb;
+	struct texture *texture;
+	unsigned int texid;
+	const unsigned char *data;
+	unsigned char *image;
+	int w, h, n;
+};
+
+static void decode_texture_job(void *arg)
+{
+	struct texture_job *job = arg;
+	int len;
+
+	job->data = load_file_view(job->filename, &len);
+	if (!job->data) {
+		warn("error: cannot load image file: '%s'", job->filename);
+		return;
+	}
+
+	if (len >= 4 && !memcmp(job->data, "DDS ", 4))
+		return;
+
+	/* the pixels are malloced, so they outlive the scope until the upload */
+	arena_begin();
+	job->image = stbi_load_from_memory(job->data, len, &job->w, &job->h, &job->n, 0);
+	if (!job->image)
+		warn("error: cannot decode image '%s': %s", job->filename, stbi_failure_reason());
+	arena_end();
+	release_file_view(job->data);
+	job->data = NULL;
+}
+
+static void upload_texture_job(void *arg)
+{
+	struct texture_job *job = arg;
+	int size = 0;
+	if (job->image)
+		size = upload_texture(job->texid, job->image, job->w, job->h, job->n, job->srgb);
+	else if (job->data)
+		size = upload_dds(job->texid, job->filename, job->data, job->srgb);
+	if (size)
+		set_resource_size(&job->texture->res, size);
+	release_resource(&job->texture->res);
+	release_file_view(job->data);
+	free(job->image);
+	free(job->filename);
+	free(job);
+}
+
+int load_texture_async(char *filename, int srgb)
+{
+	static unsigned char white_pixel[4] = { 255, 255, 255, 255 };
+	struct texture_job *job;
+	intptr_t texid;
+
+	texid = find_texture(texture_cache, filename);
+	if (texid)
+		return texid;
+
+	job = malloc(sizeof(struct texture_job));
+	texid = make_texture(white_pixel, 1, 1, 4, srgb);
+	job->texture = add_texture(&texture_cache, filename, texid, 4);
+	retain_resource(&job->texture->res); /* until the upload */
+
+	job->filename = strdup(filename);
+	job->srgb = srgb;
+	job->texid = texid;
+	job->data = NULL;
+	job->image = NULL;
+	queue_job(decode_texture_job, upload_texture_job, job);
+
+	return texid;
+}
+
 /*
  * Texture arrays. Load and slice a tall image into a GL_TEXTURE_2D_ARRAY.
  * Each slice is square, the number of slices determined by image h/w.
@@ -203,31 +446,36 @@ int make_texture_array(unsigned char *data, int w, int h, int d, int n, int srgb
 	return texid;
 }
 
-static int load_texture_array_from_memory(char *filename, unsigned char *data, int len, int srgb, int *d)
+static int load_texture_array_from_memory(char *filename, const unsigned char *data, int len, int srgb, int *d)
 {
 	unsigned int texid;
 	unsigned char *image;
 	int w, h, n;
 
+	arena_begin();
 	image = stbi_load_from_memory(data, len, &w, &h, &n, 0);
 	if (!image) {
 		warn("error: cannot decode image '%s': %s", filename, stbi_failure_reason());
+		arena_end();
 		return 0;
 	}
 	if (d)
 		*d = h / w;
 	texid = make_texture_array(image, w, w, h / w, n, srgb);
-	free(image);
+	stbi_image_free(image);
+	arena_end();
+	if (texid)
+		add_texture(&texture_array_cache, filename, texid, w * h * n * 4 / 3);
 	return texid;
 }
 
 int load_texture_array(char *filename, int srgb, int *d)
 {
 	intptr_t texid;
-	unsigned char *data;
+	const unsigned char *data;
 	int len;
 
-	texid = (intptr_t) lookup(texture_array_cache, filename);
+	texid = find_texture(texture_array_cache, filename);
 	if (texid) {
 		glBindTexture(GL_TEXTURE_2D_ARRAY, texid);
 		if (d)
@@ -237,13 +485,10 @@ int load_texture_array(char *filename, int srgb, int *d)
 
 	printf("loading texture array '%s'", filename);
 
-	data = load_file(filename, &len);
+	data = load_file_view(filename, &len);
 	if (!data) return 0;
 	texid = load_texture_array_from_memory(filename, data, len, srgb, d);
-	free(data);
-
-	if (texid)
-		texture_array_cache = insert(texture_array_cache, filename, (void*)texid);
+	release_file_view(data);
 
 	return texid;
 }
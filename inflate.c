@@ -0,0 +1,642 @@
+/*
+ * Table driven inflate (RFC 1951) and CRC-32.
+ *
+ * The whole compressed stream must be in memory, but output can be
+ * produced in pieces: when the output buffer is full the decoder saves
+ * its state and returns, and can be resumed with a larger buffer.
+ * Back references are resolved against the start of the output buffer.
+ *
+ * Huffman codes up to LIT_BITS long are decoded with a single table
+ * lookup. Where two short literal codes fit in the table index together,
+ * the entry holds both literals. Longer codes fall back to a canonical
+ * bit-by-bit decoder.
+ */
+
+#include "mio.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define LIT_BITS 11
+#define DIST_BITS 8
+#define CODE_BITS 7
+
+enum { BLOCK, STORED, HUFFMAN, DONE };
+
+/* table entries: bits consumed, kind, aux (extra bits or length of first literal), value */
+enum { SLOW, LIT, LIT2, LEN, EOB, DIST, SYM, BAD };
+
+#define ENTRY(len, kind, aux, value) ((len) | (kind) << 8 | (aux) << 12 | (value) << 16)
+#define E_LEN(e) ((e) & 0xff)
+#define E_KIND(e) (((e) >> 8) & 0xf)
+#define E_AUX(e) (((e) >> 12) & 0xf)
+#define E_VALUE(e) ((e) >> 16)
+
+static const unsigned short length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const unsigned char length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const unsigned short dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const unsigned char dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+struct huffman {
+	unsigned short count[16];
+	unsigned short symbol[288];
+};
+
+struct inflate {
+	const unsigned char *in, *in_end;
+	uint64_t bits;
+	int nbits, overrun;
+	int state, final;
+	int left, dist; /* bytes left in stored block, or of a pending match */
+	struct huffman lit, dist_huff;
+	unsigned int lit_table[1 << LIT_BITS];
+	unsigned int dist_table[1 << DIST_BITS];
+};
+
+static inline uint64_t getlonglong(const unsigned char *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+		(uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+/*
+ * Top up the bit buffer to at least 56 bits. Past the end of the input we
+ * shift in zero bytes and count them, so truncated streams can be caught
+ * without checking the input pointer for every symbol.
+ */
+#define REFILL() \
+	if (in_end - in >= 8) { \
+		bits |= getlonglong(in) << nbits; \
+		in += (63 - nbits) >> 3; \
+		nbits |= 56; \
+	} else { \
+		while (nbits <= 56) { \
+			if (in < in_end) bits |= (uint64_t)*in++ << nbits; \
+			else overrun++; \
+			nbits += 8; \
+		} \
+	}
+
+#define CONSUME(n) (bits >>= (n), nbits -= (n))
+
+#define LOAD() \
+	const unsigned char *in = z->in, *in_end = z->in_end; \
+	uint64_t bits = z->bits; \
+	int nbits = z->nbits, overrun = z->overrun
+
+#define SAVE() \
+	(z->in = in, z->bits = bits, z->nbits = nbits, z->overrun = overrun)
+
+static void fill_bits(struct inflate *z)
+{
+	LOAD();
+	REFILL();
+	SAVE();
+}
+
+static int getbits(struct inflate *z, int n)
+{
+	int v;
+	LOAD();
+	if (nbits < n) { REFILL(); }
+	v = bits & ((1 << n) - 1);
+	CONSUME(n);
+	SAVE();
+	return v;
+}
+
+static inline int truncated(struct inflate *z)
+{
+	return z->overrun * 8 > z->nbits;
+}
+
+static unsigned int make_entry(int kind, int sym, int len)
+{
+	if (kind == LIT) {
+		if (sym < 256) return ENTRY(len, LIT, 0, sym);
+		if (sym == 256) return ENTRY(len, EOB, 0, 0);
+		if (sym < 286) return ENTRY(len, LEN, length_extra[sym-257], length_base[sym-257]);
+		return ENTRY(len, BAD, 0, 0);
+	}
+	if (kind == DIST) {
+		if (sym < 30) return ENTRY(len, DIST, dist_extra[sym], dist_base[sym]);
+		return ENTRY(len, BAD, 0, 0);
+	}
+	return ENTRY(len, SYM, 0, sym);
+}
+
+static inline int reverse_bits(int code, int len)
+{
+	int r = 0;
+	while (len--) {
+		r = (r << 1) | (code & 1);
+		code >>= 1;
+	}
+	return r;
+}
+
+static int build_huffman(struct huffman *h, unsigned int *table, int tbits,
+	const unsigned char *lens, int n, int kind)
+{
+	int offs[16];
+	int i, j, k, len, code, left;
+	unsigned int e;
+
+	memset(h->count, 0, sizeof h->count);
+	for (i = 0; i < n; i++)
+		h->count[lens[i]]++;
+	h->count[0] = 0;
+
+	left = 1;
+	for (len = 1; len < 16; len++) {
+		left = (left << 1) - h->count[len];
+		if (left < 0)
+			return -1; /* over-subscribed */
+	}
+
+	offs[1] = 0;
+	for (len = 1; len < 15; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (i = 0; i < n; i++)
+		if (lens[i])
+			h->symbol[offs[lens[i]]++] = i;
+
+	/* unfilled entries are SLOW: long codes, or invalid bits of an incomplete code */
+	memset(table, 0, sizeof(unsigned int) << tbits);
+	code = k = 0;
+	for (len = 1; len <= tbits; len++) {
+		for (i = 0; i < h->count[len]; i++, k++, code++) {
+			e = make_entry(kind, h->symbol[k], len);
+			for (j = reverse_bits(code, len); j < 1 << tbits; j += 1 << len)
+				table[j] = e;
+		}
+		code <<= 1;
+	}
+
+	/* pair up literals whose codes fit in the table index together */
+	if (kind == LIT) {
+		for (i = (1 << tbits) - 1; i >= 0; i--) {
+			unsigned int a = table[i], b;
+			if (E_KIND(a) != LIT || E_LEN(a) >= tbits)
+				continue;
+			b = table[i >> E_LEN(a)];
+			if (E_KIND(b) == LIT && E_LEN(a) + E_LEN(b) <= tbits)
+				table[i] = ENTRY(E_LEN(a) + E_LEN(b), LIT2, E_LEN(a),
+					E_VALUE(a) | E_VALUE(b) << 8);
+		}
+	}
+
+	return 0;
+}
+
+/* canonical decode one bit at a time, for codes longer than the table */
+static int decode_slow(struct huffman *h, uint64_t bits, int *lenp)
+{
+	int len, code = 0, first = 0, index = 0, count;
+	for (len = 1; len < 16; len++) {
+		code |= bits & 1;
+		bits >>= 1;
+		count = h->count[len];
+		if (code - first < count) {
+			*lenp = len;
+			return h->symbol[index + code - first];
+		}
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+static int read_fixed(struct inflate *z)
+{
+	unsigned char lens[288 + 32];
+	int i;
+	for (i = 0; i < 144; i++) lens[i] = 8;
+	for (; i < 256; i++) lens[i] = 9;
+	for (; i < 280; i++) lens[i] = 7;
+	for (; i < 288; i++) lens[i] = 8;
+	for (i = 0; i < 32; i++) lens[288 + i] = 5;
+	build_huffman(&z->lit, z->lit_table, LIT_BITS, lens, 288, LIT);
+	build_huffman(&z->dist_huff, z->dist_table, DIST_BITS, lens + 288, 32, DIST);
+	return 0;
+}
+
+static int read_dynamic(struct inflate *z)
+{
+	static const unsigned char order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+	};
+	unsigned char lens[286 + 30], clens[19];
+	unsigned int code_table[1 << CODE_BITS];
+	struct huffman code_huff;
+	int nlen, ndist, ncode;
+	int i, sym, len, rep;
+	unsigned int e;
+
+	nlen = getbits(z, 5) + 257;
+	ndist = getbits(z, 5) + 1;
+	ncode = getbits(z, 4) + 4;
+	if (nlen > 286 || ndist > 30)
+		return -1;
+
+	memset(clens, 0, sizeof clens);
+	for (i = 0; i < ncode; i++)
+		clens[order[i]] = getbits(z, 3);
+	if (build_huffman(&code_huff, code_table, CODE_BITS, clens, 19, SYM))
+		return -1;
+
+	i = 0;
+	while (i < nlen + ndist) {
+		if (z->nbits < CODE_BITS)
+			fill_bits(z);
+		e = code_table[z->bits & ((1 << CODE_BITS) - 1)];
+		if (E_KIND(e) != SYM)
+			return -1;
+		z->bits >>= E_LEN(e);
+		z->nbits -= E_LEN(e);
+		sym = E_VALUE(e);
+		if (sym < 16) {
+			lens[i++] = sym;
+			continue;
+		}
+		if (sym == 16) {
+			if (i == 0)
+				return -1;
+			len = lens[i - 1];
+			rep = 3 + getbits(z, 2);
+		} else if (sym == 17) {
+			len = 0;
+			rep = 3 + getbits(z, 3);
+		} else {
+			len = 0;
+			rep = 11 + getbits(z, 7);
+		}
+		if (i + rep > nlen + ndist)
+			return -1;
+		memset(lens + i, len, rep);
+		i += rep;
+	}
+
+	if (lens[256] == 0)
+		return -1;
+	if (build_huffman(&z->lit, z->lit_table, LIT_BITS, lens, nlen, LIT))
+		return -1;
+	if (build_huffman(&z->dist_huff, z->dist_table, DIST_BITS, lens + nlen, ndist, DIST))
+		return -1;
+	return 0;
+}
+
+static int read_stored(struct inflate *z)
+{
+	int len, nlen, back;
+
+	/* return whole bytes in the bit buffer to the input */
+	back = (z->nbits >> 3) - z->overrun;
+	if (back < 0)
+		return -1;
+	z->in -= back;
+	z->bits = 0;
+	z->nbits = 0;
+	z->overrun = 0;
+
+	if (z->in_end - z->in < 4)
+		return -1;
+	len = z->in[0] | z->in[1] << 8;
+	nlen = z->in[2] | z->in[3] << 8;
+	if (len != (~nlen & 0xffff))
+		return -1;
+	z->in += 4;
+	z->left = len;
+	return 0;
+}
+
+static int read_block(struct inflate *z)
+{
+	int type;
+	if (z->final) {
+		z->state = DONE;
+		return 0;
+	}
+	z->final = getbits(z, 1);
+	type = getbits(z, 2);
+	switch (type) {
+	case 0:
+		z->state = STORED;
+		return read_stored(z);
+	case 1:
+		z->state = HUFFMAN;
+		return read_fixed(z);
+	case 2:
+		z->state = HUFFMAN;
+		return read_dynamic(z);
+	}
+	return -1;
+}
+
+static int inflate_stored(struct inflate *z, unsigned char *out, int *posp, int size)
+{
+	int n = MIN(z->left, size - *posp);
+	if (z->in_end - z->in < n)
+		return INFLATE_ERROR;
+	memcpy(out + *posp, z->in, n);
+	z->in += n;
+	z->left -= n;
+	*posp += n;
+	if (z->left > 0)
+		return INFLATE_FULL;
+	z->state = BLOCK;
+	return INFLATE_DONE;
+}
+
+static inline int copy_match(unsigned char *out, int pos, int size, int len, int dist)
+{
+	unsigned char *dst = out + pos;
+	const unsigned char *src = dst - dist;
+	unsigned char *end;
+
+	if (len > size - pos)
+		len = size - pos;
+	end = dst + len;
+
+	if (dist >= 8 && size - pos >= len + 8) {
+		/* may write up to 7 bytes past the match; they are overwritten later */
+		do {
+			memcpy(dst, src, 8);
+			dst += 8;
+			src += 8;
+		} while (dst < end);
+	} else if (dist == 1) {
+		memset(dst, *src, len);
+	} else {
+		while (dst < end)
+			*dst++ = *src++;
+	}
+
+	return len;
+}
+
+static int inflate_huffman(struct inflate *z, unsigned char *out, int *posp, int size)
+{
+	const unsigned int *lit_table = z->lit_table;
+	const unsigned int *dist_table = z->dist_table;
+	int pos = *posp;
+	int len, dist, n, sym, slen;
+	unsigned int e;
+	LOAD();
+
+	/* finish a match that did not fit last time */
+	if (z->left > 0) {
+		n = copy_match(out, pos, size, z->left, z->dist);
+		pos += n;
+		z->left -= n;
+		if (z->left > 0)
+			goto full;
+	}
+
+	for (;;) {
+		REFILL();
+
+		e = lit_table[bits & ((1 << LIT_BITS) - 1)];
+		if (E_KIND(e) == SLOW) {
+			sym = decode_slow(&z->lit, bits, &slen);
+			if (sym < 0)
+				goto error;
+			e = make_entry(LIT, sym, slen);
+		}
+
+		switch (E_KIND(e)) {
+		case LIT2:
+			if (size - pos >= 2) {
+				out[pos++] = E_VALUE(e);
+				out[pos++] = E_VALUE(e) >> 8;
+				CONSUME(E_LEN(e));
+				break;
+			}
+			e = ENTRY(E_AUX(e), LIT, 0, E_VALUE(e) & 0xff);
+			/* fall through */
+		case LIT:
+			if (pos >= size)
+				goto full;
+			out[pos++] = E_VALUE(e);
+			CONSUME(E_LEN(e));
+			break;
+
+		case EOB:
+			CONSUME(E_LEN(e));
+			z->state = BLOCK;
+			goto done;
+
+		case LEN:
+			CONSUME(E_LEN(e));
+			len = E_VALUE(e) + (bits & ((1 << E_AUX(e)) - 1));
+			CONSUME(E_AUX(e));
+
+			e = dist_table[bits & ((1 << DIST_BITS) - 1)];
+			if (E_KIND(e) == SLOW) {
+				sym = decode_slow(&z->dist_huff, bits, &slen);
+				if (sym < 0)
+					goto error;
+				e = make_entry(DIST, sym, slen);
+			}
+			if (E_KIND(e) != DIST)
+				goto error;
+			CONSUME(E_LEN(e));
+			dist = E_VALUE(e) + (bits & ((1 << E_AUX(e)) - 1));
+			CONSUME(E_AUX(e));
+
+			if (dist > pos)
+				goto error;
+			n = copy_match(out, pos, size, len, dist);
+			pos += n;
+			if (n < len) {
+				z->left = len - n;
+				z->dist = dist;
+				goto full;
+			}
+			break;
+
+		default:
+			goto error;
+		}
+	}
+
+done:
+	SAVE();
+	*posp = pos;
+	return truncated(z) ? INFLATE_ERROR : INFLATE_DONE;
+full:
+	SAVE();
+	*posp = pos;
+	return truncated(z) ? INFLATE_ERROR : INFLATE_FULL;
+error:
+	SAVE();
+	*posp = pos;
+	return INFLATE_ERROR;
+}
+
+static void init_inflate(struct inflate *z, const unsigned char *in, int inlen)
+{
+	z->in = in;
+	z->in_end = in + inlen;
+	z->bits = 0;
+	z->nbits = 0;
+	z->overrun = 0;
+	z->state = BLOCK;
+	z->final = 0;
+	z->left = 0;
+	z->dist = 0;
+}
+
+struct inflate *new_inflate(const unsigned char *in, int inlen)
+{
+	struct inflate *z = malloc(sizeof *z);
+	init_inflate(z, in, inlen);
+	return z;
+}
+
+void free_inflate(struct inflate *z)
+{
+	free(z);
+}
+
+/*
+ * Decode into out[*posp..size), advancing *posp. Back references may
+ * reach before *posp, so a caller that reuses a window must keep the
+ * last 32K of output in front of it.
+ * Returns INFLATE_DONE, INFLATE_FULL or INFLATE_ERROR.
+ */
+int run_inflate(struct inflate *z, unsigned char *out, int *posp, int size)
+{
+	int status;
+	for (;;) {
+		switch (z->state) {
+		case BLOCK:
+			if (read_block(z) || truncated(z))
+				return INFLATE_ERROR;
+			break;
+		case STORED:
+			status = inflate_stored(z, out, posp, size);
+			if (status != INFLATE_DONE)
+				return status;
+			break;
+		case HUFFMAN:
+			status = inflate_huffman(z, out, posp, size);
+			if (status != INFLATE_DONE)
+				return status;
+			break;
+		case DONE:
+			return INFLATE_DONE;
+		}
+	}
+}
+
+int inflate_buffer(unsigned char *out, int outlen, const unsigned char *in, int inlen)
+{
+	struct inflate *z = new_inflate(in, inlen);
+	int pos = 0, status;
+	status = run_inflate(z, out, &pos, outlen);
+	free_inflate(z);
+	return status == INFLATE_DONE ? pos : -1;
+}
+
+unsigned char *inflate_malloc(const unsigned char *in, int inlen, int initial_size, int *outlenp, int zlib_header)
+{
+	struct inflate *z;
+	unsigned char *out, *p;
+	int pos = 0, size = MAX(initial_size, 1024), status;
+
+	if (zlib_header) {
+		/* deflate, no preset dictionary; the adler-32 trailer is not checked */
+		if (inlen < 2 || (in[0] & 15) != 8 || (in[0] << 8 | in[1]) % 31 != 0 || (in[1] & 32))
+			return NULL;
+		in += 2;
+		inlen -= 2;
+	}
+
+	z = new_inflate(in, inlen);
+	out = malloc(size);
+	while ((status = run_inflate(z, out, &pos, size)) == INFLATE_FULL) {
+		size *= 2;
+		p = realloc(out, size);
+		if (!p) {
+			status = INFLATE_ERROR;
+			break;
+		}
+		out = p;
+	}
+	free_inflate(z);
+
+	if (status != INFLATE_DONE) {
+		free(out);
+		return NULL;
+	}
+	if (outlenp)
+		*outlenp = pos;
+	return out;
+}
+
+/* CRC-32 (IEEE 802.3), slicing-by-8 */
+
+static unsigned int crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table(void)
+{
+	unsigned int c;
+	int i, k;
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		c = crc_table[0][i];
+		for (k = 1; k < 8; k++) {
+			c = crc_table[0][c & 0xff] ^ (c >> 8);
+			crc_table[k][i] = c;
+		}
+	}
+}
+
+unsigned int update_crc32(unsigned int crc, const unsigned char *p, int n)
+{
+	unsigned int a, b;
+
+	pthread_once(&crc_once, init_crc_table);
+
+	crc = ~crc;
+	while (n > 0 && ((uintptr_t)p & 7)) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		n--;
+	}
+	while (n >= 8) {
+		a = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24);
+		b = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int)p[7] << 24;
+		crc = crc_table[7][a & 0xff] ^ crc_table[6][(a >> 8) & 0xff] ^
+			crc_table[5][(a >> 16) & 0xff] ^ crc_table[4][a >> 24] ^
+			crc_table[3][b & 0xff] ^ crc_table[2][(b >> 8) & 0xff] ^
+			crc_table[1][(b >> 16) & 0xff] ^ crc_table[0][b >> 24];
+		p += 8;
+		n -= 8;
+	}
+	while (n-- > 0)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
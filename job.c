@@ -0,0 +1,213 @@
+/*
+ * A small pool of worker threads for loading resources in the background.
+ *
+ * Each job has a 'run' function that is called on a worker thread, and
+ * a 'finish' function that is called later on the main thread from
+ * run_finished_jobs. Only the finish function may call OpenGL.
+ */
+
+#include "mio.h"
+
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define MAXWORKER 16
+
+struct job {
+	void (*run)(void *arg);
+	void (*finish)(void *arg);
+	void *arg;
+	SIMPLEQ_ENTRY(job) list;
+};
+
+/* a slice of the work of run_parallel */
+struct task {
+	void (*fn)(void *arg, int i);
+	void *arg;
+	int i;
+	int *remaining; /* of the slices of its run_parallel call */
+	SIMPLEQ_ENTRY(task) list;
+};
+
+static SIMPLEQ_HEAD(job_list, job) todo_list = SIMPLEQ_HEAD_INITIALIZER(todo_list);
+static struct job_list done_list = SIMPLEQ_HEAD_INITIALIZER(done_list);
+static SIMPLEQ_HEAD(task_list, task) task_list = SIMPLEQ_HEAD_INITIALIZER(task_list);
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t worker[MAXWORKER];
+static int worker_count = 0;
+static int pending_count = 0;
+
+/* Run a queued task; called and returns with job_lock held. */
+static void run_task(void)
+{
+	struct task *task = SIMPLEQ_FIRST(&task_list);
+	SIMPLEQ_REMOVE_HEAD(&task_list, list);
+	pthread_mutex_unlock(&job_lock);
+
+	task->fn(task->arg, task->i);
+
+	pthread_mutex_lock(&job_lock);
+	if (--*task->remaining == 0)
+		pthread_cond_broadcast(&task_cond);
+}
+
+static void *worker_main(void *unused)
+{
+	struct job *job;
+	for (;;) {
+		pthread_mutex_lock(&job_lock);
+		while (SIMPLEQ_EMPTY(&todo_list) && SIMPLEQ_EMPTY(&task_list))
+			pthread_cond_wait(&job_cond, &job_lock);
+		/* tasks first, since a job is waiting for them */
+		if (!SIMPLEQ_EMPTY(&task_list)) {
+			run_task();
+			pthread_mutex_unlock(&job_lock);
+			continue;
+		}
+		job = SIMPLEQ_FIRST(&todo_list);
+		SIMPLEQ_REMOVE_HEAD(&todo_list, list);
+		pthread_mutex_unlock(&job_lock);
+
+		job->run(job->arg);
+
+		pthread_mutex_lock(&job_lock);
+		SIMPLEQ_INSERT_TAIL(&done_list, job, list);
+		pthread_cond_signal(&done_cond);
+		pthread_mutex_unlock(&job_lock);
+	}
+	return NULL;
+}
+
+int count_processors(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+static void init_workers(void)
+{
+	int i, n = CLAMP(count_processors() - 1, 1, MAXWORKER);
+	for (i = 0; i < n; i++)
+		if (!pthread_create(&worker[worker_count], NULL, worker_main, NULL))
+			worker_count++;
+}
+
+void queue_job(void (*run)(void *arg), void (*finish)(void *arg), void *arg)
+{
+	struct job *job = malloc(sizeof(struct job));
+	job->run = run;
+	job->finish = finish;
+	job->arg = arg;
+
+	if (!worker_count)
+		init_workers();
+
+	pending_count++;
+
+	pthread_mutex_lock(&job_lock);
+	SIMPLEQ_INSERT_TAIL(&todo_list, job, list);
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+}
+
+/*
+ * Call fn(arg, i) for each i below count, and wait for all of them. This
+ * is for splitting up one large piece of work. The slices go to the
+ * worker pool ahead of queued jobs, and the caller works through them
+ * too, so it is safe to call from inside a job even when every worker is
+ * busy.
+ */
+void run_parallel(void (*fn)(void *arg, int i), void *arg, int count)
+{
+	struct task task[MAXWORKER];
+	int i, n, base, remaining;
+
+	if (count <= 0)
+		return;
+
+	if (!worker_count)
+		init_workers();
+
+	/* at most MAXWORKER slices are queued at a time */
+	for (base = 0; base < count; base += n) {
+		n = MIN(count - base, MAXWORKER);
+
+		pthread_mutex_lock(&job_lock);
+		remaining = n - 1;
+		for (i = 1; i < n; i++) {
+			task[i].fn = fn;
+			task[i].arg = arg;
+			task[i].i = base + i;
+			task[i].remaining = &remaining;
+			SIMPLEQ_INSERT_TAIL(&task_list, &task[i], list);
+		}
+		pthread_cond_broadcast(&job_cond);
+		pthread_mutex_unlock(&job_lock);
+
+		fn(arg, base);
+
+		pthread_mutex_lock(&job_lock);
+		while (remaining > 0) {
+			if (!SIMPLEQ_EMPTY(&task_list))
+				run_task();
+			else
+				pthread_cond_wait(&task_cond, &job_lock);
+		}
+		pthread_mutex_unlock(&job_lock);
+	}
+}
+
+int pending_jobs(void)
+{
+	return pending_count;
+}
+
+/* Block until a job has finished, if any are pending, and finish it. */
+void wait_for_jobs(void)
+{
+	pthread_mutex_lock(&job_lock);
+	while (pending_count && SIMPLEQ_EMPTY(&done_list))
+		pthread_cond_wait(&done_cond, &job_lock);
+	pthread_mutex_unlock(&job_lock);
+	run_finished_jobs(0);
+}
+
+/* Call finish functions for completed jobs until 'budget' milliseconds have passed. */
+void run_finished_jobs(int budget)
+{
+	int start = glutGet(GLUT_ELAPSED_TIME);
+	struct job *job;
+
+	if (!pending_count)
+		return;
+
+	do {
+		pthread_mutex_lock(&job_lock);
+		job = SIMPLEQ_FIRST(&done_list);
+		if (job)
+			SIMPLEQ_REMOVE_HEAD(&done_list, list);
+		pthread_mutex_unlock(&job_lock);
+
+		if (!job)
+			break;
+
+		job->finish(job->arg);
+		free(job);
+		pending_count--;
+	} while (glutGet(GLUT_ELAPSED_TIME) - start < budget);
+}
@@ -0,0 +1,191 @@
+/*
+ * LZ4 block format compression and decompression.
+ *
+ * The compressor is the simple greedy variant with a single hash table;
+ * it is only used by the mio-pak tool. The decompressor checks every
+ * length and offset against the buffers it was given.
+ */
+
+#include <string.h>
+
+#include "pak.h"
+
+#define MINMATCH 4
+#define LASTLITERALS 5 /* the last bytes are always literals */
+#define MFLIMIT 12 /* no match may start this close to the end */
+#define HASH_BITS 14
+
+static inline uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline int hash4(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static unsigned char *put_length(unsigned char *op, int n)
+{
+	while (n >= 255) {
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = n;
+	return op;
+}
+
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+	const unsigned char *lit, int litlen, int offset, int matchlen)
+{
+	unsigned char *token;
+
+	/* token, literal length, literals, offset, match length */
+	if (oend - op < 1 + litlen / 255 + 1 + litlen + 2 + matchlen / 255 + 1)
+		return NULL;
+
+	token = op++;
+	*token = (litlen < 15 ? litlen : 15) << 4;
+	if (litlen >= 15)
+		op = put_length(op, litlen - 15);
+	memcpy(op, lit, litlen);
+	op += litlen;
+
+	if (matchlen) {
+		*op++ = offset;
+		*op++ = offset >> 8;
+		matchlen -= MINMATCH;
+		*token |= matchlen < 15 ? matchlen : 15;
+		if (matchlen >= 15)
+			op = put_length(op, matchlen - 15);
+	}
+
+	return op;
+}
+
+int lz4_compress_bound(int size)
+{
+	return size + size / 255 + 16;
+}
+
+/* Returns the compressed size, or 0 if it does not fit in dstlen. */
+int lz4_compress(const unsigned char *src, int srclen, unsigned char *dst, int dstlen)
+{
+	int table[1 << HASH_BITS];
+	const unsigned char *ip = src, *anchor = src, *ref;
+	const unsigned char *end = src + srclen;
+	const unsigned char *mflimit = end - MFLIMIT;
+	const unsigned char *matchlimit = end - LASTLITERALS;
+	unsigned char *op = dst, *oend = dst + dstlen;
+	int h, len;
+
+	memset(table, 0, sizeof table);
+
+	if (srclen > MFLIMIT) {
+		ip++;
+		while (ip < mflimit) {
+			h = hash4(read32(ip));
+			ref = src + table[h];
+			table[h] = ip - src;
+
+			if (ip - ref > 65535 || read32(ref) != read32(ip)) {
+				ip += 1 + ((ip - anchor) >> 6); /* skip faster through incompressible data */
+				continue;
+			}
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+
+			len = MINMATCH;
+			while (ip + len < matchlimit && ip[len] == ref[len])
+				len++;
+
+			op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, len);
+			if (!op)
+				return 0;
+
+			ip += len;
+			anchor = ip;
+			if (ip < mflimit)
+				table[hash4(read32(ip - 2))] = ip - 2 - src;
+		}
+	}
+
+	op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+	if (!op)
+		return 0;
+	return op - dst;
+}
+
+/* Returns the decompressed size, or -1 if the data is corrupt or does not fit. */
+int lz4_decompress(const unsigned char *src, int srclen, unsigned char *dst, int dstlen)
+{
+	const unsigned char *ip = src, *iend = src + srclen;
+	unsigned char *op = dst, *oend = dst + dstlen;
+	const unsigned char *match;
+	int token, litlen, matchlen, offset, b;
+
+	for (;;) {
+		if (ip >= iend)
+			return -1;
+		token = *ip++;
+
+		litlen = token >> 4;
+		if (litlen == 15) {
+			do {
+				if (ip >= iend || litlen > dstlen)
+					return -1;
+				b = *ip++;
+				litlen += b;
+			} while (b == 255);
+		}
+		if (iend - ip < litlen || oend - op < litlen)
+			return -1;
+		memcpy(op, ip, litlen);
+		ip += litlen;
+		op += litlen;
+
+		if (ip == iend)
+			break; /* the last sequence has no match */
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op - dst)
+			return -1;
+
+		matchlen = token & 15;
+		if (matchlen == 15) {
+			do {
+				if (ip >= iend || matchlen > dstlen)
+					return -1;
+				b = *ip++;
+				matchlen += b;
+			} while (b == 255);
+		}
+		matchlen += MINMATCH;
+		if (oend - op < matchlen)
+			return -1;
+
+		match = op - offset;
+		if (offset >= 8 && oend - op >= matchlen + 8) {
+			unsigned char *mend = op + matchlen;
+			do {
+				memcpy(op, match, 8);
+				op += 8;
+				match += 8;
+			} while (op < mend);
+			op = mend;
+		} else {
+			while (matchlen--)
+				*op++ = *match++;
+		}
+	}
+
+	return op - dst;
+}
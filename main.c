@@ -2,6 +2,7 @@
 
 #define TIME_STEP (1000 / 30)
 #define MAX_TIME_STEP (250)
+#define UPLOAD_BUDGET (4)
 
 float dpi_scale = 1;
 
@@ -243,6 +244,9 @@ static void display(void)
 	float alpha = (float) accumtime / TIME_STEP;
 	// drawstate = lerp(prevstate, curstate, alpha)
 
+	// upload resources that finished loading in the background
+	run_finished_jobs(UPLOAD_BUDGET);
+
 	// draw world
 
 	mat_perspective(projection, 75, (float)screenw / screenh, 0.1, 1000);
@@ -330,6 +334,7 @@ int main(int argc, char **argv)
 
 	register_directory("data/");
 	register_directory("data/textures/");
+	set_cook_directory("cache");
 
 	font_sans = load_font("fonts/SourceSansPro-Regular.ttf");
 	if (!font_sans)
@@ -1,26 +1,40 @@
 #include "mio.h"
 
-int load_material(char *dirname, char *material)
+void material_filename(char *filename, int size, const char *dirname, const char *material)
 {
-	char filename[1024], *s;
-	int texture;
+	const char *s;
 	s = strrchr(material, ';');
 	if (s) s++; else s = material;
 	if (dirname[0]) {
-		strlcpy(filename, dirname, sizeof filename);
-		strlcat(filename, "/textures/", sizeof filename);
-		strlcat(filename, s, sizeof filename);
-		strlcat(filename, ".png", sizeof filename);
+		strlcpy(filename, dirname, size);
+		strlcat(filename, "/textures/", size);
+		strlcat(filename, s, size);
+		strlcat(filename, ".png", size);
 	} else {
-		strlcpy(filename, "textures/", sizeof filename);
-		strlcat(filename, s, sizeof filename);
-		strlcat(filename, ".png", sizeof filename);
+		strlcpy(filename, "textures/", size);
+		strlcat(filename, s, size);
+		strlcat(filename, ".png", size);
 	}
-	texture = load_texture(filename, 1);
-	if (strstr(material, "clamp;")) {
+}
+
+int load_material_texture(char *filename, int clamp, int async)
+{
+	int texture;
+	if (async)
+		texture = load_texture_async(filename, 1);
+	else
+		texture = load_texture(filename, 1);
+	if (clamp) {
 		glBindTexture(GL_TEXTURE_2D, texture);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	}
 	return texture;
 }
+
+int load_material(char *dirname, char *material)
+{
+	char filename[1024];
+	material_filename(filename, sizeof filename, dirname, material);
+	return load_material_texture(filename, strstr(material, "clamp;") != NULL, 0);
+}
@@ -0,0 +1,345 @@
+/*
+ * mio-pak -- pack directories and archives into a pak archive (see pak.h).
+ *
+ * File names in the archive are relative to the directory they were
+ * found in; entries of zip and pak inputs keep their names, so an
+ * existing archive can be repacked as is. A name found in more than one
+ * input is taken from the first. With -z, entries are LZ4 compressed when that saves at
+ * least an eighth of their size. With -l, entry data is laid out in the
+ * order files are listed in an access log (see dump_vfs_log), so a scene
+ * that loads them in that order reads the archive front to back. Files
+ * missing from the log go last, in name order.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include "mio.h"
+#include "pak.h"
+#include "getopt.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+
+struct file {
+	char *name;
+	char *path;
+	struct archive *zip; /* or NULL for a loose file */
+	struct pakentry entry;
+	int source; /* command line position of the input */
+	int order;
+};
+
+static struct file *file_list = NULL;
+static int file_count = 0, file_cap = 0;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: mio-pak [-z] [-l access.log] -o output.pak (directory|archive)...\n");
+	exit(1);
+}
+
+/* the archive readers report through these; there is no console here */
+void warn(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	fputs("mio-pak: ", stderr);
+	vfprintf(stderr, fmt, ap);
+	putc('\n', stderr);
+	va_end(ap);
+}
+
+void console_printf(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+static void add_file(const char *name, const char *path, struct archive *zip, int source)
+{
+	if (file_count == file_cap) {
+		file_cap = file_cap ? file_cap * 2 : 256;
+		file_list = realloc(file_list, file_cap * sizeof *file_list);
+	}
+	file_list[file_count].name = strdup(name);
+	file_list[file_count].path = path ? strdup(path) : NULL;
+	file_list[file_count].zip = zip;
+	memset(&file_list[file_count].entry, 0, sizeof(struct pakentry));
+	file_list[file_count].entry.hash = pak_hash(name);
+	file_list[file_count].source = source;
+	file_list[file_count].order = INT_MAX;
+	file_count++;
+}
+
+static void scan_directory(const char *dirname, const char *prefix, int source)
+{
+	char path[1024], name[1024];
+	struct stat info;
+	struct dirent *ent;
+	DIR *d;
+
+	snprintf(path, sizeof path, "%s/%s", dirname, prefix);
+	d = opendir(path);
+	if (!d) {
+		fprintf(stderr, "mio-pak: cannot open directory: '%s'\n", path);
+		return;
+	}
+
+	while ((ent = readdir(d))) {
+		if (ent->d_name[0] == '.')
+			continue;
+		if (snprintf(name, sizeof name, "%s%s", prefix, ent->d_name) >= sizeof name - 1)
+			continue;
+		if (snprintf(path, sizeof path, "%s/%s", dirname, name) >= sizeof path)
+			continue;
+		if (stat(path, &info) < 0)
+			continue;
+		if (S_ISDIR(info.st_mode)) {
+			strcat(name, "/");
+			scan_directory(dirname, name, source);
+		} else if (S_ISREG(info.st_mode)) {
+			add_file(name, path, NULL, source);
+		}
+	}
+
+	closedir(d);
+}
+
+static void scan_archive(const char *zipname, int source)
+{
+	struct archive *zip = open_archive(zipname);
+	const char *name;
+	int i, n;
+	if (!zip)
+		exit(1);
+	for (i = 0, n = archive_entry_count(zip); i < n; i++) {
+		name = archive_entry_name(zip, i);
+		if (name[0] && name[strlen(name) - 1] != '/')
+			add_file(name, NULL, zip, source);
+	}
+}
+
+static int cmpname(const void *a_, const void *b_)
+{
+	const struct file *a = a_;
+	const struct file *b = b_;
+	if (a->entry.hash < b->entry.hash) return -1;
+	if (a->entry.hash > b->entry.hash) return 1;
+	return strcmp(a->name, b->name);
+}
+
+/* qsort is not stable, so duplicates are ordered by where they came from */
+static int cmpfile(const void *a_, const void *b_)
+{
+	const struct file *a = a_;
+	const struct file *b = b_;
+	int c = cmpname(a, b);
+	if (c) return c;
+	return a->source - b->source;
+}
+
+static int cmporder(const void *a_, const void *b_)
+{
+	const struct file *a = *(const struct file **)a_;
+	const struct file *b = *(const struct file **)b_;
+	if (a->order < b->order) return -1;
+	if (a->order > b->order) return 1;
+	return strcmp(a->name, b->name);
+}
+
+static struct file *find_file(const char *name)
+{
+	struct file key, *file;
+	key.name = (char*)name;
+	key.entry.hash = pak_hash(name);
+	file = bsearch(&key, file_list, file_count, sizeof *file_list, cmpname);
+	return file;
+}
+
+/* The first column of each line is a file name; a name seen twice keeps its first place. */
+static void read_order(const char *filename)
+{
+	char line[1024], *p;
+	struct file *file;
+	int order = 0;
+	FILE *in = fopen(filename, "r");
+	if (!in) {
+		fprintf(stderr, "mio-pak: cannot open access log: '%s'\n", filename);
+		exit(1);
+	}
+	while (fgets(line, sizeof line, in)) {
+		if (line[0] == '#')
+			continue;
+		p = line + strcspn(line, "\t\r\n");
+		*p = 0;
+		file = find_file(line);
+		if (file && file->order == INT_MAX)
+			file->order = order++;
+	}
+	fclose(in);
+}
+
+/* ftell is only 32 bits on Windows */
+static int64_t tell_file(FILE *file)
+{
+#ifdef _WIN32
+	return _ftelli64(file);
+#else
+	return ftello(file);
+#endif
+}
+
+static unsigned char *read_whole_file(const char *filename, int *lenp)
+{
+	unsigned char *data;
+	int len;
+	FILE *file = fopen(filename, "rb");
+	if (!file)
+		return NULL;
+	fseek(file, 0, 2);
+	len = tell_file(file);
+	fseek(file, 0, 0);
+	data = malloc(len > 0 ? len : 1);
+	if (fread(data, 1, len, file) != len) {
+		free(data);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	*lenp = len;
+	return data;
+}
+
+static void pad_file(FILE *out, int align)
+{
+	static const char zero[PAK_ALIGN] = {0};
+	int64_t pos = tell_file(out);
+	if (pos % align)
+		fwrite(zero, 1, align - pos % align, out);
+}
+
+int main(int argc, char **argv)
+{
+	struct pakheader hdr;
+	char *output = NULL, *order = NULL;
+	struct file **layout;
+	int compress = 0;
+	int i, k, c, len, zlen;
+	unsigned char *data, *zdata;
+	uint64_t names;
+	FILE *out;
+
+	while ((c = getopt(argc, argv, "zl:o:")) != EOF) {
+		switch (c) {
+		case 'z': compress = 1; break;
+		case 'l': order = optarg; break;
+		case 'o': output = optarg; break;
+		default: usage(); break;
+		}
+	}
+
+	if (!output || optind == argc)
+		usage();
+
+	for (i = optind; i < argc; i++) {
+		struct stat info;
+		if (stat(argv[i], &info) == 0 && S_ISREG(info.st_mode))
+			scan_archive(argv[i], i);
+		else
+			scan_directory(argv[i], "", i);
+	}
+
+	qsort(file_list, file_count, sizeof *file_list, cmpfile);
+
+	/* the same name in more than one directory: keep the first */
+	for (i = k = 1; i < file_count; i++) {
+		if (!strcmp(file_list[i].name, file_list[k-1].name)) {
+			fprintf(stderr, "mio-pak: duplicate file: '%s'\n", file_list[i].name);
+			continue;
+		}
+		file_list[k++] = file_list[i];
+	}
+	if (file_count > 0)
+		file_count = k;
+
+	/* the index stays in hash order; the data goes in layout order */
+	if (order)
+		read_order(order);
+	layout = malloc(file_count * sizeof *layout + 1);
+	for (i = 0; i < file_count; i++)
+		layout[i] = file_list + i;
+	qsort(layout, file_count, sizeof *layout, cmporder);
+
+	out = fopen(output, "wb");
+	if (!out) {
+		fprintf(stderr, "mio-pak: cannot create '%s'\n", output);
+		return 1;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	fwrite(&hdr, 1, sizeof hdr, out);
+
+	for (i = 0; i < file_count; i++) {
+		struct pakentry *entry = &layout[i]->entry;
+
+		if (layout[i]->zip)
+			data = read_archive(layout[i]->zip, layout[i]->name, &len);
+		else
+			data = read_whole_file(layout[i]->path, &len);
+		if (!data) {
+			fprintf(stderr, "mio-pak: cannot read '%s'\n", layout[i]->path ? layout[i]->path : layout[i]->name);
+			return 1;
+		}
+
+		entry->usize = entry->csize = len;
+		entry->codec = PAK_STORED;
+		entry->crc = update_crc32(0, data, len);
+
+		zdata = NULL;
+		if (compress && len > 0) {
+			zdata = malloc(lz4_compress_bound(len));
+			zlen = lz4_compress(data, len, zdata, lz4_compress_bound(len));
+			if (zlen > 0 && zlen <= len - len / 8) {
+				entry->csize = zlen;
+				entry->codec = PAK_LZ4;
+			}
+		}
+
+		pad_file(out, PAK_ALIGN);
+		entry->offset = tell_file(out);
+		fwrite(entry->codec == PAK_LZ4 ? zdata : data, 1, entry->csize, out);
+
+		free(zdata);
+		free(data);
+	}
+
+	pad_file(out, 8);
+	hdr.ofs_entries = tell_file(out);
+	names = 0;
+	for (i = 0; i < file_count; i++) {
+		file_list[i].entry.name = names;
+		names += strlen(file_list[i].name) + 1;
+		fwrite(&file_list[i].entry, 1, sizeof(struct pakentry), out);
+	}
+
+	hdr.ofs_names = tell_file(out);
+	hdr.num_names = names;
+	for (i = 0; i < file_count; i++)
+		fwrite(file_list[i].name, 1, strlen(file_list[i].name) + 1, out);
+
+	memcpy(hdr.magic, PAK_MAGIC, 8);
+	hdr.version = PAK_VERSION;
+	hdr.num_entries = file_count;
+	fseek(out, 0, 0);
+	fwrite(&hdr, 1, sizeof hdr, out);
+
+	if (fclose(out)) {
+		fprintf(stderr, "mio-pak: cannot write '%s'\n", output);
+		return 1;
+	}
+
+	return 0;
+}
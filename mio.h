@@ -4,6 +4,7 @@
 #include <math.h>
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "queue.h" // freebsd sys/queue.h
 #include "tree.h" // freebsd sys/tree.h
@@ -94,17 +95,111 @@ void calc_matrix_from_pose(mat4 *pose_matrix, struct pose *pose, int count);
 /* archive data file loading */
 
 void register_directory(const char *dirname);
+void rescan_directories(void);
 void register_archive(const char *zipname);
+
+struct archive;
+struct archive *open_archive(const char *filename);
+void close_archive(struct archive *zip);
+int archive_entry_count(struct archive *zip);
+const char *archive_entry_name(struct archive *zip, int i);
+unsigned char *read_archive(struct archive *zip, const char *filename, int *sizep);
+
 unsigned char *load_file(const char *filename, int *lenp);
+const unsigned char *load_file_view(const char *filename, int *lenp);
+void release_file_view(const unsigned char *data);
+const unsigned char *map_file(const char *filename, int *lenp);
+void unmap_file(const unsigned char *data, int len);
+void set_file_cache_budget(int bytes);
+void file_cache_stats(int *hits, int *misses, int *bytes, int *budget);
+
+struct vfs_stats {
+	const char *name;
+	int opens, failed;
+	long long bytes_read, compressed, uncompressed;
+	double decode_time; /* milliseconds */
+};
+
+int vfs_stats(struct vfs_stats *list, int max);
+void reset_vfs_stats(void);
+void print_vfs_stats(void);
+int dump_vfs_log(const char *filename);
+void prefetch_file(const char *filename);
+int prefetch_files(const char *logname);
+
+struct vfs_stream;
+
+struct vfs_stream *vfs_open(const char *filename);
+int vfs_read(struct vfs_stream *stm, void *buf, int len);
+int vfs_seek(struct vfs_stream *stm, int offset, int whence);
+int vfs_size(struct vfs_stream *stm);
+void vfs_close(struct vfs_stream *stm);
+
+/* deflate decompression and crc-32 */
+
+enum { INFLATE_DONE, INFLATE_FULL, INFLATE_ERROR = -1 };
+
+struct inflate *new_inflate(const unsigned char *in, int inlen);
+int run_inflate(struct inflate *z, unsigned char *out, int *posp, int size);
+void free_inflate(struct inflate *z);
+int inflate_buffer(unsigned char *out, int outlen, const unsigned char *in, int inlen);
+unsigned char *inflate_malloc(const unsigned char *in, int inlen, int initial_size, int *outlenp, int zlib_header);
+unsigned int update_crc32(unsigned int crc, const unsigned char *data, int len);
+
+/* background jobs; finish functions run on the main thread */
+
+void queue_job(void (*run)(void *arg), void (*finish)(void *arg), void *arg);
+int pending_jobs(void);
+int count_processors(void);
+void run_parallel(void (*fn)(void *arg, int i), void *arg, int count);
+void run_finished_jobs(int budget);
+void wait_for_jobs(void);
+
+/* per-thread scratch memory, emptied when the outermost scope ends */
+
+void arena_begin(void);
+void arena_end(void);
+void *arena_alloc(int size);
+void *arena_calloc(int count, int size);
+void *arena_realloc(void *ptr, int size);
+void arena_free(void *ptr);
+char *arena_strdup(const char *s);
 
 /* resource cache */
 
 struct cache;
 
+struct cache *new_cache(void);
 void *lookup(struct cache *cache, const char *key);
 struct cache *insert(struct cache *cache, const char *key, void *value);
+void *lookup_or_insert(struct cache *cache, const char *key, void *value);
+void *remove_from_cache(struct cache *cache, const char *key);
 void print_cache(struct cache *cache);
 
+struct resource {
+	const char *name;
+	int refs;
+	int size; /* resident bytes, GPU and CPU */
+	void (*free)(struct resource *res);
+	TAILQ_ENTRY(resource) lru;
+};
+
+void init_resource(struct resource *res, const char *name, int size, void (*destroy)(struct resource *res));
+void set_resource_size(struct resource *res, int size);
+void retain_resource(struct resource *res);
+void release_resource(struct resource *res);
+void set_resource_budget(int bytes);
+void resource_stats(int *count, int *bytes, int *unused, int *budget);
+
+/* generational handles for resources held by Lua; tags are enum tag */
+
+uintptr_t new_handle(int tag, void *ptr);
+int handle_tag(uintptr_t handle);
+void *get_handle(uintptr_t handle, int tag);
+void *free_handle(uintptr_t handle, int tag);
+void replace_handles(int tag, void *old, void *new);
+int live_handles(int tag, void **list, int max);
+
 /* texture loader based on stb_image */
 
 unsigned char *stbi_load(const char *filename, int *x, int *y, int *comp, int req_comp);
@@ -112,6 +207,8 @@ unsigned char *stbi_load_from_memory(const unsigned char *buffer, int len, int *
 
 int make_texture(unsigned char *data, int w, int h, int n, int srgb);
 int load_texture(char *filename, int srgb);
+int load_texture_async(char *filename, int srgb);
+void release_texture(int texid);
 
 int make_texture_array(unsigned char *data, int w, int h, int d, int n, int srgb);
 int load_texture_array(char *filename, int srgb, int *d);
@@ -206,26 +303,99 @@ int compile_shader(const char *vert_src, const char *frag_src);
 
 /* materials */
 
+void material_filename(char *filename, int size, const char *dirname, const char *material);
+int load_material_texture(char *filename, int clamp, int async);
 int load_material(char *dirname, char *material);
 
+/* read-only text scanning for the model loaders */
+
+const char *find_line_end(const char *s, const char *end);
+const char *skip_space(const char *s, const char *end);
+const char *parse_word(const char **sp, const char *end, int *lenp);
+char *parse_string(const char **sp, const char *end, char *buf, int size);
+int is_word(const char *s, int n, const char *word);
+int parse_int(const char **sp, const char *end, int def);
+float parse_float(const char **sp, const char *end, float def);
+
 /* models and animations */
 
 #define MAXBONE 80
 #define MAX_BONE_NAME 16
 
 struct model {
+	struct resource res;
+	int loading; /* queued by load_mesh_async */
 	struct skel *skel;
 	struct mesh *mesh;
 	struct anim *anim;
+	struct mesh_data *mesh_data;
 };
 
 struct part {
 	unsigned int material;
+	int double_sided;
+	int first, count;
+	int base; /* added to each index, for parts split into 16-bit chunks */
+	int cluster_first, cluster_count;
+};
+
+/* the parts that make up a level of detail, and how far it strays from the full mesh */
+#define MAXLOD 4
+
+struct lod {
 	int first, count;
+	float error;
+};
+
+/* a run of nearby triangles of a static mesh, culled as a whole */
+struct cluster {
+	int first, count;
+	vec3 center; /* bounding sphere */
+	float radius;
+	vec3 cone_axis; /* all face normals are within the cone */
+	float cone_cutoff; /* sine of the cone half angle; 1 if the cone is too wide to cull */
+};
+
+/* mesh data decoded by the loaders, waiting to be uploaded by upload_mesh */
+
+#define MAXATTRIB 16
+
+struct vertex_attrib {
+	int index, size, type, normalize, stride, offset;
+};
+
+struct part_data {
+	char *material; /* texture file name */
+	int clamp;
+	int double_sided; /* drawn without back face culling */
+	int first, count;
+};
+
+struct mesh_data {
+	int vertex_count, vertex_len;
+	unsigned char *vertex_data;
+	int attrib_count;
+	struct vertex_attrib attrib[MAXATTRIB];
+	vec3 position_scale, position_offset; /* to undo position quantization */
+	int index_count, index_size; /* 2 or 4 bytes per index */
+	void *index_data;
+	int part_count;
+	struct part_data *part;
+	int cluster_count;
+	struct cluster *cluster;
+	int lod_count;
+	struct lod lod[MAXLOD];
+	vec3 center; /* bounding sphere */
+	float radius;
+	struct skel *skel;
+	mat4 *inv_bind_matrix;
+	const unsigned char *mapping; /* vertex and index data of a cooked model */
+	int mapping_len;
 };
 
 struct skel {
 	enum tag tag;
+	struct model *model;
 	int count;
 	char name[MAXBONE][MAX_BONE_NAME];
 	int parent[MAXBONE];
@@ -234,10 +404,18 @@ struct skel {
 
 struct mesh {
 	enum tag tag;
+	struct model *model;
 	unsigned int vao, vbo, ibo;
+	int index_type, index_size;
+	vec3 position_scale, position_offset;
 	int enabled;
 	int count;
 	struct part *part;
+	struct cluster *cluster;
+	int lod_count;
+	struct lod lod[MAXLOD];
+	vec3 center;
+	float radius;
 	struct skel *skel;
 	mat4 *inv_bind_matrix;
 };
@@ -250,6 +428,7 @@ struct anim_map {
 
 struct anim {
 	enum tag tag;
+	struct model *model;
 	char *name;
 	int frames, channels;
 	float framerate;
@@ -298,14 +477,67 @@ void init_lamp(struct lamp *lamp);
 void init_transform(struct transform *transform);
 void init_skelpose(struct skelpose *skelpose, struct skel *skel);
 
-struct model *load_iqe_from_memory(const char *filename, unsigned char *data, int len);
-struct model *load_iqm_from_memory(const char *filename, unsigned char *data, int len);
-struct model *load_obj_from_memory(const char *filename, unsigned char *data, int len);
+struct model *decode_iqe_from_memory(const char *filename, const unsigned char *data, int len);
+struct model *decode_iqm_from_memory(const char *filename, const unsigned char *data, int len);
+struct model *decode_gltf_from_memory(const char *filename, const unsigned char *data, int len);
+struct model *decode_obj_from_memory(const char *filename, const unsigned char *data, int len);
+
+void upload_mesh(struct mesh *mesh, struct mesh_data *data, int async);
+void free_mesh_data(struct mesh_data *data);
+
+/* interleaved, quantized vertex buffers for the loaders */
+
+enum {
+	VERTEX_QUANTIZE_POSITION = 1, /* unorm16 with a per-mesh scale and offset */
+	VERTEX_QUANTIZE_NORMAL = 2, /* and tangents, to 2_10_10_10 snorm */
+	VERTEX_QUANTIZE_TEXCOORD = 4, /* half floats */
+	VERTEX_QUANTIZE_ALL = 7
+};
+
+struct vertex_array {
+	int index, size, type, normalize;
+	int stride; /* zero if tightly packed */
+	const void *data;
+};
+
+void set_vertex_quantization(int mask);
+int vertex_quantization(void);
+void build_vertex_layout(struct mesh_data *mesh, const struct vertex_array *arrays, int count);
+const struct vertex_attrib *find_position_attrib(const struct mesh_data *mesh);
+int vertex_attrib_size(const struct vertex_attrib *att);
+void get_vertex_position(const struct mesh_data *mesh, const struct vertex_attrib *att, int i, vec3 p);
+
+void set_mesh_indices(struct mesh_data *data, const unsigned int *index, int count);
+void set_mesh_optimization(int enable, int report);
+void optimize_mesh(const char *filename, struct mesh_data *mesh);
+void optimize_vertex_cache(unsigned int *index, int count, int vertex_count);
+void set_mesh_lods(int levels);
+int mesh_lods(void);
+void build_mesh_lods(struct mesh_data *mesh);
+void set_mesh_clusters(int enable);
+void build_mesh_clusters(struct mesh_data *mesh);
+void set_mesh_splitting(int enable);
+struct model *upload_model(struct model *model, int async);
+
+struct model *load_iqe_from_memory(const char *filename, const unsigned char *data, int len);
+struct model *load_iqm_from_memory(const char *filename, const unsigned char *data, int len);
+struct model *load_gltf_from_memory(const char *filename, const unsigned char *data, int len);
+struct model *load_obj_from_memory(const char *filename, const unsigned char *data, int len);
 struct model *load_model(const char *filename);
 
+void set_cook_directory(const char *dirname);
+void add_cook_dependency(const char *filename, const unsigned char *data, int len);
+struct model *load_cooked_model(const char *filename, const unsigned char *source, int len);
+void cook_model(const char *filename, const unsigned char *source, int len, struct model *model);
+
 struct skel *load_skel(const char *filename);
 struct mesh *load_mesh(const char *filename);
+struct mesh *load_mesh_async(const char *filename);
 struct anim *load_anim(const char *filename);
+void release_model(struct model *model);
+void release_skel(struct skel *skel);
+void release_mesh(struct mesh *mesh);
+void release_anim(struct anim *anim);
 
 void extract_raw_frame_root(struct pose *pose, struct anim *anim, int frame);
 void extract_raw_frame(struct pose *pose, struct anim *anim, int frame);
@@ -329,6 +561,7 @@ void render_mesh(struct transform *transform, struct mesh *mesh);
 void render_mesh_skel(struct transform *transform, struct mesh *mesh, struct skelpose *skelpose);
 void render_lamp(struct transform *transform, struct lamp *lamp);
 
+void set_lod_bias(float bias);
 void render_static_mesh(struct mesh *mesh, mat4 clip_from_view, mat4 view_from_model);
 void render_skinned_mesh(struct mesh *mesh, mat4 clip_from_view, mat4 view_from_model, mat4 *model_from_bind_pose);
 
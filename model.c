@@ -2,84 +2,647 @@
 
 struct {
 	const char *suffix;
-	struct model *(*load)(const char *filename, unsigned char *data, int len);
+	struct model *(*decode)(const char *filename, const unsigned char *data, int len);
+	int cook; /* text formats are slow to parse */
 } formats[] = {
-	{ ".iqm", load_iqm_from_memory },
-	{ ".iqe", load_iqe_from_memory },
-	{ ".obj", load_obj_from_memory },
+	{ ".iqm", decode_iqm_from_memory, 0 },
+	{ ".glb", decode_gltf_from_memory, 0 },
+	{ ".iqe", decode_iqe_from_memory, 1 },
+	{ ".obj", decode_obj_from_memory, 1 },
 };
 
 static struct cache *model_cache = NULL;
 
-struct model *load_model(const char *name)
+static int split_large_meshes = 0;
+
+/*
+ * A model is one reference counted resource for its mesh, skeleton and
+ * animations; each of them points back to the model that owns it.
+ */
+
+static void free_anim(struct anim *anim)
+{
+	while (anim) {
+		struct anim *next = anim->next;
+		while (anim->anim_map_head) {
+			struct anim_map *map = anim->anim_map_head;
+			anim->anim_map_head = map->next;
+			free(map);
+		}
+		free(anim->name);
+		free(anim->data);
+		free(anim);
+		anim = next;
+	}
+}
+
+static void free_mesh(struct mesh *mesh)
+{
+	int i;
+	if (mesh->vao) {
+		glDeleteVertexArrays(1, &mesh->vao);
+		glDeleteBuffers(1, &mesh->vbo);
+		glDeleteBuffers(1, &mesh->ibo);
+	}
+	for (i = 0; i < mesh->count; i++)
+		release_texture(mesh->part[i].material);
+	free(mesh->part);
+	free(mesh->cluster);
+	free(mesh->inv_bind_matrix);
+	free(mesh);
+}
+
+static void free_model(struct resource *res)
+{
+	struct model *model = (struct model*)res;
+	if (res->name && lookup(model_cache, res->name) == model)
+		remove_from_cache(model_cache, res->name);
+	if (model->mesh)
+		free_mesh(model->mesh);
+	free_mesh_data(model->mesh_data);
+	free_anim(model->anim);
+	free(model->skel);
+	free(model);
+}
+
+static int model_size(struct model *model)
+{
+	struct anim *anim;
+	int size = sizeof(struct model);
+	if (model->mesh_data)
+		size += model->mesh_data->vertex_len + model->mesh_data->index_count * model->mesh_data->index_size;
+	if (model->skel)
+		size += sizeof(struct skel);
+	for (anim = model->anim; anim; anim = anim->next)
+		size += sizeof(struct anim) + anim->frames * anim->channels * sizeof(float);
+	return size;
+}
+
+static void set_model_owner(struct model *model)
+{
+	struct anim *anim;
+	if (model->mesh)
+		model->mesh->model = model;
+	if (model->skel)
+		model->skel->model = model;
+	for (anim = model->anim; anim; anim = anim->next)
+		anim->model = model;
+}
+
+void release_model(struct model *model)
+{
+	if (model)
+		release_resource(&model->res);
+}
+
+void release_skel(struct skel *skel)
+{
+	if (skel)
+		release_model(skel->model);
+}
+
+void release_mesh(struct mesh *mesh)
+{
+	if (mesh)
+		release_model(mesh->model);
+}
+
+void release_anim(struct anim *anim)
+{
+	if (anim)
+		release_model(anim->model);
+}
+
+/* Drop triangles that refer past the vertex arrays, and clamp part ranges to the index data. */
+static unsigned int *filter_mesh_indices(struct mesh_data *data, const unsigned int *index, int *countp)
+{
+	unsigned int vc = data->vertex_count;
+	unsigned int *out;
+	int count = *countp;
+	int i, k, n, end, bad;
+
+	for (i = 0; i < count; i++)
+		if (index[i] >= vc)
+			break;
+	for (k = 0; i == count && k < data->part_count; k++)
+		if (data->part[k].first < 0 || data->part[k].count < 0 || data->part[k].first > count - data->part[k].count)
+			i = 0;
+	if (i == count)
+		return NULL;
+
+	out = malloc(count * sizeof *out);
+	n = bad = 0;
+	for (k = 0; k < data->part_count; k++) {
+		struct part_data *part = data->part + k;
+		i = part->first < 0 ? 0 : part->first;
+		end = part->count < 0 || part->first > count - part->count ? count : part->first + part->count;
+		part->first = n;
+		for (; i + 3 <= end; i += 3) {
+			if (index[i] < vc && index[i+1] < vc && index[i+2] < vc) {
+				out[n++] = index[i];
+				out[n++] = index[i+1];
+				out[n++] = index[i+2];
+			} else {
+				bad++;
+			}
+		}
+		part->count = n - part->first;
+	}
+	if (bad)
+		warn("warning: dropped %d triangles with bad vertex indices", bad);
+	*countp = n;
+	return out;
+}
+
+/* Store indices at 16 bits if every vertex can be reached with them, otherwise at 32. */
+void set_mesh_indices(struct mesh_data *data, const unsigned int *index, int count)
+{
+	unsigned int *valid;
+	unsigned short *p;
+	int i;
+
+	valid = filter_mesh_indices(data, index, &count);
+	if (valid)
+		index = valid;
+
+	data->index_count = count;
+	if (data->vertex_count > 0x10000) {
+		data->index_size = 4;
+		data->index_data = malloc(count * 4);
+		memcpy(data->index_data, index, count * 4);
+	} else {
+		data->index_size = 2;
+		data->index_data = p = malloc(count * 2);
+		for (i = 0; i < count; i++)
+			p[i] = index[i];
+	}
+	free(valid);
+}
+
+/*
+ * With splitting on, meshes that need 32-bit indices are instead drawn in
+ * chunks of triangles that each span less than 64K vertices, with 16-bit
+ * indices relative to a base vertex. Works best when the loader has kept
+ * the vertices of neighbouring triangles close together, as they all do.
+ */
+void set_mesh_splitting(int enable)
+{
+	split_large_meshes = enable;
+}
+
+struct split {
+	int part, first, count, base;
+};
+
+/* Returns the 16-bit indices, or NULL if some triangle spans too many vertices. */
+static unsigned short *split_mesh_indices(struct mesh_data *data, struct split **splitp, int *countp)
+{
+	const unsigned int *index = data->index_data;
+	unsigned short *out = malloc(data->index_count * 2);
+	struct split *split = NULL;
+	int i, k, n = 0, cap = 0;
+
+	for (k = 0; k < data->part_count; k++) {
+		int end = data->part[k].first + data->part[k].count;
+		i = data->part[k].first;
+		while (i < end) {
+			unsigned int lo = index[i], hi = index[i];
+			int start = i;
+			while (i + 3 <= end) {
+				unsigned int tlo = MIN(lo, MIN(index[i], MIN(index[i+1], index[i+2])));
+				unsigned int thi = MAX(hi, MAX(index[i], MAX(index[i+1], index[i+2])));
+				if (thi - tlo > 0xffff)
+					break;
+				lo = tlo;
+				hi = thi;
+				i += 3;
+			}
+			if (i == start) {
+				free(split);
+				free(out);
+				return NULL;
+			}
+			if (n == cap) {
+				cap = cap ? cap * 2 : 16;
+				split = realloc(split, cap * sizeof *split);
+			}
+			split[n].part = k;
+			split[n].first = start;
+			split[n].count = i - start;
+			split[n].base = lo;
+			n++;
+			for (; start < i; start++)
+				out[start] = index[start] - lo;
+		}
+	}
+
+	*splitp = split;
+	*countp = n;
+	return out;
+}
+
+/* Give each drawn part the clusters that overlap it, trimmed to its range. */
+static void clip_mesh_clusters(struct mesh *mesh, struct mesh_data *data)
+{
+	int i, k, n = 0;
+
+	/* a cluster is cut in two at most once for each part boundary */
+	mesh->cluster = malloc((data->cluster_count + mesh->count) * sizeof(struct cluster));
+
+	for (i = 0; i < mesh->count; i++) {
+		struct part *part = mesh->part + i;
+		int end = part->first + part->count;
+		part->cluster_first = n;
+		for (k = 0; k < data->cluster_count; k++) {
+			struct cluster *c = data->cluster + k;
+			int first = MAX(c->first, part->first);
+			int last = MIN(c->first + c->count, end);
+			if (first < last) {
+				mesh->cluster[n] = *c;
+				mesh->cluster[n].first = first;
+				mesh->cluster[n].count = last - first;
+				n++;
+			}
+		}
+		part->cluster_count = n - part->cluster_first;
+	}
+}
+
+void upload_mesh(struct mesh *mesh, struct mesh_data *data, int async)
+{
+	struct split *split = NULL;
+	unsigned short *split_index = NULL;
+	int i, k, count;
+
+	mesh->tag = TAG_MESH;
+	mesh->enabled = 0;
+	mesh->skel = data->skel;
+	mesh->inv_bind_matrix = data->inv_bind_matrix;
+	data->inv_bind_matrix = NULL;
+
+	mesh->index_size = data->index_size;
+	mesh->index_type = data->index_size == 4 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+	memcpy(mesh->position_scale, data->position_scale, sizeof(vec3));
+	memcpy(mesh->position_offset, data->position_offset, sizeof(vec3));
+
+	if (data->index_size == 4 && split_large_meshes && glDrawElementsBaseVertex) {
+		split_index = split_mesh_indices(data, &split, &count);
+		if (split_index) {
+			mesh->index_size = 2;
+			mesh->index_type = GL_UNSIGNED_SHORT;
+		}
+	}
+
+	if (!split_index) {
+		count = data->part_count;
+		split = malloc(count * sizeof *split);
+		for (i = 0; i < count; i++) {
+			split[i].part = i;
+			split[i].first = data->part[i].first;
+			split[i].count = data->part[i].count;
+			split[i].base = 0;
+		}
+	}
+
+	mesh->count = count;
+	mesh->part = malloc(count * sizeof(struct part));
+	for (i = 0; i < count; i++) {
+		struct part_data *part = data->part + split[i].part;
+		mesh->part[i].first = split[i].first;
+		mesh->part[i].count = split[i].count;
+		mesh->part[i].base = split[i].base;
+		mesh->part[i].double_sided = part->double_sided;
+		mesh->part[i].cluster_first = 0;
+		mesh->part[i].cluster_count = 0;
+		if (part->material)
+			mesh->part[i].material = load_material_texture(part->material, part->clamp, async);
+		else
+			mesh->part[i].material = 0;
+	}
+
+	/* the levels of detail, in terms of the parts as split */
+	mesh->lod_count = MAX(data->lod_count, 1);
+	for (k = 0; k < mesh->lod_count; k++) {
+		int first = data->lod_count ? data->lod[k].first : 0;
+		int end = data->lod_count ? first + data->lod[k].count : data->part_count;
+		mesh->lod[k].first = 0;
+		mesh->lod[k].count = 0;
+		mesh->lod[k].error = data->lod_count ? data->lod[k].error : 0;
+		for (i = 0; i < count; i++) {
+			if (split[i].part >= first && split[i].part < end) {
+				if (mesh->lod[k].count++ == 0)
+					mesh->lod[k].first = i;
+			}
+		}
+	}
+	memcpy(mesh->center, data->center, sizeof(vec3));
+	mesh->radius = data->radius;
+
+	free(split);
+
+	mesh->cluster = NULL;
+	if (data->cluster_count > 0)
+		clip_mesh_clusters(mesh, data);
+
+	glGenVertexArrays(1, &mesh->vao);
+	glGenBuffers(1, &mesh->vbo);
+	glGenBuffers(1, &mesh->ibo);
+
+	glBindVertexArray(mesh->vao);
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+
+	glBufferData(GL_ARRAY_BUFFER, data->vertex_len, data->vertex_data, GL_STATIC_DRAW);
+
+	for (i = 0; i < data->attrib_count; i++) {
+		struct vertex_attrib *va = data->attrib + i;
+		mesh->enabled |= 1<<va->index;
+		glEnableVertexAttribArray(va->index);
+		glVertexAttribPointer(va->index, va->size, va->type, va->normalize, va->stride, PTR(va->offset));
+	}
+
+	if (split_index) {
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, data->index_count * 2, split_index, GL_STATIC_DRAW);
+		free(split_index);
+	} else {
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, data->index_count * data->index_size, data->index_data, GL_STATIC_DRAW);
+	}
+}
+
+void free_mesh_data(struct mesh_data *data)
+{
+	int i;
+	if (!data)
+		return;
+	for (i = 0; i < data->part_count; i++)
+		free(data->part[i].material);
+	free(data->part);
+	free(data->cluster);
+	if (data->mapping) {
+		unmap_file(data->mapping, data->mapping_len);
+	} else {
+		free(data->vertex_data);
+		free(data->index_data);
+	}
+	free(data->inv_bind_matrix);
+	free(data);
+}
+
+struct model *upload_model(struct model *model, int async)
+{
+	if (model && model->mesh_data) {
+		if (!model->mesh)
+			model->mesh = malloc(sizeof(struct mesh));
+		upload_mesh(model->mesh, model->mesh_data, async);
+		free_mesh_data(model->mesh_data);
+		model->mesh_data = NULL;
+	}
+	return model;
+}
+
+static struct model *cluster_model(struct model *model)
+{
+	if (model && model->mesh_data)
+		build_mesh_clusters(model->mesh_data);
+	return model;
+}
+
+/* Reorder the triangles and vertices of a freshly decoded model for drawing, and simplify it. */
+static struct model *optimize_model(const char *filename, struct model *model)
+{
+	if (model && model->mesh_data) {
+		optimize_mesh(filename, model->mesh_data);
+		build_mesh_lods(model->mesh_data);
+	}
+	return cluster_model(model);
+}
+
+/* Upload a decoded model and make it a resource; the caller holds the only reference. */
+static struct model *make_model(struct model *model, const char *name)
+{
+	int size;
+	if (!model)
+		return NULL;
+	model->loading = 0;
+	size = model_size(model);
+	upload_model(model, 0);
+	set_model_owner(model);
+	init_resource(&model->res, name, size, free_model);
+	return model;
+}
+
+struct model *load_iqe_from_memory(const char *filename, const unsigned char *data, int len)
+{
+	return make_model(optimize_model(filename, decode_iqe_from_memory(filename, data, len)), NULL);
+}
+
+struct model *load_iqm_from_memory(const char *filename, const unsigned char *data, int len)
+{
+	return make_model(optimize_model(filename, decode_iqm_from_memory(filename, data, len)), NULL);
+}
+
+struct model *load_gltf_from_memory(const char *filename, const unsigned char *data, int len)
+{
+	return make_model(optimize_model(filename, decode_gltf_from_memory(filename, data, len)), NULL);
+}
+
+struct model *load_obj_from_memory(const char *filename, const unsigned char *data, int len)
+{
+	return make_model(optimize_model(filename, decode_obj_from_memory(filename, data, len)), NULL);
+}
+
+static void init_anim_motion(struct anim *anim)
+{
+	struct pose a_from_org, b_from_org;
+	vec4 org_from_a;
+	extract_frame_root(&a_from_org, anim, 0);
+	extract_frame_root(&b_from_org, anim, anim->frames - 1);
+	vec_sub(anim->motion.position, b_from_org.position, a_from_org.position);
+	quat_conjugate(org_from_a, a_from_org.rotation);
+	quat_mul(anim->motion.rotation, b_from_org.rotation, org_from_a);
+	vec_div(anim->motion.scale, b_from_org.scale, a_from_org.scale);
+}
+
+/* Find, read and parse a model without touching OpenGL; safe to call from worker threads. */
+static struct model *decode_model(const char *name)
 {
 	char filename[1024];
-	unsigned char *data = NULL;
+	const unsigned char *source = NULL;
 	struct model *model;
 	int i, len;
 
-	model = lookup(model_cache, name);
-	if (model)
-		return model;
-
 	for (i = 0; i < nelem(formats); i++) {
 		strlcpy(filename, name, sizeof filename);
 		strlcat(filename, formats[i].suffix, sizeof filename);
-		data = load_file(filename, &len);
-		if (data)
+		source = load_file_view(filename, &len);
+		if (source)
 			break;
 	}
 
-	if (!data) {
+	if (!source) {
 		warn("error: cannot find model: '%s'", name);
 		return NULL;
 	}
 
-	model = formats[i].load(filename, data, len);
+	if (formats[i].cook) {
+		model = load_cooked_model(filename, source, len);
+		if (model) {
+			release_file_view(source);
+			return cluster_model(model);
+		}
+	}
+
+	model = optimize_model(filename, formats[i].decode(filename, source, len));
 	if (!model)
 		warn("error: cannot load model: '%s'", filename);
 
-	free(data);
+	if (model && model->anim)
+		init_anim_motion(model->anim);
+
+	if (model && formats[i].cook)
+		cook_model(filename, source, len, model);
+
+	release_file_view(source);
 
+	return model;
+}
+
+struct model *load_model(const char *name)
+{
+	struct model *model;
+
+	model = lookup(model_cache, name);
+	if (model) {
+		retain_resource(&model->res);
+		while (model->loading)
+			wait_for_jobs();
+		if (lookup(model_cache, name) != model) {
+			release_model(model); /* the background load failed */
+			return NULL;
+		}
+		return model;
+	}
+
+	model = make_model(decode_model(name), name);
 	if (model)
 		model_cache = insert(model_cache, name, model);
 
-	if (model && model->anim) {
-		struct anim *anim = model->anim;
-		struct pose a_from_org, b_from_org;
-		vec4 org_from_a;
-		extract_frame_root(&a_from_org, anim, 0);
-		extract_frame_root(&b_from_org, anim, anim->frames - 1);
-		vec_sub(anim->motion.position, b_from_org.position, a_from_org.position);
-		quat_conjugate(org_from_a, a_from_org.rotation);
-		quat_mul(anim->motion.rotation, b_from_org.rotation, org_from_a);
-		vec_div(anim->motion.scale, b_from_org.scale, a_from_org.scale);
+	return model;
+}
+
+/*
+ * Asynchronous mesh loading. The caller gets an empty mesh right away,
+ * which draws nothing until the upload has finished on the main thread.
+ */
+
+struct mesh_job {
+	char *name;
+	struct model *model; /* owns the empty mesh */
+	struct model *decoded;
+};
+
+static void decode_mesh_job(void *arg)
+{
+	struct mesh_job *job = arg;
+	job->decoded = decode_model(job->name);
+}
+
+static void upload_mesh_job(void *arg)
+{
+	struct mesh_job *job = arg;
+	struct model *model = job->model;
+	struct model *decoded = job->decoded;
+	if (decoded) {
+		model->skel = decoded->skel;
+		model->anim = decoded->anim;
+		model->mesh_data = decoded->mesh_data;
+		free(decoded);
+		set_resource_size(&model->res, model_size(model));
+		upload_model(model, 1);
+		set_model_owner(model);
+	} else if (lookup(model_cache, job->name) == model) {
+		remove_from_cache(model_cache, job->name);
 	}
+	model->loading = 0;
+	release_resource(&model->res);
+	free(job->name);
+	free(job);
+}
 
-	return model;
+struct mesh *load_mesh_async(const char *name)
+{
+	struct mesh_job *job;
+	struct model *model, *found;
+	struct mesh *mesh;
+
+	if (!model_cache)
+		model_cache = new_cache();
+
+	model = lookup(model_cache, name);
+	if (model) {
+		if (!model->mesh)
+			return NULL;
+		retain_resource(&model->res);
+		return model->mesh;
+	}
+
+	mesh = malloc(sizeof(struct mesh));
+	memset(mesh, 0, sizeof(struct mesh));
+	mesh->tag = TAG_MESH;
+
+	model = malloc(sizeof(struct model));
+	memset(model, 0, sizeof(struct model));
+	model->mesh = mesh;
+	mesh->model = model;
+	model->loading = 1;
+
+	/* later requests share this model until it is loaded */
+	found = lookup_or_insert(model_cache, name, model);
+	if (found != model) {
+		free(mesh);
+		free(model);
+		if (!found->mesh)
+			return NULL;
+		retain_resource(&found->res);
+		return found->mesh;
+	}
+
+	init_resource(&model->res, name, 0, free_model);
+	retain_resource(&model->res); /* until the upload */
+
+	job = malloc(sizeof(struct mesh_job));
+	job->name = strdup(name);
+	job->model = model;
+	job->decoded = NULL;
+	queue_job(decode_mesh_job, upload_mesh_job, job);
+
+	return mesh;
 }
 
 struct skel *load_skel(const char *filename)
 {
 	struct model *model = load_model(filename);
-	if (model)
+	if (model && model->skel)
 		return model->skel;
+	release_model(model);
 	return NULL;
 }
 
 struct mesh *load_mesh(const char *filename)
 {
 	struct model *model = load_model(filename);
-	if (model)
+	if (model && model->mesh)
 		return model->mesh;
+	release_model(model);
 	return NULL;
 }
 
 struct anim *load_anim(const char *filename)
 {
 	struct model *model = load_model(filename);
-	if (model)
+	if (model && model->anim)
 		return model->anim;
+	release_model(model);
 	return NULL;
 }
 
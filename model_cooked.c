@@ -0,0 +1,495 @@
+/*
+ * Cooked models. After a text model has been parsed, its decoded form is
+ * written to the cook directory under a hash of the source name and
+ * contents. The next time the same source is loaded, the cooked file is
+ * mapped instead, and the vertex and index data are uploaded straight
+ * from the mapping.
+ *
+ * Files the source pulls in (such as OBJ material libraries) are listed
+ * in the cooked file with their own hashes, so changing them also makes
+ * the model parse again. The format is private to this build: structs
+ * are written as they are in memory, and a cooked file written with a
+ * different layout or version is ignored.
+ */
+
+#include "mio.h"
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(dir, mode) _mkdir(dir)
+#endif
+
+#define COOK_MAGIC "MIOCOOK"
+#define COOK_VERSION 5
+#define COOK_ALIGN 64
+
+struct cook_header
+{
+	char magic[8];
+	int version;
+	int skel_size, anim_size;
+	int quantize, lods;
+	unsigned int crc;
+	int len;
+	int dep_count;
+	int has_mesh, has_skel, anim_count;
+	int vertex_count, vertex_len, attrib_count;
+	vec3 position_scale, position_offset;
+	vec3 center;
+	float radius;
+	int index_count, index_size;
+	int part_count;
+	int vertex_ofs, index_ofs;
+};
+
+struct dependency
+{
+	char *name;
+	unsigned int crc;
+	int len;
+};
+
+static char *cook_directory = NULL;
+
+/* files read while decoding the current model on this thread */
+static __thread struct dependency dep_list[16];
+static __thread int dep_count = 0;
+
+void set_cook_directory(const char *dirname)
+{
+	free(cook_directory);
+	cook_directory = dirname ? strdup(dirname) : NULL;
+}
+
+void add_cook_dependency(const char *filename, const unsigned char *data, int len)
+{
+	if (dep_count < nelem(dep_list)) {
+		dep_list[dep_count].name = strdup(filename);
+		dep_list[dep_count].crc = update_crc32(0, data, len);
+		dep_list[dep_count].len = len;
+		dep_count++;
+	}
+}
+
+static void clear_dependencies(void)
+{
+	while (dep_count > 0)
+		free(dep_list[--dep_count].name);
+}
+
+static unsigned int source_crc(const char *filename, const unsigned char *source, int len)
+{
+	unsigned int crc = update_crc32(0, (const unsigned char*)filename, strlen(filename) + 1);
+	return update_crc32(crc, source, len);
+}
+
+static int cooked_filename(char *path, int size, unsigned int crc, int len)
+{
+	if (!cook_directory)
+		return 0;
+	return snprintf(path, size, "%s/%08x%08x.cooked", cook_directory, crc, len) < size;
+}
+
+/* Writing */
+
+static void put_int(FILE *file, int v)
+{
+	fwrite(&v, sizeof v, 1, file);
+}
+
+static void put_string(FILE *file, const char *s)
+{
+	int n = s ? strlen(s) : -1;
+	put_int(file, n);
+	if (n > 0)
+		fwrite(s, 1, n, file);
+}
+
+static int put_align(FILE *file)
+{
+	static const char zero[COOK_ALIGN] = {0};
+	long pos = ftell(file);
+	if (pos % COOK_ALIGN)
+		fwrite(zero, 1, COOK_ALIGN - pos % COOK_ALIGN, file);
+	return ftell(file);
+}
+
+/* Write the cooked form of a freshly decoded model, before it is uploaded. */
+void cook_model(const char *filename, const unsigned char *source, int len, struct model *model)
+{
+	struct mesh_data *mesh = model->mesh_data;
+	struct cook_header hdr;
+	struct anim *anim;
+	char path[1024], tmp[1040];
+	FILE *file;
+	int i;
+
+	memset(&hdr, 0, sizeof hdr);
+	hdr.crc = source_crc(filename, source, len);
+	hdr.len = len;
+	if (!cooked_filename(path, sizeof path, hdr.crc, len))
+		goto done;
+
+	/* each thread writes its own temporary file, named after its dependency list */
+	mkdir(cook_directory, 0777);
+	snprintf(tmp, sizeof tmp, "%s.%p", path, (void*)dep_list);
+	file = fopen(tmp, "wb");
+	if (!file) {
+		warn("error: cannot write cooked model: '%s'", tmp);
+		goto done;
+	}
+
+	fwrite(&hdr, sizeof hdr, 1, file);
+
+	memcpy(hdr.magic, COOK_MAGIC, 8);
+	hdr.version = COOK_VERSION;
+	hdr.skel_size = sizeof(struct skel);
+	hdr.anim_size = sizeof(struct anim);
+	hdr.quantize = vertex_quantization();
+	hdr.lods = mesh_lods();
+	hdr.dep_count = dep_count;
+	hdr.has_mesh = mesh != NULL;
+	hdr.has_skel = model->skel != NULL;
+	for (anim = model->anim; anim; anim = anim->next)
+		hdr.anim_count++;
+
+	put_string(file, filename);
+
+	for (i = 0; i < dep_count; i++) {
+		put_string(file, dep_list[i].name);
+		put_int(file, dep_list[i].crc);
+		put_int(file, dep_list[i].len);
+	}
+
+	if (model->skel)
+		fwrite(model->skel, sizeof(struct skel), 1, file);
+
+	for (anim = model->anim; anim; anim = anim->next) {
+		fwrite(anim, sizeof(struct anim), 1, file);
+		put_string(file, anim->name);
+		fwrite(anim->data, sizeof(float), anim->frames * anim->channels, file);
+	}
+
+	if (mesh) {
+		hdr.vertex_count = mesh->vertex_count;
+		hdr.vertex_len = mesh->vertex_len;
+		hdr.attrib_count = mesh->attrib_count;
+		memcpy(hdr.position_scale, mesh->position_scale, sizeof(vec3));
+		memcpy(hdr.position_offset, mesh->position_offset, sizeof(vec3));
+		memcpy(hdr.center, mesh->center, sizeof(vec3));
+		hdr.radius = mesh->radius;
+		hdr.index_count = mesh->index_count;
+		hdr.index_size = mesh->index_size;
+		hdr.part_count = mesh->part_count;
+
+		fwrite(mesh->attrib, sizeof(struct vertex_attrib), mesh->attrib_count, file);
+		for (i = 0; i < mesh->part_count; i++) {
+			put_string(file, mesh->part[i].material);
+			put_int(file, mesh->part[i].clamp);
+			put_int(file, mesh->part[i].double_sided);
+			put_int(file, mesh->part[i].first);
+			put_int(file, mesh->part[i].count);
+		}
+		put_int(file, mesh->lod_count);
+		fwrite(mesh->lod, sizeof(struct lod), mesh->lod_count, file);
+		put_int(file, mesh->inv_bind_matrix != NULL);
+		if (mesh->inv_bind_matrix)
+			fwrite(mesh->inv_bind_matrix, sizeof(mat4), mesh->skel->count, file);
+
+		hdr.vertex_ofs = put_align(file);
+		fwrite(mesh->vertex_data, 1, mesh->vertex_len, file);
+		hdr.index_ofs = put_align(file);
+		fwrite(mesh->index_data, mesh->index_size, mesh->index_count, file);
+	}
+
+	fseek(file, 0, 0);
+	fwrite(&hdr, sizeof hdr, 1, file);
+
+	if (fclose(file) || rename(tmp, path)) {
+		/* another thread may have cooked the same model first */
+		remove(tmp);
+	}
+
+done:
+	clear_dependencies();
+}
+
+/* Reading */
+
+struct reader
+{
+	const unsigned char *p, *end;
+	int error;
+};
+
+static const void *get_bytes(struct reader *r, int n)
+{
+	const unsigned char *p = r->p;
+	if (r->error || n < 0 || r->end - r->p < n) {
+		r->error = 1;
+		return NULL;
+	}
+	r->p += n;
+	return p;
+}
+
+static void get_copy(struct reader *r, void *dst, int n)
+{
+	const void *p = get_bytes(r, n);
+	if (p)
+		memcpy(dst, p, n);
+}
+
+static int get_int(struct reader *r)
+{
+	int v = 0;
+	get_copy(r, &v, sizeof v);
+	return v;
+}
+
+static char *get_string(struct reader *r)
+{
+	int n = get_int(r);
+	const char *p;
+	char *s;
+	if (n < 0)
+		return NULL;
+	p = get_bytes(r, n);
+	if (!p)
+		return NULL;
+	s = malloc(n + 1);
+	memcpy(s, p, n);
+	s[n] = 0;
+	return s;
+}
+
+static int check_dependency(const char *name, unsigned int crc, int len)
+{
+	const unsigned char *data;
+	int n, ok;
+	data = load_file_view(name, &n);
+	if (!data)
+		return 0;
+	ok = n == len && update_crc32(0, data, n) == crc;
+	release_file_view(data);
+	return ok;
+}
+
+static void free_cooked(struct model *model)
+{
+	struct mesh_data *mesh = model->mesh_data;
+	struct anim *anim;
+	int i;
+	if (mesh) {
+		for (i = 0; i < mesh->part_count; i++)
+			free(mesh->part[i].material);
+		free(mesh->part);
+		free(mesh->inv_bind_matrix);
+		free(mesh);
+	}
+	while (model->anim) {
+		anim = model->anim;
+		model->anim = anim->next;
+		free(anim->name);
+		free(anim->data);
+		free(anim);
+	}
+	free(model->skel);
+	free(model);
+}
+
+/* The arrays are used straight from the file, so every range and index must stay inside them. */
+static int check_cooked_mesh(const struct mesh_data *mesh)
+{
+	const unsigned short *index16 = mesh->index_data;
+	const unsigned int *index32 = mesh->index_data;
+	unsigned int vc = mesh->vertex_count;
+	int i;
+
+	if (mesh->vertex_count < 0)
+		return 0;
+	for (i = 0; i < mesh->attrib_count; i++) {
+		const struct vertex_attrib *att = mesh->attrib + i;
+		if (att->size < 1 || att->size > 4 || att->stride <= 0 || att->offset < 0 ||
+			att->offset + vertex_attrib_size(att) > att->stride ||
+			(int64_t)mesh->vertex_count * att->stride > mesh->vertex_len)
+			return 0;
+	}
+	for (i = 0; i < mesh->part_count; i++) {
+		const struct part_data *part = mesh->part + i;
+		if (part->first < 0 || part->count < 0 || part->first > mesh->index_count - part->count)
+			return 0;
+	}
+	for (i = 0; i < mesh->index_count; i++)
+		if ((mesh->index_size == 2 ? index16[i] : index32[i]) >= vc)
+			return 0;
+	return 1;
+}
+
+static struct model *read_cooked(const char *filename, const unsigned char *data, int len, const struct cook_header *hdr)
+{
+	struct reader r = { data + sizeof *hdr, data + len, 0 };
+	struct model *model;
+	struct mesh_data *mesh;
+	struct skel *skel = NULL;
+	struct anim *anim, **tail;
+	char *name;
+	int i, n;
+
+	name = get_string(&r);
+	n = name && !strcmp(name, filename);
+	free(name);
+	if (!n)
+		return NULL;
+
+	for (i = 0; i < hdr->dep_count; i++) {
+		unsigned int crc;
+		name = get_string(&r);
+		crc = get_int(&r);
+		n = get_int(&r);
+		if (!name || !check_dependency(name, crc, n)) {
+			free(name);
+			return NULL;
+		}
+		free(name);
+	}
+
+	model = malloc(sizeof(struct model));
+	memset(model, 0, sizeof(struct model));
+
+	if (hdr->has_skel) {
+		skel = model->skel = malloc(sizeof(struct skel));
+		get_copy(&r, skel, sizeof(struct skel));
+		skel->model = NULL;
+		if (skel->count < 0 || skel->count > MAXBONE)
+			r.error = 1;
+	}
+
+	tail = &model->anim;
+	for (i = 0; i < hdr->anim_count && !r.error; i++) {
+		anim = malloc(sizeof(struct anim));
+		get_copy(&r, anim, sizeof(struct anim));
+		anim->model = NULL;
+		anim->name = get_string(&r);
+		anim->skel = skel;
+		anim->next = NULL;
+		anim->anim_map_head = NULL;
+		n = r.error ? 0 : anim->frames * anim->channels;
+		if (n < 0 || n > len / (int)sizeof(float))
+			r.error = 1, n = 0;
+		anim->data = malloc(MAX(n, 1) * sizeof(float));
+		get_copy(&r, anim->data, n * sizeof(float));
+		*tail = anim;
+		tail = &anim->next;
+	}
+
+	if (hdr->has_mesh && !r.error) {
+		mesh = model->mesh_data = calloc(1, sizeof(struct mesh_data));
+		mesh->skel = skel;
+		memcpy(mesh->position_scale, hdr->position_scale, sizeof(vec3));
+		memcpy(mesh->position_offset, hdr->position_offset, sizeof(vec3));
+		memcpy(mesh->center, hdr->center, sizeof(vec3));
+		mesh->radius = hdr->radius;
+
+		if (hdr->attrib_count < 0 || hdr->attrib_count > MAXATTRIB || hdr->part_count < 0 || hdr->part_count > len)
+			r.error = 1;
+		else
+			mesh->attrib_count = hdr->attrib_count;
+		get_copy(&r, mesh->attrib, mesh->attrib_count * sizeof(struct vertex_attrib));
+
+		mesh->part = malloc(MAX(hdr->part_count, 1) * sizeof(struct part_data));
+		for (i = 0; i < hdr->part_count && !r.error; i++) {
+			mesh->part[i].material = get_string(&r);
+			mesh->part[i].clamp = get_int(&r);
+			mesh->part[i].double_sided = get_int(&r);
+			mesh->part[i].first = get_int(&r);
+			mesh->part[i].count = get_int(&r);
+			mesh->part_count++;
+		}
+
+		n = get_int(&r);
+		if (n < 0 || n > MAXLOD)
+			r.error = 1;
+		else
+			mesh->lod_count = n;
+		get_copy(&r, mesh->lod, mesh->lod_count * sizeof(struct lod));
+		for (i = 0; i < mesh->lod_count; i++)
+			if (mesh->lod[i].first < 0 || mesh->lod[i].count < 0 || mesh->lod[i].first + mesh->lod[i].count > mesh->part_count)
+				r.error = 1;
+
+		if (get_int(&r)) {
+			n = skel ? skel->count : 0;
+			mesh->inv_bind_matrix = malloc(MAX(n, 1) * sizeof(mat4));
+			get_copy(&r, mesh->inv_bind_matrix, n * sizeof(mat4));
+		}
+
+		if ((hdr->index_size != 2 && hdr->index_size != 4) ||
+			hdr->vertex_len < 0 || hdr->vertex_ofs < 0 || hdr->vertex_ofs > len - hdr->vertex_len ||
+			hdr->index_count < 0 || hdr->index_count > len / hdr->index_size ||
+			hdr->index_ofs < 0 || hdr->index_ofs > len - hdr->index_count * hdr->index_size)
+			r.error = 1;
+
+		/* uploaded straight from the mapping, which free_mesh_data unmaps */
+		if (!r.error) {
+			mesh->vertex_count = hdr->vertex_count;
+			mesh->vertex_len = hdr->vertex_len;
+			mesh->vertex_data = (unsigned char*)data + hdr->vertex_ofs;
+			mesh->index_count = hdr->index_count;
+			mesh->index_size = hdr->index_size;
+			mesh->index_data = (void*)(data + hdr->index_ofs);
+			mesh->mapping = data;
+			mesh->mapping_len = len;
+			if (!check_cooked_mesh(mesh))
+				r.error = 1;
+		}
+	}
+
+	if (r.error) {
+		warn("error: corrupt cooked model for '%s'", filename);
+		free_cooked(model);
+		return NULL;
+	}
+
+	return model;
+}
+
+/*
+ * Return the cooked model for this source, or NULL if there is none or it
+ * is out of date. Either way, start recording dependencies for cook_model.
+ */
+struct model *load_cooked_model(const char *filename, const unsigned char *source, int len)
+{
+	const struct cook_header *hdr;
+	const unsigned char *data;
+	struct model *model;
+	char path[1024];
+	unsigned int crc;
+	int size;
+
+	clear_dependencies();
+
+	crc = source_crc(filename, source, len);
+	if (!cooked_filename(path, sizeof path, crc, len))
+		return NULL;
+
+	data = map_file(path, &size);
+	if (!data)
+		return NULL;
+
+	hdr = (const struct cook_header*)data;
+	if (size < sizeof *hdr || memcmp(hdr->magic, COOK_MAGIC, 8) || hdr->version != COOK_VERSION ||
+		hdr->skel_size != sizeof(struct skel) || hdr->anim_size != sizeof(struct anim) ||
+		hdr->quantize != vertex_quantization() || hdr->lods != mesh_lods() ||
+		hdr->crc != crc || hdr->len != len) {
+		unmap_file(data, size);
+		return NULL;
+	}
+
+	model = read_cooked(filename, data, size, hdr);
+	if (!model || !model->mesh_data)
+		unmap_file(data, size);
+
+	return model;
+}
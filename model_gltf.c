@@ -0,0 +1,1330 @@
+#include "mio.h"
+
+// Simple loader assumes little-endian, like the IQM one.
+
+/*
+ * Binary glTF 2.0 models (.glb).
+ *
+ * The JSON chunk is tokenized in place into a flat array, where each value
+ * knows the token after its last child, so whole subtrees can be skipped.
+ * Vertex attributes are read straight out of the buffer views of the file.
+ * When all primitives store an attribute the same way, and no node
+ * transform has to be baked into it, it keeps its format; that includes
+ * the integer formats of KHR_mesh_quantization. A shared node transform
+ * that only scales and translates goes into the position scale and
+ * offset. Anything else is converted to floats.
+ *
+ * The joints of the first skin make up the skeleton, sorted so parents
+ * come before their children. Animations of the joints are resampled at
+ * a fixed frame rate.
+ */
+
+#define GLB_MAGIC 0x46546c67 /* "glTF" */
+#define GLB_JSON 0x4e4f534a
+#define GLB_BIN 0x004e4942
+
+#define MAXBUFFER 16
+#define FRAMERATE 30
+
+enum { JSON_OBJECT, JSON_ARRAY, JSON_STRING, JSON_PRIMITIVE };
+
+struct json_token {
+	int type;
+	int start, end; /* text of a string or primitive, without the quotes */
+	int size; /* number of items or members */
+	int next; /* the token after this value and all of its children */
+};
+
+struct json_list {
+	int count;
+	int *item;
+};
+
+struct accessor {
+	const unsigned char *data;
+	int count, size, type, normalize, stride;
+};
+
+enum { POSITION, NORMAL, TANGENT, TEXCOORD, COLOR, JOINTS, WEIGHTS, NSEMANTIC };
+
+static const struct {
+	const char *name;
+	int index;
+} semantic[NSEMANTIC] = {
+	{ "POSITION", ATT_POSITION },
+	{ "NORMAL", ATT_NORMAL },
+	{ "TANGENT", ATT_TANGENT },
+	{ "TEXCOORD_0", ATT_TEXCOORD },
+	{ "COLOR_0", ATT_COLOR },
+	{ "JOINTS_0", ATT_BLEND_INDEX },
+	{ "WEIGHTS_0", ATT_BLEND_WEIGHT },
+};
+
+/* A triangle primitive of a mesh, placed by a node. */
+struct instance {
+	int node, material;
+	int vertex_count, first_vertex;
+	int has; /* bit mask of semantics */
+	struct accessor att[NSEMANTIC];
+	struct accessor index;
+	int has_index;
+};
+
+struct gltf {
+	const char *filename;
+	char dirname[1024];
+	const char *text;
+	struct json_token *token;
+	int token_count, token_cap;
+
+	const unsigned char *buffer[MAXBUFFER];
+	int buffer_len[MAXBUFFER];
+	const unsigned char *file_view[MAXBUFFER]; /* external buffers */
+
+	struct json_list buffers, views, accessors, nodes, meshes;
+	struct json_list materials, textures, samplers, images, skins, animations;
+
+	int *node_parent;
+	struct pose *node_pose;
+	mat4 *node_local, *node_world;
+
+	/* the skeleton, by the index of the joint in the skin */
+	int joint_count;
+	int *joint_node, *node_joint, *joint_parent;
+	int *order, *remap; /* from skeleton to skin order, and back */
+	mat4 *pre; /* for joints whose node parent is not their joint parent */
+	unsigned char *has_pre;
+
+	int warned;
+};
+
+static int error(struct gltf *g, const char *msg)
+{
+	warn("error: %s: '%s'", msg, g->filename);
+	return 0;
+}
+
+static void warn_once(struct gltf *g, int bit, const char *msg)
+{
+	if (!(g->warned & bit))
+		warn("warning: %s: '%s'", msg, g->filename);
+	g->warned |= bit;
+}
+
+/* json */
+
+static int new_token(struct gltf *g, int type, const char *s)
+{
+	struct json_token *t;
+	if (g->token_count == g->token_cap) {
+		g->token_cap = g->token_cap ? g->token_cap * 2 : 1024;
+		g->token = arena_realloc(g->token, g->token_cap * sizeof *g->token);
+	}
+	t = g->token + g->token_count;
+	t->type = type;
+	t->start = t->end = s - g->text;
+	t->size = 0;
+	return g->token_count++;
+}
+
+/* Parse the value at s into tokens; return the text after it, or NULL on error. */
+static const char *parse_value(struct gltf *g, const char *s, const char *end, int depth)
+{
+	int t;
+
+	s = skip_space(s, end);
+	if (s == end || depth > 64)
+		return NULL;
+
+	if (*s == '{' || *s == '[') {
+		char close = *s == '{' ? '}' : ']';
+		t = new_token(g, *s == '{' ? JSON_OBJECT : JSON_ARRAY, s);
+		s = skip_space(s + 1, end);
+		if (s < end && *s == close) {
+			s++;
+		} else {
+			for (;;) {
+				if (close == '}') {
+					s = skip_space(s, end);
+					if (s == end || *s != '"')
+						return NULL;
+					s = parse_value(g, s, end, depth + 1);
+					if (!s)
+						return NULL;
+					s = skip_space(s, end);
+					if (s == end || *s != ':')
+						return NULL;
+					s++;
+				}
+				s = parse_value(g, s, end, depth + 1);
+				if (!s)
+					return NULL;
+				g->token[t].size++;
+				s = skip_space(s, end);
+				if (s < end && *s == ',')
+					s++;
+				else if (s < end && *s == close)
+					break;
+				else
+					return NULL;
+			}
+			s++;
+		}
+	} else if (*s == '"') {
+		t = new_token(g, JSON_STRING, ++s);
+		while (s < end && *s != '"')
+			s += *s == '\\' ? 2 : 1;
+		if (s >= end)
+			return NULL;
+		g->token[t].end = s++ - g->text;
+	} else {
+		t = new_token(g, JSON_PRIMITIVE, s);
+		while (s < end && *s != ',' && *s != ':' && *s != ']' && *s != '}' && *s > ' ')
+			s++;
+		if (s - g->text == g->token[t].start)
+			return NULL;
+		g->token[t].end = s - g->text;
+	}
+
+	g->token[t].next = g->token_count;
+	return s;
+}
+
+static int json_is(struct gltf *g, int t, const char *s)
+{
+	int n = strlen(s);
+	return t >= 0 && g->token[t].type == JSON_STRING &&
+		g->token[t].end - g->token[t].start == n && !memcmp(g->text + g->token[t].start, s, n);
+}
+
+/* Return the value of a member of an object, or -1. */
+static int json_get(struct gltf *g, int t, const char *key)
+{
+	int i, k;
+	if (t < 0 || g->token[t].type != JSON_OBJECT)
+		return -1;
+	for (i = 0, k = t + 1; i < g->token[t].size; i++, k = g->token[k+1].next)
+		if (json_is(g, k, key))
+			return k + 1;
+	return -1;
+}
+
+static struct json_list json_items(struct gltf *g, int t)
+{
+	struct json_list list = { 0, NULL };
+	int i, k;
+	if (t < 0 || g->token[t].type != JSON_ARRAY)
+		return list;
+	list.count = g->token[t].size;
+	list.item = arena_alloc(list.count * sizeof *list.item);
+	for (i = 0, k = t + 1; i < list.count; i++, k = g->token[k].next)
+		list.item[i] = k;
+	return list;
+}
+
+static int json_item(struct json_list *list, int i)
+{
+	return i >= 0 && i < list->count ? list->item[i] : -1;
+}
+
+static int json_int(struct gltf *g, int t, int def)
+{
+	const char *s;
+	if (t < 0 || g->token[t].type != JSON_PRIMITIVE)
+		return def;
+	s = g->text + g->token[t].start;
+	return parse_int(&s, g->text + g->token[t].end, def);
+}
+
+static float json_float(struct gltf *g, int t, float def)
+{
+	const char *s;
+	if (t < 0 || g->token[t].type != JSON_PRIMITIVE)
+		return def;
+	s = g->text + g->token[t].start;
+	return parse_float(&s, g->text + g->token[t].end, def);
+}
+
+static int json_get_int(struct gltf *g, int t, const char *key, int def)
+{
+	return json_int(g, json_get(g, t, key), def);
+}
+
+static int json_get_bool(struct gltf *g, int t, const char *key)
+{
+	t = json_get(g, t, key);
+	return t >= 0 && g->text[g->token[t].start] == 't';
+}
+
+/* Read up to n numbers of an array; keep the defaults already in out for the rest. */
+static void json_get_floats(struct gltf *g, int t, const char *key, float *out, int n)
+{
+	int i, k;
+	t = json_get(g, t, key);
+	if (t < 0 || g->token[t].type != JSON_ARRAY)
+		return;
+	for (i = 0, k = t + 1; i < g->token[t].size && i < n; i++, k = g->token[k].next)
+		out[i] = json_float(g, k, out[i]);
+}
+
+static char *json_string(struct gltf *g, int t, char *buf, int size)
+{
+	const char *s, *end;
+	int n = 0;
+	buf[0] = 0;
+	if (t < 0 || g->token[t].type != JSON_STRING)
+		return buf;
+	s = g->text + g->token[t].start;
+	end = g->text + g->token[t].end;
+	while (s < end && n < size - 1) {
+		int c = *s++;
+		if (c == '\\' && s < end) {
+			c = *s++;
+			switch (c) {
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case 'u': c = end - s >= 4 ? strtol((char[5]){ s[0], s[1], s[2], s[3], 0 }, NULL, 16) : '?'; s += 4; break;
+			}
+			if (c >= 0x80)
+				c = '_'; /* file and bone names are ascii in practice */
+		}
+		buf[n++] = c;
+	}
+	buf[n] = 0;
+	return buf;
+}
+
+/* buffers and accessors */
+
+static int component_size(int type)
+{
+	switch (type) {
+	case GL_BYTE: case GL_UNSIGNED_BYTE: return 1;
+	case GL_SHORT: case GL_UNSIGNED_SHORT: return 2;
+	case GL_UNSIGNED_INT: case GL_FLOAT: return 4;
+	}
+	return 0;
+}
+
+static int type_size(struct gltf *g, int t)
+{
+	if (json_is(g, t, "SCALAR")) return 1;
+	if (json_is(g, t, "VEC2")) return 2;
+	if (json_is(g, t, "VEC3")) return 3;
+	if (json_is(g, t, "VEC4")) return 4;
+	if (json_is(g, t, "MAT4")) return 16;
+	return 0;
+}
+
+static int load_buffers(struct gltf *g, const unsigned char *bin, int bin_len)
+{
+	char name[1024], path[1024];
+	int i, t, len;
+
+	if (g->buffers.count > MAXBUFFER)
+		return error(g, "too many buffers in gltf");
+
+	for (i = 0; i < g->buffers.count; i++) {
+		t = g->buffers.item[i];
+		if (json_get(g, t, "uri") < 0) {
+			if (i != 0 || !bin)
+				return error(g, "missing gltf buffer");
+			g->buffer[i] = bin;
+			len = bin_len;
+		} else {
+			json_string(g, json_get(g, t, "uri"), name, sizeof name);
+			if (!strncmp(name, "data:", 5))
+				return error(g, "data uris are not supported");
+			if (g->dirname[0]) {
+				strlcpy(path, g->dirname, sizeof path);
+				strlcat(path, "/", sizeof path);
+				strlcat(path, name, sizeof path);
+			} else {
+				strlcpy(path, name, sizeof path);
+			}
+			g->buffer[i] = g->file_view[i] = load_file_view(path, &len);
+			if (!g->buffer[i])
+				return error(g, "cannot load gltf buffer");
+		}
+		g->buffer_len[i] = json_get_int(g, t, "byteLength", 0);
+		if (g->buffer_len[i] < 0 || g->buffer_len[i] > len)
+			return error(g, "bad gltf buffer size");
+	}
+	return 1;
+}
+
+static int get_accessor(struct gltf *g, int index, struct accessor *a)
+{
+	int t = json_item(&g->accessors, index);
+	int v, buffer, offset, length, elem;
+	long long last;
+
+	if (t < 0)
+		return error(g, "bad gltf accessor");
+	if (json_get(g, t, "sparse") >= 0)
+		return error(g, "sparse gltf accessors are not supported");
+
+	a->count = json_get_int(g, t, "count", 0);
+	a->type = json_get_int(g, t, "componentType", 0);
+	a->normalize = json_get_bool(g, t, "normalized");
+	a->size = type_size(g, json_get(g, t, "type"));
+	elem = a->size * component_size(a->type);
+	if (!elem || a->count <= 0)
+		return error(g, "bad gltf accessor");
+
+	v = json_item(&g->views, json_get_int(g, t, "bufferView", -1));
+	if (v < 0)
+		return error(g, "gltf accessors without buffer views are not supported");
+	buffer = json_get_int(g, v, "buffer", -1);
+	offset = json_get_int(g, v, "byteOffset", 0);
+	length = json_get_int(g, v, "byteLength", 0);
+	a->stride = json_get_int(g, v, "byteStride", elem);
+	if (buffer < 0 || buffer >= g->buffers.count || offset < 0 || length < 0 ||
+			(long long)offset + length > g->buffer_len[buffer])
+		return error(g, "bad gltf buffer view");
+
+	t = json_get_int(g, t, "byteOffset", 0);
+	last = t + (long long)a->stride * (a->count - 1) + elem;
+	if (t < 0 || a->stride < elem || last > length)
+		return error(g, "gltf accessor is out of bounds");
+
+	a->data = g->buffer[buffer] + offset + t;
+	return 1;
+}
+
+static float read_component(const unsigned char *p, int type, int normalize)
+{
+	switch (type) {
+	case GL_BYTE: {
+		signed char v = *p;
+		return normalize ? MAX(v / 127.0f, -1) : v;
+	}
+	case GL_UNSIGNED_BYTE:
+		return normalize ? *p / 255.0f : *p;
+	case GL_SHORT: {
+		short v;
+		memcpy(&v, p, 2);
+		return normalize ? MAX(v / 32767.0f, -1) : v;
+	}
+	case GL_UNSIGNED_SHORT: {
+		unsigned short v;
+		memcpy(&v, p, 2);
+		return normalize ? v / 65535.0f : v;
+	}
+	case GL_UNSIGNED_INT: {
+		unsigned int v;
+		memcpy(&v, p, 4);
+		return v;
+	}
+	default: {
+		float v;
+		memcpy(&v, p, 4);
+		return v;
+	}
+	}
+}
+
+/* Read an element as n floats; missing components are 0, or 1 for w. */
+static void read_floats(const struct accessor *a, int i, float *out, int n)
+{
+	const unsigned char *p = a->data + i * a->stride;
+	int k, size = component_size(a->type);
+	for (k = 0; k < n; k++)
+		out[k] = k < a->size ? read_component(p + k * size, a->type, a->normalize) : k == 3;
+}
+
+static unsigned int read_index(const struct accessor *a, int i)
+{
+	const unsigned char *p = a->data + i * a->stride;
+	unsigned short s;
+	unsigned int v;
+	switch (a->type) {
+	case GL_UNSIGNED_BYTE: return *p;
+	case GL_UNSIGNED_SHORT: memcpy(&s, p, 2); return s;
+	default: memcpy(&v, p, 4); return v;
+	}
+}
+
+/* nodes */
+
+/* Nodes may be scaled to zero to hide them; such transforms have no inverse. */
+static void invert_node_matrix(mat4 out, const mat4 m)
+{
+	vec3 v;
+	vec_cross(v, m+0, m+4);
+	if (vec_dot(v, m+8) == 0)
+		mat_identity(out);
+	else
+		mat_invert(out, m);
+}
+
+static void calc_node_world(struct gltf *g, int i, unsigned char *state)
+{
+	int p = g->node_parent[i];
+	state[i] = 1;
+	if (p >= 0 && state[p] == 0)
+		calc_node_world(g, p, state);
+	if (p >= 0 && state[p] == 2)
+		mat_mul44(g->node_world[i], g->node_world[p], g->node_local[i]);
+	else
+		mat_copy(g->node_world[i], g->node_local[i]); /* a root, or a cycle */
+	state[i] = 2;
+}
+
+static void init_nodes(struct gltf *g)
+{
+	int n = g->nodes.count;
+	unsigned char *state = arena_calloc(n, 1);
+	int i, k;
+
+	g->node_parent = arena_alloc(n * sizeof *g->node_parent);
+	g->node_pose = arena_alloc(n * sizeof *g->node_pose);
+	g->node_local = arena_alloc(n * sizeof *g->node_local);
+	g->node_world = arena_alloc(n * sizeof *g->node_world);
+
+	for (i = 0; i < n; i++)
+		g->node_parent[i] = -1;
+
+	for (i = 0; i < n; i++) {
+		int t = g->nodes.item[i];
+		struct pose *pose = g->node_pose + i;
+		struct json_list children = json_items(g, json_get(g, t, "children"));
+
+		for (k = 0; k < children.count; k++) {
+			int c = json_int(g, children.item[k], -1);
+			if (c >= 0 && c < n && c != i && g->node_parent[c] < 0)
+				g->node_parent[c] = i;
+		}
+
+		if (json_get(g, t, "matrix") >= 0) {
+			mat_identity(g->node_local[i]);
+			json_get_floats(g, t, "matrix", g->node_local[i], 16);
+			g->node_local[i][3] = g->node_local[i][7] = g->node_local[i][11] = 0;
+			g->node_local[i][15] = 1;
+			mat_decompose(g->node_local[i], pose->position, pose->rotation, pose->scale);
+		} else {
+			vec_init(pose->position, 0, 0, 0);
+			quat_init(pose->rotation, 0, 0, 0, 1);
+			vec_init(pose->scale, 1, 1, 1);
+			json_get_floats(g, t, "translation", pose->position, 3);
+			json_get_floats(g, t, "rotation", pose->rotation, 4);
+			json_get_floats(g, t, "scale", pose->scale, 3);
+			mat_from_pose(g->node_local[i], pose->position, pose->rotation, pose->scale);
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		if (!state[i])
+			calc_node_world(g, i, state);
+}
+
+/* Mark the nodes of the default scene, or all of them if there are no scenes. */
+static unsigned char *find_scene_nodes(struct gltf *g, int root)
+{
+	int n = g->nodes.count;
+	unsigned char *in_scene = arena_calloc(n, 1);
+	struct json_list scenes = json_items(g, json_get(g, root, "scenes"));
+	struct json_list roots;
+	int i, k, changed;
+
+	if (scenes.count == 0) {
+		memset(in_scene, 1, n);
+		return in_scene;
+	}
+
+	roots = json_items(g, json_get(g, json_item(&scenes, json_get_int(g, root, "scene", 0)), "nodes"));
+	for (i = 0; i < roots.count; i++) {
+		k = json_int(g, roots.item[i], -1);
+		if (k >= 0 && k < n)
+			in_scene[k] = 1;
+	}
+
+	/* parents come in any order, so spread down until nothing changes */
+	do {
+		changed = 0;
+		for (i = 0; i < n; i++) {
+			if (!in_scene[i] && g->node_parent[i] >= 0 && in_scene[g->node_parent[i]]) {
+				in_scene[i] = 1;
+				changed = 1;
+			}
+		}
+	} while (changed);
+
+	return in_scene;
+}
+
+/* skeleton */
+
+static struct skel *make_skel(struct gltf *g, int skin)
+{
+	struct json_list joints = json_items(g, json_get(g, skin, "joints"));
+	struct skel *skel;
+	char name[80];
+	int *depth;
+	int i, k, m, d, max_depth;
+
+	if (joints.count == 0)
+		return NULL;
+	if (joints.count > MAXBONE) {
+		error(g, "too many bones in gltf");
+		return NULL;
+	}
+
+	g->joint_count = joints.count;
+	g->joint_node = arena_alloc(joints.count * sizeof *g->joint_node);
+	g->joint_parent = arena_alloc(joints.count * sizeof *g->joint_parent);
+	g->order = arena_alloc(joints.count * sizeof *g->order);
+	g->remap = arena_alloc(joints.count * sizeof *g->remap);
+	g->pre = arena_alloc(joints.count * sizeof *g->pre);
+	g->has_pre = arena_calloc(joints.count, 1);
+	g->node_joint = arena_alloc(g->nodes.count * sizeof *g->node_joint);
+	depth = arena_calloc(joints.count, sizeof *depth);
+
+	for (i = 0; i < g->nodes.count; i++)
+		g->node_joint[i] = -1;
+	for (k = 0; k < joints.count; k++) {
+		g->joint_node[k] = json_int(g, joints.item[k], -1);
+		if (g->joint_node[k] < 0 || g->joint_node[k] >= g->nodes.count || g->node_joint[g->joint_node[k]] >= 0) {
+			error(g, "bad gltf skin joint");
+			return NULL;
+		}
+		g->node_joint[g->joint_node[k]] = k;
+	}
+
+	/* the parent of a joint is its closest ancestor in the skin */
+	for (k = 0; k < joints.count; k++) {
+		g->joint_parent[k] = -1;
+		for (i = g->node_parent[g->joint_node[k]], d = 0; i >= 0 && d < g->nodes.count; i = g->node_parent[i], d++) {
+			if (g->node_joint[i] >= 0) {
+				g->joint_parent[k] = g->node_joint[i];
+				break;
+			}
+		}
+	}
+
+	max_depth = 0;
+	for (k = 0; k < joints.count; k++) {
+		for (i = g->joint_parent[k]; i >= 0 && depth[k] < joints.count; i = g->joint_parent[i])
+			depth[k]++;
+		max_depth = MAX(max_depth, depth[k]);
+	}
+
+	m = 0;
+	for (d = 0; d <= max_depth; d++)
+		for (k = 0; k < joints.count; k++)
+			if (depth[k] == d)
+				g->order[m++] = k;
+	for (m = 0; m < joints.count; m++)
+		g->remap[g->order[m]] = m;
+
+	skel = malloc(sizeof(struct skel));
+	skel->tag = TAG_SKEL;
+	skel->count = joints.count;
+	for (m = 0; m < joints.count; m++) {
+		int node, parent_node, joint_parent_node;
+		k = g->order[m];
+		node = g->joint_node[k];
+		parent_node = g->node_parent[node];
+		joint_parent_node = g->joint_parent[k] >= 0 ? g->joint_node[g->joint_parent[k]] : -1;
+
+		json_string(g, json_get(g, g->nodes.item[node], "name"), name, sizeof name);
+		if (!name[0])
+			snprintf(name, sizeof name, "joint%d", k);
+		strlcpy(skel->name[m], name, sizeof skel->name[0]);
+		skel->parent[m] = g->joint_parent[k] >= 0 ? g->remap[g->joint_parent[k]] : -1;
+		skel->pose[m] = g->node_pose[node];
+
+		/* fold the transforms of any nodes in between into the pose */
+		if (parent_node != joint_parent_node) {
+			mat4 inv, m4;
+			if (joint_parent_node >= 0) {
+				invert_node_matrix(inv, g->node_world[joint_parent_node]);
+				mat_mul44(g->pre[k], inv, g->node_world[parent_node]);
+			} else {
+				mat_copy(g->pre[k], g->node_world[parent_node]);
+			}
+			g->has_pre[k] = 1;
+			mat_mul44(m4, g->pre[k], g->node_local[node]);
+			mat_decompose(m4, skel->pose[m].position, skel->pose[m].rotation, skel->pose[m].scale);
+		}
+	}
+
+	return skel;
+}
+
+static mat4 *make_inv_bind_matrix(struct gltf *g, int skin, struct skel *skel)
+{
+	static __thread mat4 loc_bind_matrix[MAXBONE];
+	static __thread mat4 abs_bind_matrix[MAXBONE];
+	mat4 *inv_bind_matrix = malloc(sizeof(mat4) * skel->count);
+	struct accessor a;
+	int m;
+
+	if (json_get(g, skin, "inverseBindMatrices") >= 0) {
+		if (get_accessor(g, json_get_int(g, skin, "inverseBindMatrices", -1), &a) &&
+				a.size == 16 && a.type == GL_FLOAT && a.count >= skel->count) {
+			for (m = 0; m < skel->count; m++)
+				read_floats(&a, g->order[m], inv_bind_matrix[m], 16);
+			return inv_bind_matrix;
+		}
+		warn_once(g, 1, "ignoring bad inverse bind matrices");
+	}
+
+	calc_matrix_from_pose(loc_bind_matrix, skel->pose, skel->count);
+	calc_abs_matrix(abs_bind_matrix, loc_bind_matrix, skel->parent, skel->count);
+	for (m = 0; m < skel->count; m++)
+		invert_node_matrix(inv_bind_matrix[m], abs_bind_matrix[m]);
+	return inv_bind_matrix;
+}
+
+/* animations */
+
+static float *pose_channel(struct pose *pose, int path)
+{
+	return path == 0 ? pose->position : path == 1 ? pose->rotation : pose->scale;
+}
+
+static void sample_channel(const struct accessor *in, const struct accessor *out, int interp, int path, float t, float *value)
+{
+	int n = path == 1 ? 4 : 3;
+	int cubic = interp == 2;
+	int lo = 0, hi = in->count - 1, k;
+	float t0, t1, u, a[4], b[4];
+
+	read_floats(in, 0, &t0, 1);
+	read_floats(in, hi, &t1, 1);
+	if (t <= t0 || in->count == 1) {
+		read_floats(out, cubic ? 1 : 0, value, n);
+		return;
+	}
+	if (t >= t1) {
+		read_floats(out, cubic ? hi * 3 + 1 : hi, value, n);
+		return;
+	}
+
+	/* the last key at or before t */
+	while (hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+		float tm;
+		read_floats(in, mid, &tm, 1);
+		if (tm <= t)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	read_floats(in, lo, &t0, 1);
+	read_floats(in, hi, &t1, 1);
+	u = t1 > t0 ? (t - t0) / (t1 - t0) : 0;
+
+	if (interp == 1) {
+		read_floats(out, lo, value, n);
+	} else if (cubic) {
+		/* hermite spline through the values, with the tangents scaled by the key spacing */
+		float d = t1 - t0, u2 = u * u, u3 = u2 * u;
+		float v0[4], m0[4], v1[4], m1[4];
+		read_floats(out, lo * 3 + 1, v0, n);
+		read_floats(out, lo * 3 + 2, m0, n);
+		read_floats(out, hi * 3 + 1, v1, n);
+		read_floats(out, hi * 3, m1, n);
+		for (k = 0; k < n; k++)
+			value[k] = (2*u3 - 3*u2 + 1) * v0[k] + (u3 - 2*u2 + u) * d * m0[k] +
+				(-2*u3 + 3*u2) * v1[k] + (u3 - u2) * d * m1[k];
+		if (path == 1)
+			quat_normalize(value, value);
+	} else {
+		read_floats(out, lo, a, n);
+		read_floats(out, hi, b, n);
+		if (path == 1) {
+			quat_lerp_neighbor_normalize(value, a, b, u);
+		} else {
+			for (k = 0; k < n; k++)
+				value[k] = a[k] + (b[k] - a[k]) * u;
+		}
+	}
+}
+
+static const float pose_epsilon[10] = {
+	0.0001, 0.0001, 0.0001,
+	0.0001, 0.0001, 0.0001, 0.0001,
+	0.001, 0.001, 0.001,
+};
+
+/* Store the channels that change between frames, like the IQE loader does. */
+static struct anim *make_anim(struct skel *skel, char *name, struct pose *frame, int frames)
+{
+	struct anim *anim = malloc(sizeof(struct anim));
+	float *out;
+	int f, i, k;
+
+	anim->tag = TAG_ANIM;
+	anim->name = name;
+	anim->framerate = FRAMERATE;
+	anim->loop = 0;
+	anim->skel = skel;
+	anim->next = NULL;
+	anim->anim_map_head = NULL;
+	anim->frames = frames;
+	anim->channels = 0;
+
+	for (i = 0; i < MAXBONE; i++) {
+		anim->mask[i] = 0;
+		if (i < skel->count)
+			anim->pose[i] = frame[i];
+	}
+	for (f = 1; f < frames; f++) {
+		for (i = 0; i < skel->count; i++) {
+			const float *a = anim->pose[i].position, *b = frame[f * skel->count + i].position;
+			for (k = 0; k < 10; k++)
+				if (fabsf(a[k] - b[k]) > pose_epsilon[k])
+					anim->mask[i] |= 1 << k;
+		}
+	}
+	for (i = 0; i < skel->count; i++)
+		for (k = 0; k < 10; k++)
+			if (anim->mask[i] & (1 << k))
+				anim->channels++;
+
+	anim->data = out = malloc(sizeof(float) * MAX(anim->frames * anim->channels, 1));
+	for (f = 0; f < frames; f++) {
+		for (i = 0; i < skel->count; i++) {
+			const float *p = frame[f * skel->count + i].position;
+			for (k = 0; k < 10; k++)
+				if (anim->mask[i] & (1 << k))
+					*out++ = p[k];
+		}
+	}
+
+	return anim;
+}
+
+static struct anim *make_anims(struct gltf *g, struct skel *skel)
+{
+	struct anim *head = NULL, **tail = &head;
+	char name[80];
+	int i;
+
+	for (i = 0; i < g->animations.count; i++) {
+		int t = g->animations.item[i];
+		struct json_list channels = json_items(g, json_get(g, t, "channels"));
+		struct json_list samplers = json_items(g, json_get(g, t, "samplers"));
+		struct accessor *in = arena_alloc(MAX(channels.count, 1) * sizeof *in);
+		struct accessor *out = arena_alloc(MAX(channels.count, 1) * sizeof *out);
+		int *joint = arena_alloc(MAX(channels.count, 1) * sizeof *joint);
+		int *path = arena_alloc(MAX(channels.count, 1) * sizeof *path);
+		int *interp = arena_alloc(MAX(channels.count, 1) * sizeof *interp);
+		struct pose *frame, *p;
+		float duration = 0, last;
+		int c, f, k, m, frames, used = 0;
+
+		for (c = 0; c < channels.count; c++) {
+			int target = json_get(g, channels.item[c], "target");
+			int node = json_get_int(g, target, "node", -1);
+			int sampler = json_item(&samplers, json_get_int(g, channels.item[c], "sampler", -1));
+			int p_tok = json_get(g, target, "path");
+
+			joint[c] = node >= 0 && node < g->nodes.count ? g->node_joint[node] : -1;
+			path[c] = json_is(g, p_tok, "translation") ? 0 : json_is(g, p_tok, "rotation") ? 1 : json_is(g, p_tok, "scale") ? 2 : -1;
+			interp[c] = json_is(g, json_get(g, sampler, "interpolation"), "STEP") ? 1 :
+				json_is(g, json_get(g, sampler, "interpolation"), "CUBICSPLINE") ? 2 : 0;
+			if (joint[c] < 0 || path[c] < 0 || sampler < 0) {
+				joint[c] = -1;
+				continue;
+			}
+			if (!get_accessor(g, json_get_int(g, sampler, "input", -1), in + c) ||
+					!get_accessor(g, json_get_int(g, sampler, "output", -1), out + c) ||
+					in[c].size != 1 || out[c].size != (path[c] == 1 ? 4 : 3) ||
+					out[c].count < in[c].count * (interp[c] == 2 ? 3 : 1)) {
+				warn_once(g, 2, "skipping bad animation channels");
+				joint[c] = -1;
+				continue;
+			}
+			read_floats(in + c, in[c].count - 1, &last, 1);
+			duration = MAX(duration, last);
+			used++;
+		}
+
+		if (!used)
+			continue;
+		if (!(duration < 3600)) {
+			warn_once(g, 2, "skipping bad animation channels");
+			continue;
+		}
+
+		frames = (int)(duration * FRAMERATE + 0.5f) + 1;
+		frame = arena_alloc(frames * skel->count * sizeof *frame);
+		for (f = 0; f < frames; f++)
+			for (k = 0; k < g->joint_count; k++)
+				frame[f * skel->count + k] = g->node_pose[g->joint_node[k]];
+
+		for (c = 0; c < channels.count; c++)
+			if (joint[c] >= 0)
+				for (f = 0; f < frames; f++)
+					sample_channel(in + c, out + c, interp[c], path[c], (float)f / FRAMERATE,
+						pose_channel(frame + f * skel->count + joint[c], path[c]));
+
+		/* the frames are in skin order with local poses; make them skeleton poses */
+		p = arena_alloc(skel->count * sizeof *p);
+		for (f = 0; f < frames; f++) {
+			struct pose *fp = frame + f * skel->count;
+			for (m = 0; m < skel->count; m++) {
+				k = g->order[m];
+				p[m] = fp[k];
+				if (g->has_pre[k]) {
+					mat4 local, m4;
+					mat_from_pose(local, fp[k].position, fp[k].rotation, fp[k].scale);
+					mat_mul44(m4, g->pre[k], local);
+					mat_decompose(m4, p[m].position, p[m].rotation, p[m].scale);
+				}
+			}
+			memcpy(fp, p, skel->count * sizeof *p);
+		}
+
+		json_string(g, json_get(g, t, "name"), name, sizeof name);
+		if (!name[0])
+			snprintf(name, sizeof name, "anim%d", i);
+		*tail = make_anim(skel, strdup(name), frame, frames);
+		tail = &(*tail)->next;
+	}
+
+	return head;
+}
+
+/* meshes */
+
+static char *material_texture(struct gltf *g, int material, int *clamp)
+{
+	char uri[1024], path[1024];
+	int pbr, texture, sampler, image;
+
+	*clamp = 0;
+	pbr = json_get(g, json_item(&g->materials, material), "pbrMetallicRoughness");
+	texture = json_item(&g->textures, json_get_int(g, json_get(g, pbr, "baseColorTexture"), "index", -1));
+	if (texture < 0)
+		return NULL;
+
+	sampler = json_item(&g->samplers, json_get_int(g, texture, "sampler", -1));
+	*clamp = json_get_int(g, sampler, "wrapS", GL_REPEAT) == GL_CLAMP_TO_EDGE;
+
+	image = json_item(&g->images, json_get_int(g, texture, "source", -1));
+	json_string(g, json_get(g, image, "uri"), uri, sizeof uri);
+	if (!uri[0] || !strncmp(uri, "data:", 5)) {
+		warn_once(g, 4, "only external gltf images are supported");
+		return NULL;
+	}
+	if (g->dirname[0]) {
+		strlcpy(path, g->dirname, sizeof path);
+		strlcat(path, "/", sizeof path);
+		strlcat(path, uri, sizeof path);
+		return strdup(path);
+	}
+	return strdup(uri);
+}
+
+static int add_instance(struct gltf *g, struct instance *inst, int node, int prim)
+{
+	int attributes = json_get(g, prim, "attributes");
+	int s, a;
+
+	inst->node = node;
+	inst->material = json_get_int(g, prim, "material", -1);
+	inst->has = 0;
+	for (s = 0; s < NSEMANTIC; s++) {
+		a = json_get_int(g, attributes, semantic[s].name, -1);
+		if (a >= 0) {
+			if (!get_accessor(g, a, inst->att + s))
+				return 0;
+			if (inst->att[s].size > 4 || (s == JOINTS && inst->att[s].type != GL_UNSIGNED_BYTE &&
+					inst->att[s].type != GL_UNSIGNED_SHORT))
+				return error(g, "bad gltf vertex attribute");
+			inst->has |= 1 << s;
+		}
+	}
+	if (!(inst->has & (1 << POSITION)) || inst->att[POSITION].size != 3)
+		return error(g, "gltf primitive has no positions");
+	inst->vertex_count = inst->att[POSITION].count;
+	for (s = 0; s < NSEMANTIC; s++)
+		if ((inst->has & (1 << s)) && inst->att[s].count < inst->vertex_count)
+			return error(g, "gltf vertex attributes differ in length");
+
+	inst->has_index = json_get(g, prim, "indices") >= 0;
+	if (inst->has_index) {
+		if (!get_accessor(g, json_get_int(g, prim, "indices", -1), &inst->index))
+			return 0;
+		if (inst->index.size != 1 || (inst->index.type != GL_UNSIGNED_BYTE &&
+				inst->index.type != GL_UNSIGNED_SHORT && inst->index.type != GL_UNSIGNED_INT))
+			return error(g, "bad gltf index accessor");
+	}
+	return 1;
+}
+
+static int is_scale_translate(const mat4 m)
+{
+	return m[1] == 0 && m[2] == 0 && m[4] == 0 && m[6] == 0 && m[8] == 0 && m[9] == 0 &&
+		m[0] > 0 && m[5] > 0 && m[10] > 0;
+}
+
+/* Joint indices can only be used as stored if they all name a joint. */
+static int joints_in_range(struct gltf *g, struct instance *inst, int count)
+{
+	int i, j, k;
+	for (i = 0; i < count; i++) {
+		const struct accessor *a = &inst[i].att[JOINTS];
+		for (j = 0; j < inst[i].vertex_count; j++) {
+			float v[4];
+			read_floats(a, j, v, 4);
+			for (k = 0; k < a->size; k++)
+				if (v[k] >= g->joint_count)
+					return 0;
+		}
+	}
+	return 1;
+}
+
+/* Gather one attribute of all instances into a vertex array. */
+static void gather_array(struct gltf *g, struct instance *inst, int count, int total, int s,
+	int native, mat4 *transform, struct vertex_array *va)
+{
+	const struct accessor *a0 = &inst[0].att[s];
+	int i, j, k;
+
+	va->index = semantic[s].index;
+	va->stride = 0;
+
+	if (native && count == 1) {
+		/* straight from the file */
+		va->size = a0->size;
+		va->type = a0->type;
+		va->normalize = a0->normalize;
+		va->stride = a0->stride;
+		va->data = a0->data;
+		return;
+	}
+
+	if (native) {
+		int elem = a0->size * component_size(a0->type);
+		unsigned char *out = arena_alloc(total * elem);
+		va->size = a0->size;
+		va->type = a0->type;
+		va->normalize = a0->normalize;
+		va->data = out;
+		for (i = 0; i < count; i++) {
+			const struct accessor *a = &inst[i].att[s];
+			for (j = 0; j < inst[i].vertex_count; j++)
+				memcpy(out + (inst[i].first_vertex + j) * elem, a->data + j * a->stride, elem);
+		}
+		return;
+	}
+
+	if (s == JOINTS) {
+		/* as bytes, renumbered in skeleton order */
+		unsigned char *out = arena_alloc(total * 4);
+		va->size = 4;
+		va->type = GL_UNSIGNED_BYTE;
+		va->normalize = GL_FALSE;
+		va->data = out;
+		for (i = 0; i < count; i++) {
+			for (j = 0; j < inst[i].vertex_count; j++) {
+				float v[4];
+				read_floats(&inst[i].att[s], j, v, 4);
+				for (k = 0; k < 4; k++)
+					out[(inst[i].first_vertex + j) * 4 + k] = v[k] < g->joint_count ? g->remap[(int)v[k]] : 0;
+			}
+		}
+		return;
+	}
+
+	va->size = a0->size;
+	for (i = 1; i < count; i++)
+		va->size = MAX(va->size, inst[i].att[s].size);
+	va->type = GL_FLOAT;
+	va->normalize = GL_FALSE;
+	va->data = arena_alloc(total * va->size * sizeof(float));
+
+	for (i = 0; i < count; i++) {
+		float *out = (float*)va->data + inst[i].first_vertex * va->size;
+		mat4 inv;
+		int flip = 0;
+		if (transform) {
+			invert_node_matrix(inv, transform[i]);
+			flip = mat_is_negative(transform[i]);
+		}
+		for (j = 0; j < inst[i].vertex_count; j++, out += va->size) {
+			float v[4];
+			read_floats(&inst[i].att[s], j, v, 4);
+			if (transform && s == POSITION) {
+				mat_vec_mul(out, transform[i], v);
+			} else if (transform && s == NORMAL) {
+				mat_vec_mul_t(out, inv, v);
+				vec_normalize(out, out);
+			} else if (transform && s == TANGENT) {
+				mat_vec_mul_n(out, transform[i], v);
+				vec_normalize(out, out);
+				out[3] = flip ? -v[3] : v[3];
+			} else {
+				memcpy(out, v, va->size * sizeof(float));
+			}
+		}
+	}
+}
+
+static struct mesh_data *make_mesh(struct gltf *g, struct instance *inst, int count, struct skel *skel, int skin)
+{
+	struct vertex_array va[NSEMANTIC];
+	struct mesh_data *mesh;
+	struct part_data *part;
+	unsigned int *index;
+	mat4 *transform = NULL;
+	int i, j, s, n, array_count = 0, total = 0, index_count = 0, part_count = 0, fold, common;
+
+	for (i = 0; i < count; i++) {
+		inst[i].first_vertex = total;
+		total += inst[i].vertex_count;
+		index_count += (inst[i].has_index ? inst[i].index.count : inst[i].vertex_count) / 3 * 3;
+	}
+
+	/* check the indices before anything is built from them */
+	index = arena_alloc(MAX(index_count, 1) * sizeof *index);
+	for (i = 0, n = 0; i < count; i++) {
+		int flip = !skel && mat_is_negative(g->node_world[inst[i].node]);
+		int m = (inst[i].has_index ? inst[i].index.count : inst[i].vertex_count) / 3 * 3;
+		for (j = 0; j < m; j++) {
+			unsigned int v = inst[i].has_index ? read_index(&inst[i].index, j) : (unsigned)j;
+			if (v >= (unsigned)inst[i].vertex_count) {
+				error(g, "gltf index is out of range");
+				return NULL;
+			}
+			index[n + j] = v + inst[i].first_vertex;
+		}
+		if (flip) {
+			for (j = 0; j < m; j += 3) {
+				unsigned int t = index[n + j + 1];
+				index[n + j + 1] = index[n + j + 2];
+				index[n + j + 2] = t;
+			}
+		}
+		n += m;
+	}
+
+	/* skinned meshes are not placed by their node; static ones are */
+	common = 1;
+	for (i = 1; i < count; i++)
+		if (memcmp(g->node_world[inst[i].node], g->node_world[inst[0].node], sizeof(mat4)))
+			common = 0;
+	fold = skel || (common && is_scale_translate(g->node_world[inst[0].node]));
+	if (fold && !skel && (inst[0].has & (1 << NORMAL | 1 << TANGENT))) {
+		const float *m = g->node_world[inst[0].node];
+		if (fabsf(m[0] - m[5]) > 1e-5f * m[0] || fabsf(m[0] - m[10]) > 1e-5f * m[0])
+			fold = 0; /* non-uniform scale bends normals */
+	}
+	if (!fold) {
+		transform = arena_alloc(count * sizeof *transform);
+		for (i = 0; i < count; i++)
+			mat_copy(transform[i], g->node_world[inst[i].node]);
+	}
+
+	for (s = 0; s < NSEMANTIC; s++) {
+		int native = 1;
+		for (i = 0; i < count; i++)
+			if (!(inst[i].has & (1 << s)))
+				break;
+		if (i < count)
+			continue; /* only attributes that every primitive has */
+		if ((s == JOINTS || s == WEIGHTS) && !skel)
+			continue;
+		for (i = 1; i < count; i++) {
+			const struct accessor *a = &inst[i].att[s], *a0 = &inst[0].att[s];
+			if (a->type != a0->type || a->size != a0->size || a->normalize != a0->normalize)
+				native = 0;
+		}
+		if (transform && (s == POSITION || s == NORMAL || s == TANGENT))
+			native = 0;
+		if (s == JOINTS)
+			for (j = 0; j < g->joint_count; j++)
+				if (g->order[j] != j)
+					native = 0;
+		if (s == JOINTS && native && !joints_in_range(g, inst, count))
+			native = 0;
+		gather_array(g, inst, count, total, s, native, transform, va + array_count++);
+	}
+
+	mesh = calloc(1, sizeof(struct mesh_data));
+	mesh->skel = skel;
+	mesh->inv_bind_matrix = skel ? make_inv_bind_matrix(g, skin, skel) : NULL;
+
+	mesh->part = part = malloc(count * sizeof(struct part_data));
+	for (i = 0, n = 0; i < count; i++) {
+		int clamp, m = (inst[i].has_index ? inst[i].index.count : inst[i].vertex_count) / 3 * 3;
+		char *material = material_texture(g, inst[i].material, &clamp);
+		int double_sided = json_get_bool(g, json_item(&g->materials, inst[i].material), "doubleSided");
+		/* merge parts if they share materials */
+		if (part_count > 0 && part[part_count-1].clamp == clamp && part[part_count-1].double_sided == double_sided &&
+				((!material && !part[part_count-1].material) ||
+				(material && part[part_count-1].material && !strcmp(material, part[part_count-1].material)))) {
+			part[part_count-1].count += m;
+			free(material);
+		} else {
+			part[part_count].material = material;
+			part[part_count].clamp = clamp;
+			part[part_count].double_sided = double_sided;
+			part[part_count].first = n;
+			part[part_count].count = m;
+			part_count++;
+		}
+		n += m;
+	}
+	mesh->part_count = part_count;
+
+	mesh->vertex_count = total;
+	build_vertex_layout(mesh, va, array_count);
+
+	/* the node transform still has to be applied to positions that kept their format */
+	if (fold && !skel) {
+		const float *m = g->node_world[inst[0].node];
+		for (s = 0; s < 3; s++) {
+			mesh->position_offset[s] = mesh->position_offset[s] * m[s*5] + m[12+s];
+			mesh->position_scale[s] *= m[s*5];
+		}
+	}
+
+	set_mesh_indices(mesh, index, index_count);
+
+	return mesh;
+}
+
+struct model *decode_gltf_from_memory(const char *filename, const unsigned char *data, int len)
+{
+	struct gltf gltf, *g = &gltf;
+	struct instance *inst;
+	struct skel *skel = NULL;
+	struct mesh_data *mesh = NULL;
+	struct anim *anim = NULL;
+	struct model *model;
+	const unsigned char *bin = NULL;
+	unsigned int header[5];
+	unsigned char *in_scene;
+	int i, k, root, skin = -1, count, cap, bin_len = 0, ok = 0;
+	char *s;
+
+	memset(g, 0, sizeof *g);
+	g->filename = filename;
+	strlcpy(g->dirname, filename, sizeof g->dirname);
+	s = strrchr(g->dirname, '/');
+	if (!s) s = strrchr(g->dirname, '\\');
+	if (s) s[0] = 0; else strlcpy(g->dirname, "", sizeof g->dirname);
+
+	if (len < 20) { error(g, "bad glb file"); return NULL; }
+	memcpy(header, data, 20);
+	if (header[0] != GLB_MAGIC) { error(g, "bad glb magic"); return NULL; }
+	if (header[1] != 2) { error(g, "bad glb version"); return NULL; }
+	if (header[2] < 20 || header[2] > (unsigned)len || header[4] != GLB_JSON || header[3] > header[2] - 20) { error(g, "bad glb chunk"); return NULL; }
+
+	g->text = (const char*)data + 20;
+	i = 20 + ((header[3] + 3) & ~3);
+	if (i + 8 <= header[2]) {
+		unsigned int chunk[2];
+		memcpy(chunk, data + i, 8);
+		if (chunk[1] == GLB_BIN && chunk[0] <= header[2] - i - 8) {
+			bin = data + i + 8;
+			bin_len = chunk[0];
+		}
+	}
+
+	arena_begin();
+
+	if (!parse_value(g, g->text, g->text + header[3], 0) || g->token[0].type != JSON_OBJECT) {
+		error(g, "bad gltf json");
+		goto done;
+	}
+
+	root = 0;
+	g->buffers = json_items(g, json_get(g, root, "buffers"));
+	g->views = json_items(g, json_get(g, root, "bufferViews"));
+	g->accessors = json_items(g, json_get(g, root, "accessors"));
+	g->nodes = json_items(g, json_get(g, root, "nodes"));
+	g->meshes = json_items(g, json_get(g, root, "meshes"));
+	g->materials = json_items(g, json_get(g, root, "materials"));
+	g->textures = json_items(g, json_get(g, root, "textures"));
+	g->samplers = json_items(g, json_get(g, root, "samplers"));
+	g->images = json_items(g, json_get(g, root, "images"));
+	g->skins = json_items(g, json_get(g, root, "skins"));
+	g->animations = json_items(g, json_get(g, root, "animations"));
+
+	if (!load_buffers(g, bin, bin_len))
+		goto done;
+
+	init_nodes(g);
+	in_scene = find_scene_nodes(g, root);
+
+	/* the first skinned node picks the skin; a file of only animations uses the first */
+	for (i = 0; i < g->nodes.count && skin < 0; i++)
+		if (in_scene[i] && json_get(g, g->nodes.item[i], "mesh") >= 0)
+			skin = json_get_int(g, g->nodes.item[i], "skin", -1);
+	if (skin >= g->skins.count)
+		skin = -1;
+	if (skin < 0 && g->skins.count > 0 && g->animations.count > 0)
+		skin = 0;
+
+	count = cap = 0;
+	inst = NULL;
+	for (i = 0; i < g->nodes.count; i++) {
+		int node = g->nodes.item[i];
+		struct json_list prims;
+		if (!in_scene[i] || json_get(g, node, "mesh") < 0)
+			continue;
+		if (json_get_int(g, node, "skin", -1) != skin) {
+			warn_once(g, 8, "skipping meshes that are not bound to the skin");
+			continue;
+		}
+		prims = json_items(g, json_get(g, json_item(&g->meshes, json_get_int(g, node, "mesh", -1)), "primitives"));
+		for (k = 0; k < prims.count; k++) {
+			if (json_get_int(g, prims.item[k], "mode", 4) != 4) {
+				warn_once(g, 16, "only triangle primitives are supported");
+				continue;
+			}
+			if (count == cap) {
+				cap = cap ? cap * 2 : 16;
+				inst = arena_realloc(inst, cap * sizeof *inst);
+			}
+			if (!add_instance(g, inst + count, i, prims.item[k]))
+				goto done;
+			count++;
+		}
+	}
+
+	if (skin >= 0) {
+		skel = make_skel(g, g->skins.item[skin]);
+		if (!skel)
+			goto done;
+	}
+
+	if (count > 0) {
+		mesh = make_mesh(g, inst, count, skel, skin >= 0 ? g->skins.item[skin] : -1);
+		if (!mesh)
+			goto done;
+	}
+
+	if (skel)
+		anim = make_anims(g, skel);
+
+	ok = 1;
+
+done:
+	for (i = 0; i < MAXBUFFER; i++)
+		release_file_view(g->file_view[i]);
+	arena_end();
+
+	if (!ok) {
+		free(skel);
+		return NULL;
+	}
+
+	model = malloc(sizeof *model);
+	model->skel = skel;
+	model->mesh = NULL;
+	model->anim = anim;
+	model->mesh_data = mesh;
+	return model;
+}
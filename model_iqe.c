@@ -1,7 +1,5 @@
 #include "mio.h"
 
-#include <ctype.h>
-
 #define IQE_MAGIC "# Inter-Quake Export"
 
 #define TAG_DOUBLESIDED "doublesided"
@@ -16,7 +14,7 @@ struct floatarray {
 
 struct intarray {
 	int len, cap;
-	unsigned short *data;
+	unsigned int *data;
 };
 
 struct bytearray {
@@ -26,40 +24,40 @@ struct bytearray {
 
 struct partarray {
 	int len, cap;
-	struct part *data;
+	struct part_data *data;
 };
 
-// temp buffers are global so we can reuse them between meshs
-static struct floatarray position = { 0, 0, NULL };
-static struct floatarray normal = { 0, 0, NULL };
-static struct floatarray texcoord = { 0, 0, NULL };
-static struct bytearray color = { 0, 0, NULL };
-static struct bytearray blendindex = { 0, 0, NULL };
-static struct bytearray blendweight = { 0, 0, NULL };
-static struct intarray element = { 0, 0, NULL };
-static struct partarray part = { 0, 0, NULL };
-
-static struct bytearray customb[10] = { { 0 } };
-static struct floatarray customf[10] = { { 0 } };
-static int custom_format[10] = { 0 };
-static int custom_count[10] = { 0 };
-static char custom_name[10][80] = { { 0 } };
+// temp buffers are per thread, and live in its arena for the length of a load
+static __thread struct floatarray position = { 0, 0, NULL };
+static __thread struct floatarray normal = { 0, 0, NULL };
+static __thread struct floatarray texcoord = { 0, 0, NULL };
+static __thread struct bytearray color = { 0, 0, NULL };
+static __thread struct bytearray blendindex = { 0, 0, NULL };
+static __thread struct bytearray blendweight = { 0, 0, NULL };
+static __thread struct intarray element = { 0, 0, NULL };
+static __thread struct partarray part = { 0, 0, NULL };
+
+static __thread struct bytearray customb[10] = { { 0 } };
+static __thread struct floatarray customf[10] = { { 0 } };
+static __thread int custom_format[10] = { 0 };
+static __thread int custom_count[10] = { 0 };
+static __thread char custom_name[10][80] = { { 0 } };
 
 static inline void push_float(struct floatarray *a, float v)
 {
 	if (a->len + 1 >= a->cap) {
 		a->cap = 600 + a->cap * 2;
-		a->data = realloc(a->data, a->cap * sizeof(*a->data));
+		a->data = arena_realloc(a->data, a->cap * sizeof(*a->data));
 	}
 	a->data[a->len++] = v;
 }
 
 static inline void push_int(struct intarray *a, int v)
 {
-	assert(v >= 0 && v < 65535);
+	assert(v >= 0);
 	if (a->len + 1 >= a->cap) {
 		a->cap = 600 + a->cap * 2;
-		a->data = realloc(a->data, a->cap * sizeof(*a->data));
+		a->data = arena_realloc(a->data, a->cap * sizeof(*a->data));
 	}
 	a->data[a->len++] = v;
 }
@@ -68,43 +66,30 @@ static inline void push_byte(struct bytearray *a, int v)
 {
 	if (a->len + 1 >= a->cap) {
 		a->cap = 600 + a->cap * 2;
-		a->data = realloc(a->data, a->cap * sizeof(*a->data));
+		a->data = arena_realloc(a->data, a->cap * sizeof(*a->data));
 	}
 	a->data[a->len++] = v;
 }
 
-static inline void dup_float(struct floatarray *a, int i, int size)
-{
-	if (a->len > i * size) {
-		int k;
-		for (k = 0; k < size; k++)
-			push_float(a, a->data[i*size+k]);
-	}
-}
-
-static inline void dup_byte(struct bytearray *a, int i, int size)
-{
-	if (a->len > i * size) {
-		int k;
-		for (k = 0; k < size; k++)
-			push_byte(a, a->data[i*size+k]);
-	}
-}
-
-static inline void push_part(struct partarray *a, int first, int last, int material)
+static inline void push_part(struct partarray *a, int first, int last, char *material, int clamp, int double_sided)
 {
 	/* merge parts if they share materials */
-	if (a->len > 0 && a->data[a->len-1].material == material) {
-		a->data[a->len-1].count += last - first;
-		return;
+	if (a->len > 0 && a->data[a->len-1].clamp == clamp && a->data[a->len-1].double_sided == double_sided) {
+		char *prev = a->data[a->len-1].material;
+		if ((!prev && !material[0]) || (prev && !strcmp(prev, material))) {
+			a->data[a->len-1].count += last - first;
+			return;
+		}
 	}
 	if (a->len + 1 >= a->cap) {
 		a->cap = 600 + a->cap * 2;
-		a->data = realloc(a->data, a->cap * sizeof(*a->data));
+		a->data = arena_realloc(a->data, a->cap * sizeof(*a->data));
 	}
 	a->data[a->len].first = first;
 	a->data[a->len].count = last - first;
-	a->data[a->len].material = material;
+	a->data[a->len].material = material[0] ? strdup(material) : NULL;
+	a->data[a->len].clamp = clamp;
+	a->data[a->len].double_sided = double_sided;
 	a->len++;
 }
 
@@ -165,21 +150,14 @@ static void add_custom(int i, float x, float y, float z, float w)
 	}
 }
 
-static void dup_vert(int k)
+static void add_array(struct vertex_array *va, int index, int size, int type, int normalize, const void *data)
 {
-	int i;
-	dup_float(&position, k, 3);
-	dup_float(&normal, k, 3);
-	dup_float(&texcoord, k, 2);
-	dup_byte(&color, k, 4);
-	dup_byte(&blendindex, k, 4);
-	dup_byte(&blendweight, k, 4);
-	for (i = 0; i < 10; i++) {
-		if (custom_format[i] == 'b')
-			dup_byte(&customb[i], k, custom_count[i]);
-		if (custom_format[i] == 'f')
-			dup_float(&customf[i], k, custom_count[i]);
-	}
+	va->index = index;
+	va->size = size;
+	va->type = type;
+	va->normalize = normalize;
+	va->stride = 0;
+	va->data = data;
 }
 
 static void add_triangle(int a, int b, int c)
@@ -205,7 +183,7 @@ struct rawanim {
 
 static struct pose *new_raw_frame(struct rawanim *anim)
 {
-	struct rawframe *frame = malloc(sizeof(struct rawframe));
+	struct rawframe *frame = arena_alloc(sizeof(struct rawframe));
 	frame->next = NULL;
 	if (!anim->first)
 		anim->first = anim->last = frame;
@@ -218,7 +196,7 @@ static struct pose *new_raw_frame(struct rawanim *anim)
 
 static struct rawanim *new_raw_anim(struct rawanim *head, char *name)
 {
-	struct rawanim *anim = malloc(sizeof(struct rawanim));
+	struct rawanim *anim = arena_alloc(sizeof(struct rawanim));
 	anim->name = strdup(name);
 	anim->framerate = 30;
 	anim->loop = 0;
@@ -316,7 +294,8 @@ static struct anim *make_anim(struct anim *head, struct skel *skel, struct rawan
 	return anim;
 }
 
-static void process_tags(char *tags, int v0, int v1, int f0, int f1)
+/* Apply the material tags to a mesh; return whether it is double sided. */
+static int process_tags(char *tags, int v0, int v1, int f0, int f1)
 {
 	vec3 c[8];
 	int i, k, n = 0, singlesided = 0, doublesided = 0;
@@ -360,104 +339,225 @@ static void process_tags(char *tags, int v0, int v1, int f0, int f1)
 		}
 	}
 
-	if (doublesided) {
-		n = v1 - v0;
-		for (i = v0; i < v1; i++) {
-			dup_vert(i);
-			vec_scale(normal.data + (i + n) * 3, normal.data + (i + n) * 3, -1);
-		}
-		for (i = f0; i < f1; i += 3)
-			add_triangle(element.data[i] + n, element.data[i+1] + n, element.data[i+2] + n);
-	}
-
 	if (singlesided) {
 		for (i = f0; i < f1; i += 3)
 			add_triangle(element.data[i], element.data[i+1], element.data[i+2]);
 	}
+
+	/* the renderer draws the back faces, with flipped normals */
+	return doublesided;
 }
 
-static char *parsestring(char **stringp)
+/*
+ * Runs of vertex, face and pose lines make up most of a file. Large runs
+ * are split into chunks at line boundaries and parsed on several threads
+ * into records of numbers, which are then added in their original order.
+ */
+
+#define MAXCHUNK 16
+#define CHUNK_SIZE (256 << 10)
+
+struct vertex_line {
+	char type[2];
+	union {
+		float f[10];
+		int i[3];
+	} u;
+};
+
+struct line_chunk {
+	const char *start, *end;
+	int len, cap;
+	struct vertex_line *line;
+};
+
+/* grown on the worker threads, so these stay on the heap and are reused */
+static __thread struct line_chunk chunk[MAXCHUNK];
+
+static int is_vertex_line(const char *s, int n)
 {
-	char *start, *end, *s = *stringp;
-	while (isspace(*s)) s++;
-	if (*s == '"') {
-		s++;
-		start = end = s;
-		while (*end && *end != '"') end++;
-		if (*end) *end++ = 0;
-	} else {
-		start = end = s;
-		while (*end && !isspace(*end)) end++;
-		if (*end) *end++ = 0;
-	}
-	*stringp = end;
-	return start;
+	if (n != 2)
+		return 0;
+	return s[0] == 'v' || (s[0] == 'f' && (s[1] == 'm' || s[1] == 'a')) || (s[0] == 'p' && s[1] == 'q');
 }
 
-static char *parseword(char **stringp)
+static struct vertex_line *push_line(struct line_chunk *c, const char *type)
 {
-	char *start, *end, *s = *stringp;
-	while (isspace(*s)) s++;
-	start = end = s;
-	while (*end && !isspace(*end)) end++;
-	if (*end) *end++ = 0;
-	*stringp = end;
-	return start;
+	struct vertex_line *v;
+	if (c->len + 1 >= c->cap) {
+		c->cap = 600 + c->cap * 2;
+		c->line = realloc(c->line, c->cap * sizeof(*c->line));
+	}
+	v = c->line + c->len++;
+	v->type[0] = type[0];
+	v->type[1] = type[1];
+	return v;
 }
 
-static inline float parsefloat(char **stringp, float def)
+static void parse_chunk(void *arg, int k)
 {
-	char *s = parseword(stringp);
-	return *s ? atof(s) : def;
+	struct line_chunk *c = (struct line_chunk*)arg + k;
+	const char *line, *eol, *sp, *s;
+	struct vertex_line *v;
+	int i, n, a, b;
+
+	c->len = 0;
+	for (line = c->start; line < c->end; line = eol + 1) {
+		eol = find_line_end(line, c->end);
+		sp = line;
+		s = parse_word(&sp, eol, &n);
+		if (n != 2)
+			continue;
+
+		if (s[0] == 'f') {
+			/* faces are split into triangle fans */
+			a = parse_int(&sp, eol, 0);
+			b = parse_int(&sp, eol, 0);
+			sp = skip_space(sp, eol);
+			while (sp < eol) {
+				int d = parse_int(&sp, eol, -1);
+				if (d < 0)
+					break;
+				v = push_line(c, s);
+				v->u.i[0] = a;
+				v->u.i[1] = b;
+				v->u.i[2] = b = d;
+				sp = skip_space(sp, eol);
+			}
+			continue;
+		}
+
+		v = push_line(c, s);
+		if (s[0] == 'p') {
+			for (i = 0; i < 10; i++)
+				v->u.f[i] = parse_float(&sp, eol, i >= 6 ? 1 : 0);
+		} else if (s[1] == 'b') {
+			for (i = 0; i < 8; i += 2) {
+				v->u.f[i] = parse_int(&sp, eol, 0);
+				v->u.f[i+1] = parse_float(&sp, eol, i == 0 ? 1 : 0);
+			}
+		} else {
+			for (i = 0; i < 4; i++)
+				v->u.f[i] = parse_float(&sp, eol, i == 3 && s[1] == 'c' ? 1 : 0);
+		}
+	}
 }
 
-static inline int parseint(char **stringp, int def)
+/* Parse the run of vertex lines starting at p; return the first line after it. */
+static const char *parse_vertex_lines(const char *p, const char *end, int fm, struct pose *pose, int *pose_count)
 {
-	char *s = parseword(stringp);
-	return *s ? atoi(s) : def;
+	const char *run_end, *eol, *sp, *s;
+	struct vertex_line *v;
+	int i, k, n, count;
+
+	for (run_end = p; run_end < end; run_end = eol + 1) {
+		eol = find_line_end(run_end, end);
+		sp = run_end;
+		s = parse_word(&sp, eol, &n);
+		if (n > 0 && !is_vertex_line(s, n))
+			break;
+		if (eol == end) {
+			run_end = end;
+			break;
+		}
+	}
+
+	count = CLAMP((run_end - p) / CHUNK_SIZE, 1, MIN(count_processors(), MAXCHUNK));
+	chunk[0].start = p;
+	for (k = 1; k < count; k++) {
+		s = find_line_end(p + (run_end - p) * k / count, run_end);
+		chunk[k-1].end = chunk[k].start = MIN(s + 1, run_end);
+	}
+	chunk[count-1].end = run_end;
+
+	if (count > 1)
+		run_parallel(parse_chunk, chunk, count);
+	else
+		parse_chunk(chunk, 0);
+
+	for (k = 0; k < count; k++) {
+		for (i = 0, v = chunk[k].line; i < chunk[k].len; i++, v++) {
+			float *f = v->u.f;
+			if (v->type[0] == 'f') {
+				if (v->type[1] == 'm')
+					add_triangle(v->u.i[0]+fm, v->u.i[1]+fm, v->u.i[2]+fm);
+				else
+					add_triangle(v->u.i[0], v->u.i[1], v->u.i[2]);
+			} else if (v->type[0] == 'p') {
+				if (*pose_count < MAXBONE) {
+					struct pose *q = pose + (*pose_count)++;
+					vec_init(q->position, f[0], f[1], f[2]);
+					q->rotation[0] = f[3];
+					q->rotation[1] = f[4];
+					q->rotation[2] = f[5];
+					q->rotation[3] = f[6];
+					vec_init(q->scale, f[7], f[8], f[9]);
+				}
+			} else {
+				switch (v->type[1]) {
+				case 'p': add_position(f[0], f[1], f[2]); break;
+				case 'n': add_normal(f[0], f[1], f[2]); break;
+				case 't': add_texcoord(f[0], f[1]); break;
+				case 'c': add_color(f[0], f[1], f[2], f[3]); break;
+				case 'b': add_blend(f[0], f[2], f[4], f[6], f[1], f[3], f[5], f[7]); break;
+				case '0': case '1': case '2': case '3': case '4':
+				case '5': case '6': case '7': case '8': case '9':
+					add_custom(v->type[1] - '0', f[0], f[1], f[2], f[3]);
+					break;
+				}
+			}
+		}
+	}
+
+	return run_end;
 }
 
-static mat4 loc_bind_matrix[MAXBONE];
-static mat4 abs_bind_matrix[MAXBONE];
+static __thread mat4 loc_bind_matrix[MAXBONE];
+static __thread mat4 abs_bind_matrix[MAXBONE];
 
-struct model *load_iqe_from_memory(const char *filename, unsigned char *data, int len)
+struct model *decode_iqe_from_memory(const char *filename, const unsigned char *data, int len)
 {
 	char dirname[1024];
-	char *line, *next, *p, *s, *sp;
-	char tags[500];
+	char buf[1024];
+	const char *p, *end, *eol, *sp, *s;
+	char tags[500] = "";
+	char material[1024] = "";
 	char bone_name[MAXBONE][32];
 	int bone_parent[MAXBONE];
 	struct pose bind_pose[MAXBONE];
 	int bone_count = 0;
 	int pose_count = 0;
-	int material = 0;
+	int clamp = 0;
+	int double_sided = 0;
 	int first = 0;
 	int fm = 0;
-	int i;
+	int i, n;
 
 	strlcpy(dirname, filename, sizeof dirname);
-	p = strrchr(dirname, '/');
-	if (!p) p = strrchr(dirname, '\\');
-	if (p) *p = 0;
+	s = strrchr(dirname, '/');
+	if (!s) s = strrchr(dirname, '\\');
+	if (s) dirname[s - dirname] = 0;
 	else strlcpy(dirname, "", sizeof dirname);
 
-	if (memcmp(data, IQE_MAGIC, strlen(IQE_MAGIC))) {
+	if (len < strlen(IQE_MAGIC) || memcmp(data, IQE_MAGIC, strlen(IQE_MAGIC))) {
 		warn("error: bad iqe magic: '%s'", filename);
 		return NULL;
 	}
 
-	position.len = 0;
-	texcoord.len = 0;
-	normal.len = 0;
-	color.len = 0;
-	blendindex.len = 0;
-	blendweight.len = 0;
-	element.len = 0;
-	part.len = 0;
+	arena_begin();
+
+	memset(&position, 0, sizeof position);
+	memset(&texcoord, 0, sizeof texcoord);
+	memset(&normal, 0, sizeof normal);
+	memset(&color, 0, sizeof color);
+	memset(&blendindex, 0, sizeof blendindex);
+	memset(&blendweight, 0, sizeof blendweight);
+	memset(&element, 0, sizeof element);
+	memset(&part, 0, sizeof part);
 
 	for (i = 0; i < 10; i++) {
-		customb[i].len = 0;
-		customf[i].len = 0;
+		memset(&customb[i], 0, sizeof customb[i]);
+		memset(&customf[i], 0, sizeof customf[i]);
 		custom_format[i] = 0;
 		custom_count[i] = 0;
 		custom_name[i][0] = 0;
@@ -466,120 +566,31 @@ struct model *load_iqe_from_memory(const char *filename, unsigned char *data, in
 	struct pose *pose = bind_pose;
 	struct rawanim *rawanim = NULL;
 
-	data[len-1] = 0; /* over-write final newline to zero-terminate */
-
-	for (line = (char*)data; line; line = next) {
-		float x, y, z, w;
-		int a, b, c, d;
-
-		next = strchr(line, '\n');
-		if (next)
-			*next++ = 0;
+	p = (const char*)data;
+	end = p + len;
+	while (p < end) {
+		eol = find_line_end(p, end);
+		sp = p;
+		s = parse_word(&sp, eol, &n);
 
-		sp = line;
-		s = parseword(&sp);
-		if (!s) {
-			continue;
+		if (n == 0) {
+			/* blank line */
 		}
 
-		else if (s[0] == 'v' && s[1] != 0 && s[2] == 0) {
-			switch (s[1]) {
-			case 'p':
-				x = parsefloat(&sp, 0);
-				y = parsefloat(&sp, 0);
-				z = parsefloat(&sp, 0);
-				add_position(x, y, z);
-				break;
-
-			case 'n':
-				x = parsefloat(&sp, 0);
-				y = parsefloat(&sp, 0);
-				z = parsefloat(&sp, 0);
-				add_normal(x, y, z);
-				break;
-
-			case 't':
-				x = parsefloat(&sp, 0);
-				y = parsefloat(&sp, 0);
-				add_texcoord(x, y);
-				break;
-
-			case 'c':
-				x = parsefloat(&sp, 0);
-				y = parsefloat(&sp, 0);
-				z = parsefloat(&sp, 0);
-				w = parsefloat(&sp, 1);
-				add_color(x, y, z, w);
-				break;
-
-			case 'b':
-				a = parseint(&sp, 0);
-				x = parsefloat(&sp, 1);
-				b = parseint(&sp, 0);
-				y = parsefloat(&sp, 0);
-				c = parseint(&sp, 0);
-				z = parsefloat(&sp, 0);
-				d = parseint(&sp, 0);
-				w = parsefloat(&sp, 0);
-				add_blend(a, b, c, d, x, y, z, w);
-				break;
-
-			case '0': case '1': case '2': case '3': case '4':
-			case '5': case '6': case '7': case '8': case '9':
-				x = parsefloat(&sp, 0);
-				y = parsefloat(&sp, 0);
-				z = parsefloat(&sp, 0);
-				w = parsefloat(&sp, 0);
-				add_custom(s[1] - '0', x, y, z, w);
-				break;
-			}
-		}
-
-		else if (s[0] == 'f' && s[1] == 'm' && s[2] == 0) {
-			a = parseint(&sp, 0);
-			b = parseint(&sp, 0);
-			c = parseint(&sp, -1);
-			while (c > -1) {
-				add_triangle(a+fm, b+fm, c+fm);
-				b = c;
-				c = parseint(&sp, -1);
-			}
-		}
-
-		else if (s[0] == 'f' && s[1] == 'a' && s[2] == 0) {
-			a = parseint(&sp, 0);
-			b = parseint(&sp, 0);
-			c = parseint(&sp, -1);
-			while (c > -1) {
-				add_triangle(a, b, c);
-				b = c;
-				c = parseint(&sp, -1);
-			}
-		}
-
-		else if (s[0] == 'p' && s[1] == 'q' && s[2] == 0) {
-			if (pose_count < MAXBONE) {
-				pose[pose_count].position[0] = parsefloat(&sp, 0);
-				pose[pose_count].position[1] = parsefloat(&sp, 0);
-				pose[pose_count].position[2] = parsefloat(&sp, 0);
-				pose[pose_count].rotation[0] = parsefloat(&sp, 0);
-				pose[pose_count].rotation[1] = parsefloat(&sp, 0);
-				pose[pose_count].rotation[2] = parsefloat(&sp, 0);
-				pose[pose_count].rotation[3] = parsefloat(&sp, 1);
-				pose[pose_count].scale[0] = parsefloat(&sp, 1);
-				pose[pose_count].scale[1] = parsefloat(&sp, 1);
-				pose[pose_count].scale[2] = parsefloat(&sp, 1);
-				pose_count++;
-			}
+		else if (is_vertex_line(s, n)) {
+			p = parse_vertex_lines(p, end, fm, pose, &pose_count);
+			continue;
 		}
 
 		// TODO: "pm", "pa"
 
-		else if (!strcmp(s, "vertexarray")) {
-			char *type = parsestring(&sp);
-			char *format = parsestring(&sp);
-			int count = parseint(&sp, 0);
-			char *name = parsestring(&sp);
+		else if (is_word(s, n, "vertexarray")) {
+			char type[80], format[80], name[80];
+			int count;
+			parse_string(&sp, eol, type, sizeof type);
+			parse_string(&sp, eol, format, sizeof format);
+			count = parse_int(&sp, eol, 0);
+			parse_string(&sp, eol, name, sizeof name);
 			if (strstr(type, "custom") == type) {
 				i = type[6] - '0';
 				if (i >= 0 && i <= 9) {
@@ -595,57 +606,61 @@ struct model *load_iqe_from_memory(const char *filename, unsigned char *data, in
 			}
 		}
 
-		else if (!strcmp(s, "mesh")) {
-			s = parsestring(&sp);
+		else if (is_word(s, n, "mesh")) {
 			if (element.len > first) {
-				process_tags(tags, fm, position.len / 3, first, element.len);
-				push_part(&part, first, element.len, material);
+				double_sided = process_tags(tags, fm, position.len / 3, first, element.len);
+				push_part(&part, first, element.len, material, clamp, double_sided);
 			}
 			first = element.len;
 			fm = position.len / 3;
 		}
 
-		else if (!strcmp(s, "material")) {
-			s = parsestring(&sp);
-			strlcpy(tags, s, sizeof tags);
-			material = load_material(dirname, s);
+		else if (is_word(s, n, "material")) {
+			parse_string(&sp, eol, buf, sizeof buf);
+			strlcpy(tags, buf, sizeof tags);
+			material_filename(material, sizeof material, dirname, buf);
+			clamp = strstr(buf, "clamp;") != NULL;
 		}
 
-		else if (!strcmp(s, "joint")) {
+		else if (is_word(s, n, "joint")) {
 			if (bone_count < MAXBONE) {
-				char *name = parsestring(&sp);
-				strlcpy(bone_name[bone_count], name, sizeof bone_name[0]);
-				bone_parent[bone_count] = parseint(&sp, -1);
+				parse_string(&sp, eol, bone_name[bone_count], sizeof bone_name[0]);
+				bone_parent[bone_count] = parse_int(&sp, eol, -1);
 				bone_count++;
 			}
 		}
 
-		else if (!strcmp(s, "animation")) {
-			s = parsestring(&sp);
-			rawanim = new_raw_anim(rawanim, s);
+		else if (is_word(s, n, "animation")) {
+			rawanim = new_raw_anim(rawanim, parse_string(&sp, eol, buf, sizeof buf));
 		}
 
-		else if (!strcmp(s, "framerate")) {
-			rawanim->framerate = parsefloat(&sp, 30);
+		else if (is_word(s, n, "framerate")) {
+			if (rawanim)
+				rawanim->framerate = parse_float(&sp, eol, 30);
 		}
 
-		else if (!strcmp(s, "loop")) {
-			rawanim->loop = 1;
+		else if (is_word(s, n, "loop")) {
+			if (rawanim)
+				rawanim->loop = 1;
 		}
 
-		else if (!strcmp(s, "frame")) {
-			pose = new_raw_frame(rawanim);
-			pose_count = 0;
+		else if (is_word(s, n, "frame")) {
+			if (rawanim) {
+				pose = new_raw_frame(rawanim);
+				pose_count = 0;
+			}
 		}
+
+		p = eol + 1;
 	}
 
 	if (element.len > first) {
-		process_tags(tags, fm, position.len / 3, first, element.len);
-		push_part(&part, first, element.len, material);
+		double_sided = process_tags(tags, fm, position.len / 3, first, element.len);
+		push_part(&part, first, element.len, material, clamp, double_sided);
 	}
 
 	struct skel *skel = NULL;
-	struct mesh *mesh = NULL;
+	struct mesh_data *mesh = NULL;
 	struct anim *anim = NULL;
 
 	if (bone_count > 0) {
@@ -660,14 +675,11 @@ struct model *load_iqe_from_memory(const char *filename, unsigned char *data, in
 	}
 
 	if (part.len) {
-		mesh = malloc(sizeof(struct mesh));
-		mesh->tag = TAG_MESH;
-		mesh->enabled = 1<<ATT_POSITION;
+		mesh = calloc(1, sizeof(struct mesh_data));
 		mesh->skel = skel;
-		mesh->inv_bind_matrix = NULL;
-		mesh->count = part.len;
-		mesh->part = malloc(part.len * sizeof(struct part));
-		memcpy(mesh->part, part.data, part.len * sizeof(struct part));
+		mesh->part_count = part.len;
+		mesh->part = malloc(part.len * sizeof(struct part_data));
+		memcpy(mesh->part, part.data, part.len * sizeof(struct part_data));
 
 		if (skel) {
 			mesh->inv_bind_matrix = malloc(sizeof(mat4) * skel->count);
@@ -676,84 +688,37 @@ struct model *load_iqe_from_memory(const char *filename, unsigned char *data, in
 			calc_inv_matrix(mesh->inv_bind_matrix, abs_bind_matrix, skel->count);
 		}
 
+		struct vertex_array va[6];
 		int vertexcount = position.len / 3;
-		int total = 12;
-		if (normal.len / 3 == vertexcount) total += 12;
-		if (texcoord.len / 2 == vertexcount) total += 8;
-		if (color.len / 4 == vertexcount) total += 4;
-		if (blendindex.len / 4 == vertexcount) total += 4;
-		if (blendweight.len / 4 == vertexcount) total += 4;
-
-		glGenVertexArrays(1, &mesh->vao);
-		glGenBuffers(1, &mesh->vbo);
-		glGenBuffers(1, &mesh->ibo);
-
-		glBindVertexArray(mesh->vao);
-		glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
-
-		glBufferData(GL_ARRAY_BUFFER, vertexcount * total * 4, NULL, GL_STATIC_DRAW);
-
-		glEnableVertexAttribArray(ATT_POSITION);
-		glVertexAttribPointer(ATT_POSITION, 3, GL_FLOAT, 0, 0, PTR(0));
-		glBufferSubData(GL_ARRAY_BUFFER, 0, vertexcount * 12, position.data);
-		total = vertexcount * 12;
-
-		if (normal.len / 3 == vertexcount) {
-			mesh->enabled |= 1<<ATT_NORMAL;
-			glEnableVertexAttribArray(ATT_NORMAL);
-			glVertexAttribPointer(ATT_NORMAL, 3, GL_FLOAT, 0, 0, PTR(total));
-			glBufferSubData(GL_ARRAY_BUFFER, total, vertexcount * 12, normal.data);
-			total += vertexcount * 12;
-		}
-		if (texcoord.len / 2 == vertexcount) {
-			mesh->enabled |= 1<<ATT_TEXCOORD;
-			glEnableVertexAttribArray(ATT_TEXCOORD);
-			glVertexAttribPointer(ATT_TEXCOORD, 2, GL_FLOAT, 0, 0, PTR(total));
-			glBufferSubData(GL_ARRAY_BUFFER, total, vertexcount * 8, texcoord.data);
-			total += vertexcount * 8;
-		}
-		if (color.len / 4 == vertexcount) {
-			mesh->enabled |= 1<<ATT_COLOR;
-			glEnableVertexAttribArray(ATT_COLOR);
-			glVertexAttribPointer(ATT_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, PTR(total));
-			glBufferSubData(GL_ARRAY_BUFFER, total, vertexcount * 4, color.data);
-			total += vertexcount * 4;
-		}
-		if (blendindex.len / 4 == vertexcount) {
-			mesh->enabled |= 1<<ATT_BLEND_INDEX;
-			glEnableVertexAttribArray(ATT_BLEND_INDEX);
-			glVertexAttribPointer(ATT_BLEND_INDEX, 4, GL_UNSIGNED_BYTE, GL_FALSE, 0, PTR(total));
-			glBufferSubData(GL_ARRAY_BUFFER, total, vertexcount * 4, blendindex.data);
-			total += vertexcount * 4;
-		}
-		if (blendweight.len / 4 == vertexcount) {
-			mesh->enabled |= 1<<ATT_BLEND_WEIGHT;
-			glEnableVertexAttribArray(ATT_BLEND_WEIGHT);
-			glVertexAttribPointer(ATT_BLEND_WEIGHT, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, PTR(total));
-			glBufferSubData(GL_ARRAY_BUFFER, total, vertexcount * 4, blendweight.data);
-			total += vertexcount * 4;
-		}
-
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, element.len * 2, element.data, GL_STATIC_DRAW);
+		int n = 0;
+
+		add_array(va + n++, ATT_POSITION, 3, GL_FLOAT, 0, position.data);
+		if (normal.len / 3 == vertexcount)
+			add_array(va + n++, ATT_NORMAL, 3, GL_FLOAT, 0, normal.data);
+		if (texcoord.len / 2 == vertexcount)
+			add_array(va + n++, ATT_TEXCOORD, 2, GL_FLOAT, 0, texcoord.data);
+		if (color.len / 4 == vertexcount)
+			add_array(va + n++, ATT_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, color.data);
+		if (blendindex.len / 4 == vertexcount)
+			add_array(va + n++, ATT_BLEND_INDEX, 4, GL_UNSIGNED_BYTE, GL_FALSE, blendindex.data);
+		if (blendweight.len / 4 == vertexcount)
+			add_array(va + n++, ATT_BLEND_WEIGHT, 4, GL_UNSIGNED_BYTE, GL_TRUE, blendweight.data);
+
+		mesh->vertex_count = vertexcount;
+		build_vertex_layout(mesh, va, n);
+
+		set_mesh_indices(mesh, element.data, element.len);
 	}
 
-	while (rawanim) {
+	for (; rawanim; rawanim = rawanim->next)
 		anim = make_anim(anim, skel, rawanim);
-		struct rawframe *frame = rawanim->first;
-		while (frame) {
-			struct rawframe *nextframe = frame->next;
-			free(frame);
-			frame = nextframe;
-		}
-		struct rawanim *nextanim = rawanim->next;
-		free(rawanim);
-		rawanim = nextanim;
-	}
+
+	arena_end();
 
 	struct model *model = malloc(sizeof *model);
 	model->skel = skel;
-	model->mesh = mesh;
+	model->mesh = NULL;
 	model->anim = anim;
+	model->mesh_data = mesh;
 	return model;
 }
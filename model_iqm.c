@@ -33,22 +33,6 @@ static int use_vertex_array(int type, char *text)
 	return enum_of_type(type, text) >= 0;
 }
 
-static int size_of_format(int format)
-{
-	switch (format) {
-	case IQM_BYTE: return 1;
-	case IQM_UBYTE: return 1;
-	case IQM_SHORT: return 2;
-	case IQM_USHORT: return 2;
-	case IQM_INT: return 4;
-	case IQM_UINT: return 4;
-	case IQM_HALF: return 2;
-	case IQM_FLOAT: return 4;
-	case IQM_DOUBLE: return 8;
-	}
-	return 0;
-}
-
 static int enum_of_format(int format)
 {
 	switch (format) {
@@ -65,7 +49,7 @@ static int enum_of_format(int format)
 	return 0;
 }
 
-static void flip_triangles(unsigned short *dst, unsigned int *src, int count)
+static void flip_triangles(unsigned int *dst, const unsigned int *src, int count)
 {
 	while (count--) {
 		dst[0] = src[2];
@@ -76,10 +60,10 @@ static void flip_triangles(unsigned short *dst, unsigned int *src, int count)
 	}
 }
 
-static mat4 loc_bind_matrix[MAXBONE];
-static mat4 abs_bind_matrix[MAXBONE];
+static __thread mat4 loc_bind_matrix[MAXBONE];
+static __thread mat4 abs_bind_matrix[MAXBONE];
 
-struct model *load_iqm_from_memory(const char *filename, unsigned char *data, int len)
+struct model *decode_iqm_from_memory(const char *filename, const unsigned char *data, int len)
 {
 	struct iqmheader *iqm = (void*)data;
 	struct iqmvertexarray *vertexarrays = (void*)(data + iqm->ofs_vertexarrays);
@@ -90,8 +74,10 @@ struct model *load_iqm_from_memory(const char *filename, unsigned char *data, in
 	char *text = (void*)(data + iqm->ofs_text);
 	unsigned short *frames = (void*)(data + iqm->ofs_frames);
 	struct skel *skel = NULL;
-	struct mesh *mesh = NULL;
+	struct mesh_data *mesh = NULL;
 	struct anim *anim_head = NULL;
+	struct vertex_array arrays[MAXATTRIB];
+	unsigned int *index;
 	int i, f, k, total;
 
 	char *p;
@@ -106,7 +92,6 @@ struct model *load_iqm_from_memory(const char *filename, unsigned char *data, in
 	if (memcmp(iqm->magic, IQM_MAGIC, 16)) { error(filename, "bad iqm magic"); return NULL; }
 	if (iqm->version != IQM_VERSION) { error(filename, "bad iqm version"); return NULL; }
 	if (iqm->filesize > len) { error(filename, "bad iqm file size"); return NULL; }
-	if (iqm->num_vertexes > 0xffff) { error(filename, "too many vertices in iqm"); return NULL; }
 	if (iqm->num_joints > MAXBONE) { error(filename, "too many bones in iqm"); return NULL; }
 	if (iqm->num_anims && iqm->num_poses != iqm->num_joints) { error(filename, "bad joint/pose data"); return NULL; }
 
@@ -124,9 +109,7 @@ struct model *load_iqm_from_memory(const char *filename, unsigned char *data, in
 	}
 
 	if (iqm->num_meshes) {
-		mesh = malloc(sizeof(struct mesh));
-		mesh->tag = TAG_MESH;
-		mesh->enabled = 0;
+		mesh = calloc(1, sizeof(struct mesh_data));
 
 		if (skel) {
 			mesh->skel = skel;
@@ -134,56 +117,43 @@ struct model *load_iqm_from_memory(const char *filename, unsigned char *data, in
 			calc_matrix_from_pose(loc_bind_matrix, skel->pose, skel->count);
 			calc_abs_matrix(abs_bind_matrix, loc_bind_matrix, skel->parent, skel->count);
 			calc_inv_matrix(mesh->inv_bind_matrix, abs_bind_matrix, skel->count);
-		} else {
-			mesh->skel = NULL;
-			mesh->inv_bind_matrix = NULL;
 		}
 
-		mesh->count = iqm->num_meshes;
-		mesh->part = malloc(iqm->num_meshes * sizeof(struct part));
+		mesh->part_count = iqm->num_meshes;
+		mesh->part = malloc(iqm->num_meshes * sizeof(struct part_data));
 		for (i = 0; i < iqm->num_meshes; i++) {
-			mesh->part[i].material = load_material(dir, text + iqmesh[i].material);
+			char *material = text + iqmesh[i].material;
+			char texture[1024];
+			material_filename(texture, sizeof texture, dir, material);
+			mesh->part[i].material = strdup(texture);
+			mesh->part[i].clamp = strstr(material, "clamp;") != NULL;
+			mesh->part[i].double_sided = strstr(material, "doublesided;") != NULL;
 			mesh->part[i].first = iqmesh[i].first_triangle * 3;
 			mesh->part[i].count = iqmesh[i].num_triangles * 3;
 		}
 
-		glGenVertexArrays(1, &mesh->vao);
-		glGenBuffers(1, &mesh->vbo);
-		glGenBuffers(1, &mesh->ibo);
-
-		glBindVertexArray(mesh->vao);
-		glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
-
-		total = 0;
-		for (i = 0; i < iqm->num_vertexarrays; i++) {
-			struct iqmvertexarray *va = vertexarrays + i;
-			if (use_vertex_array(va->type, text))
-				total += size_of_format(va->format) * va->size * iqm->num_vertexes;
-		}
-
-		glBufferData(GL_ARRAY_BUFFER, total, NULL, GL_STATIC_DRAW);
-
 		total = 0;
-		for (i = 0; i < iqm->num_vertexarrays; i++) {
+		for (i = 0; i < iqm->num_vertexarrays && total < MAXATTRIB; i++) {
 			struct iqmvertexarray *va = vertexarrays + i;
 			if (use_vertex_array(va->type, text)) {
-				int current = size_of_format(va->format) * va->size * iqm->num_vertexes;
-				int format = enum_of_format(va->format);
-				int type = enum_of_type(va->type, text);
-				int normalize = va->type != IQM_BLENDINDEXES;
-				mesh->enabled |= 1<<type;
-				glBufferSubData(GL_ARRAY_BUFFER, total, current, data + va->offset);
-				glEnableVertexAttribArray(type);
-				glVertexAttribPointer(type, va->size, format, normalize, 0, PTR(total));
-				total += current;
+				struct vertex_array *att = arrays + total++;
+				att->index = enum_of_type(va->type, text);
+				att->size = va->size;
+				att->type = enum_of_format(va->format);
+				att->normalize = va->type != IQM_BLENDINDEXES;
+				att->stride = 0;
+				att->data = data + va->offset;
 			}
 		}
 
-		unsigned short *triangles = malloc(iqm->num_triangles * 3 * 2);
-		flip_triangles(triangles, (void*)&data[iqm->ofs_triangles], iqm->num_triangles);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, iqm->num_triangles * 3 * 2, triangles, GL_STATIC_DRAW);
-		free(triangles);
+		mesh->vertex_count = iqm->num_vertexes;
+		build_vertex_layout(mesh, arrays, total);
+
+		arena_begin();
+		index = arena_alloc(iqm->num_triangles * 3 * sizeof(unsigned int));
+		flip_triangles(index, (const void*)&data[iqm->ofs_triangles], iqm->num_triangles);
+		set_mesh_indices(mesh, index, iqm->num_triangles * 3);
+		arena_end();
 	}
 
 	for (k = 0; k < iqm->num_anims; k++) {
@@ -238,7 +208,8 @@ struct model *load_iqm_from_memory(const char *filename, unsigned char *data, in
 
 	struct model *model = malloc(sizeof(struct model));
 	model->skel = skel;
-	model->mesh = mesh;
+	model->mesh = NULL;
 	model->anim = anim_head;
+	model->mesh_data = mesh;
 	return model;
 }
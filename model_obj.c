@@ -1,7 +1,5 @@
 #include "mio.h"
 
-#define SEP " \t\r\n"
-
 struct floatarray {
 	int len, cap;
 	float *data;
@@ -9,50 +7,52 @@ struct floatarray {
 
 struct intarray {
 	int len, cap;
-	unsigned short *data;
+	unsigned int *data;
 };
 
 struct partarray {
 	int len, cap;
-	struct part *data;
+	struct part_data *data;
 };
 
-// temp buffers are global so we can reuse them between models
-static struct floatarray position = { 0, 0, NULL };
-static struct floatarray normal = { 0, 0, NULL };
-static struct floatarray texcoord = { 0, 0, NULL };
-static struct floatarray vertex = { 0, 0, NULL };
-static struct intarray element = { 0, 0, NULL };
-static struct partarray part = { 0, 0, NULL };
+// temp buffers are per thread, and live in its arena for the length of a load
+static __thread struct floatarray position = { 0, 0, NULL };
+static __thread struct floatarray normal = { 0, 0, NULL };
+static __thread struct floatarray texcoord = { 0, 0, NULL };
+static __thread struct floatarray vertex = { 0, 0, NULL };
+static __thread struct intarray element = { 0, 0, NULL };
+static __thread struct partarray part = { 0, 0, NULL };
 
 static inline void push_float(struct floatarray *a, float v)
 {
 	if (a->len + 1 >= a->cap) {
 		a->cap = 600 + a->cap * 2;
-		a->data = realloc(a->data, a->cap * sizeof(*a->data));
+		a->data = arena_realloc(a->data, a->cap * sizeof(*a->data));
 	}
 	a->data[a->len++] = v;
 }
 
 static inline void push_int(struct intarray *a, int v)
 {
-	assert(v >= 0 && v < 65535);
+	assert(v >= 0);
 	if (a->len + 1 >= a->cap) {
 		a->cap = 600 + a->cap * 2;
-		a->data = realloc(a->data, a->cap * sizeof(*a->data));
+		a->data = arena_realloc(a->data, a->cap * sizeof(*a->data));
 	}
 	a->data[a->len++] = v;
 }
 
-static inline void push_part(struct partarray *a, int first, int last, int material)
+static inline void push_part(struct partarray *a, int first, int last, char *material)
 {
 	if (a->len + 1 >= a->cap) {
 		a->cap = 600 + a->cap * 2;
-		a->data = realloc(a->data, a->cap * sizeof(*a->data));
+		a->data = arena_realloc(a->data, a->cap * sizeof(*a->data));
 	}
 	a->data[a->len].first = first;
 	a->data[a->len].count = last - first;
-	a->data[a->len].material = material;
+	a->data[a->len].material = material ? strdup(material) : NULL;
+	a->data[a->len].clamp = 0;
+	a->data[a->len].double_sided = 0;
 	a->len++;
 }
 
@@ -76,14 +76,69 @@ static void add_normal(float x, float y, float z)
 	push_float(&normal, y);
 }
 
-static int add_vertex_imp(float v[8])
+/*
+ * Weld identical vertices with a hash table of vertex numbers (plus one,
+ * so zero is an empty slot) keyed on the bits of the eight floats.
+ */
+
+static __thread struct {
+	int cap;
+	int *slot;
+} vertex_map = { 0, NULL };
+
+static unsigned int hash_vertex(const float *v)
 {
+	unsigned int h = 2166136261u, x;
 	int i;
-	for (i = vertex.len - 8; i >= 0; i -= 8)
-		if (!memcmp(vertex.data + i, v, sizeof(float) * 8))
-			return i / 8;
+	for (i = 0; i < 8; i++) {
+		memcpy(&x, v + i, 4);
+		h = (h ^ x) * 16777619u;
+	}
+	h ^= h >> 15;
+	h *= 0x2c1b3c6d;
+	h ^= h >> 12;
+	return h;
+}
+
+static int *find_vertex(const float *v)
+{
+	int mask = vertex_map.cap - 1;
+	int i = hash_vertex(v) & mask;
+	while (vertex_map.slot[i]) {
+		if (!memcmp(vertex.data + (vertex_map.slot[i] - 1) * 8, v, sizeof(float) * 8))
+			break;
+		i = (i + 1) & mask;
+	}
+	return vertex_map.slot + i;
+}
+
+static void clear_vertex_map(void)
+{
+	vertex_map.cap = 0;
+	vertex_map.slot = NULL;
+}
+
+static void grow_vertex_map(void)
+{
+	int i, n = vertex.len / 8;
+	arena_free(vertex_map.slot);
+	vertex_map.cap = vertex_map.cap ? vertex_map.cap * 2 : 4096;
+	vertex_map.slot = arena_calloc(vertex_map.cap, sizeof(int));
+	for (i = 0; i < n; i++)
+		*find_vertex(vertex.data + i * 8) = i + 1;
+}
+
+static int add_vertex_imp(float v[8])
+{
+	int i, *slot;
+	if ((vertex.len / 8 + 1) * 2 > vertex_map.cap)
+		grow_vertex_map();
+	slot = find_vertex(v);
+	if (*slot)
+		return *slot - 1;
 	for (i = 0; i < 8; i++)
 		push_float(&vertex, v[i]);
+	*slot = vertex.len / 8;
 	return vertex.len / 8 - 1;
 }
 
@@ -93,11 +148,11 @@ static int add_vertex(int pi, int ti, int ni)
 	v[0] = position.data[pi * 3 + 0];
 	v[1] = position.data[pi * 3 + 1];
 	v[2] = position.data[pi * 3 + 2];
-	v[3] = ti >= 0 && ti < texcoord.len ? texcoord.data[ti * 2 + 0] : 0;
-	v[4] = ti >= 0 && ti < texcoord.len ? texcoord.data[ti * 2 + 1] : 0;
-	v[5] = ni >= 0 && ni < normal.len ? normal.data[ni * 3 + 0] : 0;
-	v[6] = ni >= 0 && ni < normal.len ? normal.data[ni * 3 + 1] : 0;
-	v[7] = ni >= 0 && ni < normal.len ? normal.data[ni * 3 + 2] : 1;
+	v[3] = ti >= 0 && ti * 2 < texcoord.len ? texcoord.data[ti * 2 + 0] : 0;
+	v[4] = ti >= 0 && ti * 2 < texcoord.len ? texcoord.data[ti * 2 + 1] : 0;
+	v[5] = ni >= 0 && ni * 3 < normal.len ? normal.data[ni * 3 + 0] : 0;
+	v[6] = ni >= 0 && ni * 3 < normal.len ? normal.data[ni * 3 + 1] : 0;
+	v[7] = ni >= 0 && ni * 3 < normal.len ? normal.data[ni * 3 + 2] : 1;
 	return add_vertex_imp(v);
 }
 
@@ -123,152 +178,221 @@ static char *abspath(char *path, const char *dirname, const char *filename, int
 	return path;
 }
 
-static int mtl_count = 0;
+/* Materials in the order they are defined, with a hash table of their names. */
+
+struct mtl {
+	char *name;
+	char *texture;
+};
+
+static __thread struct {
+	int len, cap;
+	struct mtl *data;
+	int index_cap;
+	int *index; /* material number plus one; zero is an empty slot */
+} mtl_map = { 0, 0, NULL, 0, NULL };
+
+static int *find_mtl(const char *name)
+{
+	unsigned int h = 2166136261u;
+	const char *s = name;
+	int mask = mtl_map.index_cap - 1;
+	int i;
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	i = h & mask;
+	while (mtl_map.index[i] && strcmp(mtl_map.data[mtl_map.index[i] - 1].name, name))
+		i = (i + 1) & mask;
+	return mtl_map.index + i;
+}
+
+static void add_mtl(const char *name)
+{
+	int i, *slot;
 
-static struct {
-	char name[80];
-	int material;
-} mtl_map[256];
+	if (mtl_map.len == mtl_map.cap) {
+		mtl_map.cap = mtl_map.cap ? mtl_map.cap * 2 : 64;
+		mtl_map.data = arena_realloc(mtl_map.data, mtl_map.cap * sizeof *mtl_map.data);
+	}
+	mtl_map.data[mtl_map.len].name = arena_strdup(name);
+	mtl_map.data[mtl_map.len].texture = NULL;
+	mtl_map.len++;
+
+	if (mtl_map.len * 2 > mtl_map.index_cap) {
+		arena_free(mtl_map.index);
+		mtl_map.index_cap = mtl_map.index_cap ? mtl_map.index_cap * 2 : 256;
+		mtl_map.index = arena_calloc(mtl_map.index_cap, sizeof(int));
+		for (i = 0; i < mtl_map.len; i++) {
+			slot = find_mtl(mtl_map.data[i].name);
+			if (!*slot)
+				*slot = i + 1;
+		}
+	} else {
+		/* the first definition of a name wins */
+		slot = find_mtl(name);
+		if (!*slot)
+			*slot = mtl_map.len;
+	}
+}
 
 static void mtllib(char *dirname, char *filename)
 {
-	char path[1024];
-	char *line, *next;
-	unsigned char *data;
-	int len;
-	char *s;
+	char path[1024], buf[1024];
+	const char *p, *end, *eol, *sp, *s;
+	const unsigned char *data;
+	int len, n;
 
-	data = load_file(abspath(path, dirname, filename, sizeof path), &len);
+	data = load_file_view(abspath(path, dirname, filename, sizeof path), &len);
 	if (!data) {
 		warn("cannot load material library: '%s'", filename);
 		return;
 	}
 
-	data[len-1] = 0; /* over-write final newline to zero-terminate */
-
-	for (line = (char*)data; line; line = next) {
-		next = strchr(line, '\n');
-		if (next)
-			*next++ = 0;
+	add_cook_dependency(path, data, len);
 
-		s = strtok(line, SEP);
-		if (!s) {
+	p = (const char*)data;
+	end = p + len;
+	for (; p < end; p = eol + 1) {
+		eol = find_line_end(p, end);
+		sp = p;
+		s = parse_word(&sp, eol, &n);
+		if (n == 0) {
 			continue;
-		} else if (!strcmp(s, "newmtl")) {
-			s = strtok(NULL, SEP);
-			if (s) {
-				strlcpy(mtl_map[mtl_count].name, s, sizeof mtl_map[0].name);
-				mtl_map[mtl_count].material = 0;
-				mtl_count++;
-			}
-		} else if (!strcmp(s, "map_Kd")) {
-			s = strtok(NULL, SEP);
-			if (s && mtl_count > 0) {
-				mtl_map[mtl_count-1].material = load_texture(abspath(path, dirname, s, sizeof path), 1);
+		} else if (is_word(s, n, "newmtl")) {
+			parse_string(&sp, eol, buf, sizeof buf);
+			if (buf[0])
+				add_mtl(buf);
+		} else if (is_word(s, n, "map_Kd")) {
+			parse_string(&sp, eol, buf, sizeof buf);
+			if (buf[0] && mtl_map.len > 0) {
+				struct mtl *mtl = mtl_map.data + mtl_map.len - 1;
+				arena_free(mtl->texture);
+				mtl->texture = arena_strdup(abspath(path, dirname, buf, sizeof path));
 			}
 		}
 	}
 
-	free(data);
+	release_file_view(data);
 }
 
-int usemtl(char *matname)
+static char *usemtl(char *matname)
 {
-	int i;
-	for (i = 0; i < mtl_count; i++)
-		if (!strcmp(mtl_map[i].name, matname))
-			return mtl_map[i].material;
-	return 0;
+	int *slot;
+	if (!matname || !mtl_map.len)
+		return NULL;
+	slot = find_mtl(matname);
+	return *slot ? mtl_map.data[*slot - 1].texture : NULL;
+}
+
+static void clear_mtl_map(void)
+{
+	memset(&mtl_map, 0, sizeof mtl_map);
 }
 
-static void splitfv(char *buf, int *vpp, int *vnp, int *vtp)
+/* Parse one slash separated index of a face vertex; missing ones are zero. */
+static int parse_fv(const char **sp, const char *end)
 {
-	char tmp[200], *p, *vp, *vt, *vn;
-	strlcpy(tmp, buf, sizeof tmp);
-	p = tmp;
-	vp = strsep(&p, "/");
-	vt = strsep(&p, "/");
-	vn = strsep(&p, "/");
-	*vpp = vp && vp[0] ? atoi(vp) - 1 : 0;
-	*vtp = vt && vt[0] ? atoi(vt) - 1 : 0;
-	*vnp = vn && vn[0] ? atoi(vn) - 1 : 0;
+	const char *s = *sp, *start = s;
+	int v = 0, neg = 0;
+	if (s < end && *s == '-') {
+		neg = 1;
+		s++;
+	}
+	while (s < end && *s >= '0' && *s <= '9')
+		v = v * 10 + (*s++ - '0');
+	if (neg)
+		v = -v;
+	while (s < end && *s != '/')
+		s++;
+	*sp = s < end ? s + 1 : s;
+	return s > start ? v - 1 : 0;
 }
 
-struct model *load_obj_from_memory(const char *filename, unsigned char *data, int len)
+static void splitfv(const char *s, const char *end, int *vpp, int *vnp, int *vtp)
 {
-	char dirname[1024];
-	char *line, *next, *p, *s;
+	*vpp = parse_fv(&s, end);
+	*vtp = parse_fv(&s, end);
+	*vnp = parse_fv(&s, end);
+}
+
+struct model *decode_obj_from_memory(const char *filename, const unsigned char *data, int len)
+{
+	char dirname[1024], buf[1024];
+	const char *p, *end, *eol, *sp, *s;
 	struct model *model;
-	struct mesh *mesh;
+	struct mesh_data *mesh;
+	struct vertex_array va[3];
 	int fvp[20], fvt[20], fvn[20];
-	int first, material;
+	char *material;
+	int first;
 	int i, n;
 
 	printf("loading obj model '%s'\n", filename);
 
 	strlcpy(dirname, filename, sizeof dirname);
-	p = strrchr(dirname, '/');
-	if (!p) p = strrchr(dirname, '\\');
-	if (p) *p = 0;
+	s = strrchr(dirname, '/');
+	if (!s) s = strrchr(dirname, '\\');
+	if (s) dirname[s - dirname] = 0;
 	else strlcpy(dirname, "", sizeof dirname);
 
-	mtl_count = 0;
-	position.len = 0;
-	texcoord.len = 0;
-	normal.len = 0;
-	element.len = 0;
-	part.len = 0;
-
-	first = 0;
-	material = 0;
+	arena_begin();
 
-	data[len-1] = 0; /* over-write final newline to zero-terminate */
+	clear_mtl_map();
+	memset(&position, 0, sizeof position);
+	memset(&texcoord, 0, sizeof texcoord);
+	memset(&normal, 0, sizeof normal);
+	memset(&vertex, 0, sizeof vertex);
+	clear_vertex_map();
+	memset(&element, 0, sizeof element);
+	memset(&part, 0, sizeof part);
 
-	for (line = (char*)data; line; line = next) {
-		next = strchr(line, '\n');
-		if (next)
-			*next++ = 0;
-
-		s = strtok(line, SEP);
-		if (!s) {
+	first = 0;
+	material = NULL;
+
+	p = (const char*)data;
+	end = p + len;
+	for (; p < end; p = eol + 1) {
+		eol = find_line_end(p, end);
+		sp = p;
+		s = parse_word(&sp, eol, &n);
+		if (n == 0) {
 			continue;
-		} else if (!strcmp(s, "v")) {
-			char *x = strtok(NULL, SEP);
-			char *y = strtok(NULL, SEP);
-			char *z = strtok(NULL, SEP);
-			add_position(atof(x), atof(y), atof(z));
-		} else if (!strcmp(s, "vt")) {
-			char *u = strtok(NULL, SEP);
-			char *v = strtok(NULL, SEP);
-			add_texcoord(atof(u), atof(v));
-		} else if (!strcmp(s, "vn")) {
-			char *x = strtok(NULL, SEP);
-			char *y = strtok(NULL, SEP);
-			char *z = strtok(NULL, SEP);
-			add_normal(atof(x), atof(y), atof(z));
-		} else if (!strcmp(s, "f")) {
-			n = 0;
-			s = strtok(NULL, SEP);
-			while (s) {
-				if (*s) {
-					splitfv(s, fvp+n, fvn+n, fvt+n);
-					n++;
-				}
-				s = strtok(NULL, SEP);
+		} else if (is_word(s, n, "v")) {
+			float x = parse_float(&sp, eol, 0);
+			float y = parse_float(&sp, eol, 0);
+			float z = parse_float(&sp, eol, 0);
+			add_position(x, y, z);
+		} else if (is_word(s, n, "vt")) {
+			float u = parse_float(&sp, eol, 0);
+			float v = parse_float(&sp, eol, 0);
+			add_texcoord(u, v);
+		} else if (is_word(s, n, "vn")) {
+			float x = parse_float(&sp, eol, 0);
+			float y = parse_float(&sp, eol, 0);
+			float z = parse_float(&sp, eol, 0);
+			add_normal(x, y, z);
+		} else if (is_word(s, n, "f")) {
+			int k = 0;
+			s = parse_word(&sp, eol, &n);
+			while (n > 0 && k < nelem(fvp)) {
+				splitfv(s, s + n, fvp+k, fvn+k, fvt+k);
+				k++;
+				s = parse_word(&sp, eol, &n);
 			}
-			for (i = 1; i < n - 1; i++) {
-				add_triangle(fvp[0], fvn[0], fvt[0],
-					fvp[i], fvn[i], fvt[i],
-					fvp[i+1], fvn[i+1], fvt[i+1]);
+			for (i = 1; i < k - 1; i++) {
+				add_triangle(fvp[0], fvt[0], fvn[0],
+					fvp[i], fvt[i], fvn[i],
+					fvp[i+1], fvt[i+1], fvn[i+1]);
 			}
-		} else if (!strcmp(s, "mtllib")) {
-			s = strtok(NULL, SEP);
-			mtllib(dirname, s);
-		} else if (!strcmp(s, "usemtl")) {
+		} else if (is_word(s, n, "mtllib")) {
+			parse_string(&sp, eol, buf, sizeof buf);
+			if (buf[0])
+				mtllib(dirname, buf);
+		} else if (is_word(s, n, "usemtl")) {
 			if (element.len > first)
 				push_part(&part, first, element.len, material);
-			s = strtok(NULL, SEP);
-			material = usemtl(s);
+			parse_string(&sp, eol, buf, sizeof buf);
+			material = usemtl(buf[0] ? buf : NULL);
 			first = element.len;
 		}
 	}
@@ -278,37 +402,37 @@ struct model *load_obj_from_memory(const char *filename, unsigned char *data, in
 
 	printf("\t%d parts; %d vertices; %d triangles", part.len, vertex.len/8, element.len/3);
 
-	mesh = malloc(sizeof(struct mesh));
-	mesh->tag = TAG_MESH;
-	mesh->enabled = 1<<ATT_POSITION | 1<<ATT_NORMAL | 1<<ATT_TEXCOORD;
-	mesh->skel = NULL;
-	mesh->inv_bind_matrix = NULL;
-	mesh->count = part.len;
-	mesh->part = malloc(part.len * sizeof(struct part));
-	memcpy(mesh->part, part.data, part.len * sizeof(struct part));
-
-	glGenVertexArrays(1, &mesh->vao);
-	glGenBuffers(1, &mesh->vbo);
-	glGenBuffers(1, &mesh->ibo);
-
-	glBindVertexArray(mesh->vao);
-	glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
-
-	glBufferData(GL_ARRAY_BUFFER, vertex.len * 4, vertex.data, GL_STATIC_DRAW);
+	mesh = calloc(1, sizeof(struct mesh_data));
+	mesh->part_count = part.len;
+	mesh->part = malloc(part.len * sizeof(struct part_data));
+	memcpy(mesh->part, part.data, part.len * sizeof(struct part_data));
+
+	/* vertices are position, texcoord, normal */
+	mesh->vertex_count = vertex.len / 8;
+	for (i = 0; i < 3; i++) {
+		va[i].type = GL_FLOAT;
+		va[i].normalize = 0;
+		va[i].stride = 32;
+	}
+	va[0].index = ATT_POSITION;
+	va[0].size = 3;
+	va[0].data = vertex.data;
+	va[1].index = ATT_NORMAL;
+	va[1].size = 3;
+	va[1].data = vertex.data + 5;
+	va[2].index = ATT_TEXCOORD;
+	va[2].size = 2;
+	va[2].data = vertex.data + 3;
+	build_vertex_layout(mesh, va, 3);
 
-	glEnableVertexAttribArray(ATT_POSITION);
-	glEnableVertexAttribArray(ATT_NORMAL);
-	glEnableVertexAttribArray(ATT_TEXCOORD);
-	glVertexAttribPointer(ATT_POSITION, 3, GL_FLOAT, 0, 32, (void*)0);
-	glVertexAttribPointer(ATT_NORMAL, 3, GL_FLOAT, 0, 32, (void*)20);
-	glVertexAttribPointer(ATT_TEXCOORD, 2, GL_FLOAT, 0, 32, (void*)12);
+	set_mesh_indices(mesh, element.data, element.len);
 
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, element.len * 2, element.data, GL_STATIC_DRAW);
+	arena_end();
 
 	model = malloc(sizeof *model);
 	model->skel = NULL;
-	model->mesh = mesh;
+	model->mesh = NULL;
 	model->anim = NULL;
+	model->mesh_data = mesh;
 	return model;
 }
@@ -0,0 +1,370 @@
+#include "mio.h"
+
+#include <pthread.h>
+
+/*
+ * Reorder the triangles and vertices of a decoded mesh for the GPU.
+ *
+ * Each part is first reordered for the post-transform vertex cache with
+ * Tom Forsyth's linear-speed algorithm. The result is then cut into
+ * clusters where the cache would start cold anyway, and the clusters are
+ * sorted so that those facing away from the center of the part, which
+ * tend to hide the rest, are drawn first. Finally the vertices are
+ * renumbered in the order they are first used, so that vertex fetch reads
+ * the buffer front to back; vertices that no triangle uses are dropped.
+ */
+
+static int optimize_enabled = 1;
+static int optimize_report = 0;
+
+void set_mesh_optimization(int enable, int report)
+{
+	optimize_enabled = enable;
+	optimize_report = report;
+}
+
+/* vertex cache reordering */
+
+#define CACHE_SIZE 32
+#define SIM_CACHE_SIZE 16 /* cache size for measuring and cluster boundaries */
+
+static float cache_score[CACHE_SIZE];
+static float valence_score[64];
+static pthread_once_t score_once = PTHREAD_ONCE_INIT;
+
+static void init_scores(void)
+{
+	int i;
+	for (i = 0; i < CACHE_SIZE; i++) {
+		if (i < 3)
+			cache_score[i] = 0.75f; /* the last triangle; discourage reusing it right away */
+		else
+			cache_score[i] = powf(1 - (float)(i - 3) / (CACHE_SIZE - 3), 1.5f);
+	}
+	for (i = 0; i < nelem(valence_score); i++)
+		valence_score[i] = i ? 2 * powf(i, -0.5f) : 0;
+}
+
+static float vertex_score(int cache_pos, int valence)
+{
+	float score;
+	if (valence == 0)
+		return -1;
+	score = cache_pos >= 0 ? cache_score[cache_pos] : 0;
+	return score + valence_score[MIN(valence, nelem(valence_score) - 1)];
+}
+
+/* Reorder count/3 triangles of index in place; vertex ids are below vertex_count. */
+void optimize_vertex_cache(unsigned int *index, int count, int vertex_count)
+{
+	int tri_count = count / 3;
+	int *valence, *adj_first, *adj, *cache_pos;
+	float *score, *tri_score;
+	unsigned char *emitted;
+	unsigned int *out;
+	int cache[CACHE_SIZE + 3], new_cache[CACHE_SIZE + 3];
+	int cache_len = 0, cursor = 0;
+	int i, k, t, n;
+
+	if (tri_count < 2)
+		return;
+
+	pthread_once(&score_once, init_scores);
+
+	valence = calloc(vertex_count, sizeof *valence);
+	adj_first = malloc((vertex_count + 1) * sizeof *adj_first);
+	adj = malloc(tri_count * 3 * sizeof *adj);
+	cache_pos = malloc(vertex_count * sizeof *cache_pos);
+	score = malloc(vertex_count * sizeof *score);
+	tri_score = malloc(tri_count * sizeof *tri_score);
+	emitted = calloc(tri_count, 1);
+	out = malloc(count * sizeof *out);
+
+	for (i = 0; i < tri_count * 3; i++)
+		valence[index[i]]++;
+	adj_first[0] = 0;
+	for (i = 0; i < vertex_count; i++)
+		adj_first[i+1] = adj_first[i] + valence[i];
+	for (i = 0; i < tri_count * 3; i++)
+		adj[adj_first[index[i]]++] = i / 3;
+	for (i = vertex_count; i > 0; i--)
+		adj_first[i] = adj_first[i-1];
+	adj_first[0] = 0;
+
+	for (i = 0; i < vertex_count; i++) {
+		cache_pos[i] = -1;
+		score[i] = vertex_score(-1, valence[i]);
+	}
+	for (t = 0; t < tri_count; t++)
+		tri_score[t] = score[index[t*3]] + score[index[t*3+1]] + score[index[t*3+2]];
+
+	for (n = 0; n < tri_count; n++) {
+		int best = -1;
+		float best_score = -1;
+
+		/* the next triangle is one that uses a cached vertex, if any do */
+		for (i = 0; i < cache_len; i++) {
+			int v = cache[i];
+			for (k = adj_first[v]; k < adj_first[v] + valence[v]; k++) {
+				t = adj[k];
+				if (tri_score[t] > best_score) {
+					best_score = tri_score[t];
+					best = t;
+				}
+			}
+		}
+		if (best < 0) {
+			while (emitted[cursor])
+				cursor++;
+			best = cursor;
+		}
+
+		emitted[best] = 1;
+		memcpy(out + n * 3, index + best * 3, 3 * sizeof *out);
+
+		/* take the triangle off the adjacency lists of its vertices */
+		for (i = 0; i < 3; i++) {
+			int v = index[best*3+i];
+			int *a = adj + adj_first[v];
+			for (k = 0; a[k] != best; k++)
+				;
+			a[k] = a[--valence[v]];
+		}
+
+		/* move its vertices to the front of the cache */
+		k = 0;
+		for (i = 0; i < 3; i++)
+			new_cache[k++] = index[best*3+i];
+		for (i = 0; i < cache_len; i++) {
+			int v = cache[i];
+			if (v != new_cache[0] && v != new_cache[1] && v != new_cache[2])
+				new_cache[k++] = v;
+		}
+
+		/* rescore the vertices that moved, including those that fell out */
+		for (i = 0; i < k; i++) {
+			int v = new_cache[i];
+			cache_pos[v] = i < CACHE_SIZE ? i : -1;
+			score[v] = vertex_score(cache_pos[v], valence[v]);
+		}
+		for (i = 0; i < k; i++) {
+			int v = new_cache[i];
+			int j;
+			for (j = adj_first[v]; j < adj_first[v] + valence[v]; j++) {
+				t = adj[j];
+				tri_score[t] = score[index[t*3]] + score[index[t*3+1]] + score[index[t*3+2]];
+			}
+		}
+
+		cache_len = MIN(k, CACHE_SIZE);
+		memcpy(cache, new_cache, cache_len * sizeof *cache);
+	}
+
+	memcpy(index, out, count * sizeof *out);
+
+	free(valence);
+	free(adj_first);
+	free(adj);
+	free(cache_pos);
+	free(score);
+	free(tri_score);
+	free(emitted);
+	free(out);
+}
+
+/* Count the transformed vertices with a FIFO cache, as most hardware has. */
+static int count_cache_misses(const unsigned int *index, int count, int vertex_count)
+{
+	unsigned int *stamp = calloc(vertex_count, sizeof *stamp);
+	unsigned int time = SIM_CACHE_SIZE + 1;
+	int i, misses = 0;
+	for (i = 0; i < count; i++) {
+		if (time - stamp[index[i]] > SIM_CACHE_SIZE) {
+			stamp[index[i]] = time++;
+			misses++;
+		}
+	}
+	free(stamp);
+	return misses;
+}
+
+/* overdraw sorting */
+
+struct overdraw_cluster {
+	int first, count;
+	vec3 center, normal;
+	float area;
+	float key;
+};
+
+static int compare_cluster(const void *a, const void *b)
+{
+	const struct overdraw_cluster *ca = a, *cb = b;
+	if (ca->key != cb->key)
+		return ca->key > cb->key ? -1 : 1;
+	return ca->first - cb->first;
+}
+
+static void optimize_overdraw(const struct mesh_data *mesh, const struct vertex_attrib *att, unsigned int *index, int count)
+{
+	unsigned int *stamp = calloc(mesh->vertex_count, sizeof *stamp);
+	unsigned int *out = malloc(count * sizeof *out);
+	struct overdraw_cluster *cluster = NULL;
+	int i, k, n = 0, cap = 0;
+	unsigned int time = SIM_CACHE_SIZE + 1;
+	vec3 center = { 0, 0, 0 };
+	float area = 0;
+
+	/* a triangle that misses on all its vertices starts a new cluster */
+	for (i = 0; i + 3 <= count; i += 3) {
+		int misses = 0;
+		for (k = 0; k < 3; k++) {
+			if (time - stamp[index[i+k]] > SIM_CACHE_SIZE) {
+				stamp[index[i+k]] = time++;
+				misses++;
+			}
+		}
+		if (misses == 3 || n == 0) {
+			if (n == cap) {
+				cap = cap ? cap * 2 : 64;
+				cluster = realloc(cluster, cap * sizeof *cluster);
+			}
+			memset(cluster + n, 0, sizeof *cluster);
+			cluster[n++].first = i;
+		}
+		cluster[n-1].count += 3;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct overdraw_cluster *c = cluster + i;
+		for (k = c->first; k < c->first + c->count; k += 3) {
+			vec3 a, b, d, u, v, nor, mid;
+			float tri_area;
+			get_vertex_position(mesh, att, index[k], a);
+			get_vertex_position(mesh, att, index[k+1], b);
+			get_vertex_position(mesh, att, index[k+2], d);
+			vec_sub(u, b, a);
+			vec_sub(v, d, a);
+			vec_cross(nor, u, v);
+			tri_area = vec_length(nor);
+			vec_add(mid, a, b);
+			vec_add(mid, mid, d);
+			vec_scale(mid, mid, tri_area / 3);
+			vec_add(c->center, c->center, mid);
+			vec_add(c->normal, c->normal, nor);
+			c->area += tri_area;
+		}
+		vec_add(center, center, c->center);
+		area += c->area;
+		if (c->area > 0)
+			vec_scale(c->center, c->center, 1 / c->area);
+	}
+
+	if (area > 0) {
+		vec_scale(center, center, 1 / area);
+		for (i = 0; i < n; i++) {
+			vec3 dir;
+			float len = vec_length(cluster[i].normal);
+			vec_sub(dir, cluster[i].center, center);
+			cluster[i].key = len > 0 ? vec_dot(dir, cluster[i].normal) / len : 0;
+		}
+		qsort(cluster, n, sizeof *cluster, compare_cluster);
+
+		k = 0;
+		for (i = 0; i < n; i++) {
+			memcpy(out + k, index + cluster[i].first, cluster[i].count * sizeof *out);
+			k += cluster[i].count;
+		}
+		memcpy(index, out, k * sizeof *out);
+	}
+
+	free(cluster);
+	free(out);
+	free(stamp);
+}
+
+/* vertex fetch reordering */
+
+static void optimize_vertex_fetch(struct mesh_data *mesh, unsigned int *index, int count)
+{
+	int stride = mesh->attrib_count > 0 ? mesh->attrib[0].stride : 0;
+	unsigned int *remap = malloc(mesh->vertex_count * sizeof *remap);
+	unsigned char *vertex_data;
+	int i, n = 0;
+
+	memset(remap, 0xff, mesh->vertex_count * sizeof *remap);
+	for (i = 0; i < count; i++) {
+		if (remap[index[i]] == ~0u)
+			remap[index[i]] = n++;
+		index[i] = remap[index[i]];
+	}
+
+	vertex_data = malloc(MAX(n * stride, 1));
+	for (i = 0; i < mesh->vertex_count; i++)
+		if (remap[i] != ~0u)
+			memcpy(vertex_data + remap[i] * stride, mesh->vertex_data + i * stride, stride);
+
+	free(mesh->vertex_data);
+	mesh->vertex_data = vertex_data;
+	mesh->vertex_count = n;
+	mesh->vertex_len = n * stride;
+
+	free(remap);
+}
+
+void optimize_mesh(const char *filename, struct mesh_data *mesh)
+{
+	const struct vertex_attrib *position = NULL;
+	unsigned int *index;
+	int i, count = mesh->index_count;
+	int vertex_count = mesh->vertex_count;
+	int misses_before = 0;
+
+	if (!optimize_enabled || mesh->mapping || count == 0)
+		return;
+
+	for (i = 0; i < mesh->attrib_count; i++)
+		if (mesh->attrib[i].stride != mesh->attrib[0].stride)
+			return; /* not interleaved, cannot reorder the vertices */
+	position = find_position_attrib(mesh);
+
+	index = malloc(count * sizeof *index);
+	if (mesh->index_size == 4) {
+		memcpy(index, mesh->index_data, count * 4);
+	} else {
+		const unsigned short *p = mesh->index_data;
+		for (i = 0; i < count; i++)
+			index[i] = p[i];
+	}
+
+	if (optimize_report)
+		misses_before = count_cache_misses(index, count, vertex_count);
+
+	for (i = 0; i < mesh->part_count; i++) {
+		struct part_data *part = mesh->part + i;
+		optimize_vertex_cache(index + part->first, part->count, vertex_count);
+		if (position)
+			optimize_overdraw(mesh, position, index + part->first, part->count);
+	}
+
+	if (mesh->attrib_count > 0)
+		optimize_vertex_fetch(mesh, index, count);
+
+	if (optimize_report) {
+		int misses_after = count_cache_misses(index, count, mesh->vertex_count);
+		int tri_count = MAX(count / 3, 1);
+		warn("%s: %d triangles; ACMR %.3f -> %.3f; ATVR %.3f -> %.3f", filename, count / 3,
+			(float)misses_before / tri_count, (float)misses_after / tri_count,
+			(float)misses_before / MAX(vertex_count, 1), (float)misses_after / MAX(mesh->vertex_count, 1));
+	}
+
+	if (mesh->index_size == 4) {
+		memcpy(mesh->index_data, index, count * 4);
+	} else {
+		unsigned short *p = mesh->index_data;
+		for (i = 0; i < count; i++)
+			p[i] = index[i];
+	}
+
+	free(index);
+}
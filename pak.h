@@ -0,0 +1,58 @@
+#ifndef __PAK_H__
+#define __PAK_H__
+
+#include <stdint.h>
+
+/*
+ * A pak file is a header, the entry data, the index and a table of
+ * zero terminated names. Each entry starts on a PAK_ALIGN boundary, so
+ * stored entries can be handed from a memory mapping straight to
+ * glBufferData and friends. The index is sorted by name hash, then by
+ * name. All values are little endian.
+ */
+
+#define PAK_MAGIC "MIOPAK\r\n"
+#define PAK_VERSION 1
+#define PAK_ALIGN 4096
+
+enum
+{
+	PAK_STORED = 0,
+	PAK_LZ4 = 1,
+};
+
+struct pakheader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t num_entries;
+	uint64_t ofs_entries;
+	uint64_t ofs_names, num_names;
+};
+
+struct pakentry
+{
+	uint32_t hash; /* pak_hash of name */
+	uint32_t name; /* offset into name table */
+	uint64_t offset;
+	uint32_t csize, usize;
+	uint32_t codec;
+	uint32_t crc; /* crc-32 of the uncompressed data */
+};
+
+/* 32-bit FNV-1a */
+static inline uint32_t pak_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+/* lz4 block format */
+
+int lz4_compress_bound(int size);
+int lz4_compress(const unsigned char *src, int srclen, unsigned char *dst, int dstlen);
+int lz4_decompress(const unsigned char *src, int srclen, unsigned char *dst, int dstlen);
+
+#endif
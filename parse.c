@@ -0,0 +1,179 @@
+#include "mio.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Tokenizing and number parsing for the text model formats.
+ *
+ * These work on a range of text that is neither written to nor zero
+ * terminated, so a file can be parsed straight from its mapping. Numbers
+ * are parsed by hand, so they do not depend on the locale, and the common
+ * cases only take a multiply or divide by an exact power of ten.
+ */
+
+static const unsigned char space_table[256] = {
+	['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1, [' '] = 1,
+};
+
+#define ISSPACE(c) space_table[(unsigned char)(c)]
+#define ISDIGIT(c) ((unsigned)((c) - '0') < 10)
+
+static const double pow10_table[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+	1e21, 1e22,
+};
+
+/* Return a pointer to the next newline, or end if there is none. */
+const char *find_line_end(const char *s, const char *end)
+{
+#ifdef __SSE2__
+	const __m128i nl = _mm_set1_epi8('\n');
+	while (end - s >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)s);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		if (mask)
+			return s + __builtin_ctz(mask);
+		s += 16;
+	}
+#endif
+	while (s < end && *s != '\n')
+		s++;
+	return s;
+}
+
+const char *skip_space(const char *s, const char *end)
+{
+	while (s < end && ISSPACE(*s))
+		s++;
+	return s;
+}
+
+static const char *skip_word(const char *s, const char *end)
+{
+	while (s < end && !ISSPACE(*s))
+		s++;
+	return s;
+}
+
+/* Return the next whitespace separated word and its length; zero at the end of the line. */
+const char *parse_word(const char **sp, const char *end, int *lenp)
+{
+	const char *s = skip_space(*sp, end);
+	*sp = skip_word(s, end);
+	*lenp = *sp - s;
+	return s;
+}
+
+/* Copy the next word, or the next string in double quotes, into buf. */
+char *parse_string(const char **sp, const char *end, char *buf, int size)
+{
+	const char *s = skip_space(*sp, end);
+	const char *e;
+	if (s < end && *s == '"') {
+		e = ++s;
+		while (e < end && *e != '"')
+			e++;
+		*sp = e < end ? e + 1 : e;
+	} else {
+		e = skip_word(s, end);
+		*sp = e;
+	}
+	if (e - s >= size)
+		e = s + size - 1;
+	memcpy(buf, s, e - s);
+	buf[e - s] = 0;
+	return buf;
+}
+
+int is_word(const char *s, int n, const char *word)
+{
+	return !strncmp(s, word, n) && word[n] == 0;
+}
+
+int parse_int(const char **sp, const char *end, int def)
+{
+	const char *s = skip_space(*sp, end);
+	int neg = 0, v = 0;
+	*sp = s;
+	if (s == end)
+		return def;
+	if (*s == '-' || *s == '+')
+		neg = *s++ == '-';
+	while (s < end && ISDIGIT(*s))
+		v = v * 10 + (*s++ - '0');
+	*sp = skip_word(s, end);
+	return neg ? -v : v;
+}
+
+/* Infinities, NaNs and junk; rare enough that the locale does not matter. */
+static float parse_float_slow(const char *s, const char *end)
+{
+	char buf[64];
+	int n = MIN(end - s, (int)sizeof buf - 1);
+	memcpy(buf, s, n);
+	buf[n] = 0;
+	return strtod(buf, NULL);
+}
+
+float parse_float(const char **sp, const char *end, float def)
+{
+	const char *s = skip_space(*sp, end);
+	const char *word = s;
+	unsigned long long m = 0;
+	int neg = 0, digits = 0, exp = 0;
+	double v;
+
+	*sp = s;
+	if (s == end)
+		return def;
+
+	if (*s == '-' || *s == '+')
+		neg = *s++ == '-';
+
+	/* keep 18 significant digits, which is plenty for a float */
+	for (; s < end && ISDIGIT(*s); s++, digits++) {
+		if (m < 100000000000000000ULL)
+			m = m * 10 + (*s - '0');
+		else
+			exp++;
+	}
+	if (s < end && *s == '.') {
+		for (s++; s < end && ISDIGIT(*s); s++, digits++) {
+			if (m < 100000000000000000ULL) {
+				m = m * 10 + (*s - '0');
+				exp--;
+			}
+		}
+	}
+
+	if (!digits) {
+		*sp = skip_word(s, end);
+		return parse_float_slow(word, *sp);
+	}
+
+	if (s < end && (*s == 'e' || *s == 'E')) {
+		const char *t = s + 1;
+		int eneg = 0, e = 0;
+		if (t < end && (*t == '-' || *t == '+'))
+			eneg = *t++ == '-';
+		if (t < end && ISDIGIT(*t)) {
+			for (; t < end && ISDIGIT(*t); t++)
+				if (e < 10000)
+					e = e * 10 + (*t - '0');
+			exp += eneg ? -e : e;
+			s = t;
+		}
+	}
+
+	*sp = skip_word(s, end);
+
+	v = m;
+	if (exp < 0)
+		v = exp >= -22 ? v / pow10_table[-exp] : v / pow(10, -exp);
+	else if (exp > 0)
+		v = exp <= 22 ? v * pow10_table[exp] : v * pow(10, exp);
+	return neg ? -v : v;
+}
@@ -183,3 +183,28 @@ function entity(t)
 
 	return t
 end
+
+local function remove_value(list, value)
+	for i = #list, 1, -1 do
+		if list[i] == value then table.remove(list, i) end
+	end
+end
+
+function delete_entity(t)
+	if t.name and entities[t.name] == t then
+		entities[t.name] = nil
+	end
+
+	remove_value(meshlist, t)
+	remove_value(lamplist, t)
+
+	if t.mesh then release_mesh(t.mesh) end
+	if t.meshlist then
+		for k, mesh in pairs(t.meshlist) do
+			release_mesh(mesh)
+		end
+	end
+	t.mesh = nil
+	t.meshlist = nil
+	t.skel = nil
+end
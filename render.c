@@ -244,16 +244,21 @@ void render_debug_buffers(mat4 proj, mat4 view)
 
 /* draw model */
 
+/* positions may be quantized; position_scale and position_offset undo it */
+
 static const char *static_mesh_vert_src =
 	"uniform mat4 clip_from_view;\n"
 	"uniform mat4 view_from_model;\n"
+	"uniform vec3 position_scale;\n"
+	"uniform vec3 position_offset;\n"
 	"in vec4 att_position;\n"
 	"in vec3 att_normal;\n"
 	"in vec2 att_texcoord;\n"
 	"out vec3 var_normal;\n"
 	"out vec2 var_texcoord;\n"
 	"void main() {\n"
-	"	gl_Position = clip_from_view * view_from_model * att_position;\n"
+	"	vec4 position = vec4(att_position.xyz * position_scale + position_offset, 1.0);\n"
+	"	gl_Position = clip_from_view * view_from_model * position;\n"
 	"	vec4 normal = view_from_model * vec4(att_normal, 0.0);\n"
 	"	var_normal = normalize(normal.xyz);\n"
 	"	var_texcoord = att_texcoord;\n"
@@ -267,6 +272,8 @@ static const char *skinned_mesh_vert_src =
 	"uniform mat4 clip_from_view;\n"
 	"uniform mat4 view_from_model;\n"
 	"uniform mat4 model_from_bind_pose[" STR2(MAXBONE) "];\n"
+	"uniform vec3 position_scale;\n"
+	"uniform vec3 position_offset;\n"
 	"in vec4 att_position;\n"
 	"in vec3 att_normal;\n"
 	"in vec2 att_texcoord;\n"
@@ -275,13 +282,14 @@ static const char *skinned_mesh_vert_src =
 	"out vec3 var_normal;\n"
 	"out vec2 var_texcoord;\n"
 	"void main() {\n"
+	"	vec4 bind_position = vec4(att_position.xyz * position_scale + position_offset, 1.0);\n"
 	"	vec4 position = vec4(0);\n"
 	"	vec4 normal = vec4(0);\n"
 	"	vec4 index = att_blend_index;\n"
 	"	vec4 weight = att_blend_weight;\n"
 	"	for (int i = 0; i < 4; i++) {\n"
 	"		mat4 m = model_from_bind_pose[int(index.x)];\n"
-	"		position += m * att_position * weight.x;\n"
+	"		position += m * bind_position * weight.x;\n"
 	"		normal += m * vec4(att_normal, 0) * weight.x;\n"
 	"		index = index.yzwx;\n"
 	"		weight = weight.yzwx;\n"
@@ -303,19 +311,168 @@ static const char *mesh_frag_src =
 	"void main() {\n"
 	"	vec4 albedo = texture(map_color, var_texcoord);\n"
 	"	vec3 normal = normalize(var_normal);\n"
+	"	if (!gl_FrontFacing) normal = -normal;\n"
 	"	if (albedo.a < 0.2) discard;\n"
 	"	frag_normal = vec4(normal.xyz, 0);\n"
 	"	frag_albedo = vec4(albedo.rgb, 1);\n"
 	"}\n"
 ;
 
+/* Cluster culling, done in view space where the camera is at the origin. */
+
+struct cull {
+	vec4 plane[6];
+	float *view_from_model;
+	float scale; /* of the radius */
+	int cone; /* normal cones only survive uniform scaling without mirroring */
+};
+
+static void init_cull(struct cull *cull, mat4 clip_from_view, mat4 view_from_model)
+{
+	float len, lo = 0, hi = 0;
+	vec3 axis;
+	int i, k;
+
+	/* the planes of the frustum, from the rows of the projection matrix */
+	for (i = 0; i < 6; i++) {
+		float *p = cull->plane[i];
+		float sign = i & 1 ? -1 : 1;
+		for (k = 0; k < 4; k++)
+			p[k] = clip_from_view[k*4+3] + sign * clip_from_view[k*4+i/2];
+		len = sqrtf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+		for (k = 0; k < 4; k++)
+			p[k] /= len;
+	}
+
+	for (i = 0; i < 3; i++) {
+		len = vec_length(view_from_model + i*4);
+		lo = i ? MIN(lo, len) : len;
+		hi = i ? MAX(hi, len) : len;
+	}
+
+	vec_cross(axis, view_from_model, view_from_model + 4);
+
+	cull->view_from_model = view_from_model;
+	cull->scale = hi;
+	cull->cone = hi - lo <= hi * 0.001f && vec_dot(axis, view_from_model + 8) > 0;
+}
+
+static int is_cluster_visible(struct cull *cull, struct cluster *c)
+{
+	vec3 center, axis;
+	float radius = c->radius * cull->scale;
+	int i;
+
+	mat_vec_mul(center, cull->view_from_model, c->center);
+
+	for (i = 0; i < 6; i++) {
+		float *p = cull->plane[i];
+		if (vec_dot(p, center) + p[3] < -radius)
+			return 0;
+	}
+
+	if (cull->cone && c->cone_cutoff < 1) {
+		mat_vec_mul_n(axis, cull->view_from_model, c->cone_axis);
+		vec_normalize(axis, axis);
+		if (vec_dot(center, axis) >= c->cone_cutoff * vec_length(center) + radius)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void draw_range(struct mesh *mesh, struct part *part, int first, int count)
+{
+	if (part->base)
+		glDrawElementsBaseVertex(GL_TRIANGLES, count, mesh->index_type, PTR(first * mesh->index_size), part->base);
+	else
+		glDrawElements(GL_TRIANGLES, count, mesh->index_type, PTR(first * mesh->index_size));
+}
+
+/* Levels of detail */
+
+static float lod_bias = 1;
+
+void set_lod_bias(float bias)
+{
+	lod_bias = bias;
+}
+
+/*
+ * Pick the coarsest level whose error, projected at the near side of the
+ * bounding sphere, stays below lod_bias pixels. Zero bias turns it off.
+ */
+static int select_lod(struct mesh *mesh, mat4 clip_from_view, mat4 view_from_model)
+{
+	vec3 center;
+	float scale = 0, dist, pixels;
+	int i;
+
+	if (mesh->lod_count < 2 || lod_bias <= 0 || fbo_h == 0)
+		return 0;
+
+	for (i = 0; i < 3; i++)
+		scale = MAX(scale, vec_length(view_from_model + i*4));
+
+	pixels = clip_from_view[5] * fbo_h * 0.5f; /* per unit of length at unit depth */
+	if (clip_from_view[11] != 0) {
+		mat_vec_mul(center, view_from_model, mesh->center);
+		dist = vec_length(center) - mesh->radius * scale;
+		if (dist <= 0)
+			return 0;
+		pixels /= dist;
+	}
+
+	for (i = mesh->lod_count - 1; i > 0; i--)
+		if (mesh->lod[i].error * scale * pixels <= lod_bias)
+			return i;
+	return 0;
+}
+
+/* Draw the parts of a level; with cull set, only their visible clusters, merged into runs. */
+static void draw_mesh_parts(struct mesh *mesh, int lod, struct cull *cull)
+{
+	int cull_face = glIsEnabled(GL_CULL_FACE); /* double-sided parts must not turn it on */
+	int i, k;
+	for (i = mesh->lod[lod].first; i < mesh->lod[lod].first + mesh->lod[lod].count; i++) {
+		struct part *part = mesh->part + i;
+		glActiveTexture(MAP_COLOR);
+		glBindTexture(GL_TEXTURE_2D, part->material);
+		if (part->double_sided && cull_face)
+			glDisable(GL_CULL_FACE);
+		if (cull && part->cluster_count > 0) {
+			int first = 0, count = 0;
+			for (k = 0; k < part->cluster_count; k++) {
+				struct cluster *c = mesh->cluster + part->cluster_first + k;
+				if (!is_cluster_visible(cull, c))
+					continue;
+				if (count > 0 && first + count == c->first) {
+					count += c->count;
+				} else {
+					if (count > 0)
+						draw_range(mesh, part, first, count);
+					first = c->first;
+					count = c->count;
+				}
+			}
+			if (count > 0)
+				draw_range(mesh, part, first, count);
+		} else {
+			draw_range(mesh, part, part->first, part->count);
+		}
+		if (part->double_sided && cull_face)
+			glEnable(GL_CULL_FACE);
+	}
+}
+
 void render_static_mesh(struct mesh *mesh, mat4 clip_from_view, mat4 view_from_model)
 {
 	static int prog = 0;
 	static int uni_clip_from_view;
 	static int uni_view_from_model;
-
-	int i;
+	static int uni_position_scale;
+	static int uni_position_offset;
+	struct cull cull;
 
 	if (!mesh)
 		return;
@@ -324,19 +481,20 @@ void render_static_mesh(struct mesh *mesh, mat4 clip_from_view, mat4 view_from_m
 		prog = compile_shader(static_mesh_vert_src, mesh_frag_src);
 		uni_clip_from_view = glGetUniformLocation(prog, "clip_from_view");
 		uni_view_from_model = glGetUniformLocation(prog, "view_from_model");
+		uni_position_scale = glGetUniformLocation(prog, "position_scale");
+		uni_position_offset = glGetUniformLocation(prog, "position_offset");
 	}
 
 	glUseProgram(prog);
 	glUniformMatrix4fv(uni_clip_from_view, 1, 0, clip_from_view);
 	glUniformMatrix4fv(uni_view_from_model, 1, 0, view_from_model);
+	glUniform3fv(uni_position_scale, 1, mesh->position_scale);
+	glUniform3fv(uni_position_offset, 1, mesh->position_offset);
 
 	glBindVertexArray(mesh->vao);
 
-	for (i = 0; i < mesh->count; i++) {
-		glActiveTexture(MAP_COLOR);
-		glBindTexture(GL_TEXTURE_2D, mesh->part[i].material);
-		glDrawElements(GL_TRIANGLES, mesh->part[i].count, GL_UNSIGNED_SHORT, PTR(mesh->part[i].first * 2));
-	}
+	init_cull(&cull, clip_from_view, view_from_model);
+	draw_mesh_parts(mesh, select_lod(mesh, clip_from_view, view_from_model), &cull);
 }
 
 void render_skinned_mesh(struct mesh *mesh, mat4 clip_from_view, mat4 view_from_model, mat4 *model_from_bind_pose)
@@ -345,8 +503,8 @@ void render_skinned_mesh(struct mesh *mesh, mat4 clip_from_view, mat4 view_from_
 	static int uni_clip_from_view;
 	static int uni_view_from_model;
 	static int uni_model_from_bind_pose;
-
-	int i;
+	static int uni_position_scale;
+	static int uni_position_offset;
 
 	if (!mesh)
 		return;
@@ -356,20 +514,21 @@ void render_skinned_mesh(struct mesh *mesh, mat4 clip_from_view, mat4 view_from_
 		uni_clip_from_view = glGetUniformLocation(prog, "clip_from_view");
 		uni_view_from_model = glGetUniformLocation(prog, "view_from_model");
 		uni_model_from_bind_pose = glGetUniformLocation(prog, "model_from_bind_pose");
+		uni_position_scale = glGetUniformLocation(prog, "position_scale");
+		uni_position_offset = glGetUniformLocation(prog, "position_offset");
 	}
 
 	glUseProgram(prog);
 	glUniformMatrix4fv(uni_clip_from_view, 1, 0, clip_from_view);
 	glUniformMatrix4fv(uni_view_from_model, 1, 0, view_from_model);
 	glUniformMatrix4fv(uni_model_from_bind_pose, mesh->skel->count, 0, model_from_bind_pose[0]);
+	glUniform3fv(uni_position_scale, 1, mesh->position_scale);
+	glUniform3fv(uni_position_offset, 1, mesh->position_offset);
 
 	glBindVertexArray(mesh->vao);
 
-	for (i = 0; i < mesh->count; i++) {
-		glActiveTexture(MAP_COLOR);
-		glBindTexture(GL_TEXTURE_2D, mesh->part[i].material);
-		glDrawElements(GL_TRIANGLES, mesh->part[i].count, GL_UNSIGNED_SHORT, PTR(mesh->part[i].first * 2));
-	}
+	/* static meshes only; the cluster bounds do not follow the skin */
+	draw_mesh_parts(mesh, select_lod(mesh, clip_from_view, view_from_model), NULL);
 }
 
 /* Point lamp */
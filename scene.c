@@ -152,6 +152,9 @@ void render_mesh_skel(struct transform *transform, struct mesh *mesh, struct ske
 	mat4 model_from_bind_pose[MAXBONE];
 	int mi, si;
 
+	if (!ms)
+		return; /* still loading */
+
 	calc_matrix_from_pose(local_pose, pose, skel->count);
 	calc_abs_matrix(model_pose, local_pose, skel->parent, skel->count);
 
@@ -0,0 +1,626 @@
+#include "mio.h"
+
+/*
+ * Levels of detail. Each part of a mesh is simplified by collapsing edges
+ * in order of their quadric error, and copies of its triangles are kept
+ * as it passes a half, a quarter and an eighth of its original count.
+ * A vertex is only ever collapsed onto one of its neighbours, so every
+ * level indexes the same vertex buffer; the new index lists are appended
+ * to the index buffer, with parts of their own.
+ *
+ * Vertices that share their position with another vertex (texture and
+ * normal seams, material borders) and vertices used by several parts
+ * never move, so seams stay closed. Vertices on an open border only slide
+ * along it.
+ */
+
+static int lod_levels = MAXLOD;
+
+void set_mesh_lods(int levels)
+{
+	lod_levels = CLAMP(levels, 1, MAXLOD);
+}
+
+int mesh_lods(void)
+{
+	return lod_levels;
+}
+
+enum { KIND_MANIFOLD, KIND_BORDER, KIND_LOCKED };
+
+struct quadric {
+	double a00, a01, a02, a11, a12, a22;
+	double b0, b1, b2, c;
+	double w;
+};
+
+struct collapse {
+	float cost;
+	unsigned int v, w;
+};
+
+struct edge {
+	unsigned long long key;
+	int corner;
+};
+
+struct simplify {
+	/* the whole mesh */
+	int vertex_count;
+	vec3 *position;
+	unsigned int *wedge; /* the first vertex with the same position */
+	unsigned char *locked;
+	int *local; /* local number of a vertex in the current part, or -1 */
+
+	/* the current part, by local vertex number */
+	int count; /* vertices */
+	unsigned int *global;
+	unsigned char *kind, *touched;
+	unsigned int *remap;
+	struct quadric *quadric;
+	int *adj_first, *adj_count, *adj;
+	struct edge *edge; /* of the current triangles, sorted */
+	struct edge *order; /* of the collapses, by cost */
+	struct edge *sort; /* room for sorting */
+	int edge_count;
+	unsigned char *edge_use; /* for each corner, by the edge that starts there */
+	struct collapse *collapse;
+};
+
+static void add_plane(struct quadric *q, const vec3 n, float d, float w)
+{
+	q->a00 += w * n[0] * n[0];
+	q->a01 += w * n[0] * n[1];
+	q->a02 += w * n[0] * n[2];
+	q->a11 += w * n[1] * n[1];
+	q->a12 += w * n[1] * n[2];
+	q->a22 += w * n[2] * n[2];
+	q->b0 += w * n[0] * d;
+	q->b1 += w * n[1] * d;
+	q->b2 += w * n[2] * d;
+	q->c += w * d * d;
+	q->w += w;
+}
+
+static void add_quadric(struct quadric *q, const struct quadric *r)
+{
+	q->a00 += r->a00; q->a01 += r->a01; q->a02 += r->a02;
+	q->a11 += r->a11; q->a12 += r->a12; q->a22 += r->a22;
+	q->b0 += r->b0; q->b1 += r->b1; q->b2 += r->b2;
+	q->c += r->c;
+	q->w += r->w;
+}
+
+/* The mean squared distance from p to the planes of the quadric. */
+static float quadric_error(const struct quadric *q, const vec3 p)
+{
+	double x = p[0], y = p[1], z = p[2];
+	double e = q->a00*x*x + q->a11*y*y + q->a22*z*z +
+		2 * (q->a01*x*y + q->a02*x*z + q->a12*y*z) +
+		2 * (q->b0*x + q->b1*y + q->b2*z) + q->c;
+	return q->w > 0 ? fabs(e) / q->w : 0;
+}
+
+/* Radix sort by key, 16 bits at a time; qsort is most of the run time otherwise. */
+static void sort_edges(struct edge *edge, struct edge *tmp, int n)
+{
+	static __thread int count[1 << 16];
+	int shift, i;
+
+	for (shift = 0; shift < 64 && n > 0; shift += 16) {
+		int sum = 0;
+		memset(count, 0, sizeof count);
+		for (i = 0; i < n; i++)
+			count[(edge[i].key >> shift) & 0xffff]++;
+		if (count[(edge[0].key >> shift) & 0xffff] == n)
+			continue; /* all the same */
+		for (i = 0; i < 1 << 16; i++) {
+			int c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			tmp[count[(edge[i].key >> shift) & 0xffff]++] = edge[i];
+		memcpy(edge, tmp, n * sizeof *edge);
+	}
+}
+
+static float *local_position(struct simplify *s, unsigned int v)
+{
+	return s->position[s->global[v]];
+}
+
+/* Edges are keyed by position, so that both sides of a seam count as one edge. */
+static unsigned long long edge_key(struct simplify *s, unsigned int a, unsigned int b)
+{
+	a = s->wedge[s->global[a]];
+	b = s->wedge[s->global[b]];
+	return a < b ? (unsigned long long)a << 32 | b : (unsigned long long)b << 32 | a;
+}
+
+/* How many triangles use the edge between a and b. */
+static int edge_use(struct simplify *s, unsigned int a, unsigned int b)
+{
+	unsigned long long key = edge_key(s, a, b);
+	int lo = 0, hi = s->edge_count, n = 0;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (s->edge[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	while (lo + n < s->edge_count && s->edge[lo + n].key == key)
+		n++;
+	return n;
+}
+
+/* Find the open and non-manifold edges of the triangles, and classify the vertices. */
+static void classify(struct simplify *s, const unsigned int *tri, int count)
+{
+	int i, k;
+
+	s->edge_count = count;
+	for (i = 0; i < count; i += 3) {
+		for (k = 0; k < 3; k++) {
+			s->edge[i+k].key = edge_key(s, tri[i+k], tri[i+(k+1)%3]);
+			s->edge[i+k].corner = i + k;
+		}
+	}
+	sort_edges(s->edge, s->sort, s->edge_count);
+	for (i = 0; i < count; i = k) {
+		int use;
+		for (k = i + 1; k < count && s->edge[k].key == s->edge[i].key; k++)
+			;
+		use = MIN(k - i, 3);
+		while (i < k)
+			s->edge_use[s->edge[i++].corner] = use;
+	}
+
+	for (i = 0; i < s->count; i++)
+		s->kind[i] = s->locked[s->global[i]] ? KIND_LOCKED : KIND_MANIFOLD;
+	for (i = 0; i < count; i += 3) {
+		for (k = 0; k < 3; k++) {
+			unsigned int a = tri[i+k], b = tri[i+(k+1)%3];
+			int use = s->edge_use[i+k];
+			if (use == 1) {
+				if (s->kind[a] == KIND_MANIFOLD) s->kind[a] = KIND_BORDER;
+				if (s->kind[b] == KIND_MANIFOLD) s->kind[b] = KIND_BORDER;
+			} else if (use > 2) {
+				s->kind[a] = s->kind[b] = KIND_LOCKED;
+			}
+		}
+	}
+}
+
+static void init_quadrics(struct simplify *s, const unsigned int *tri, int count)
+{
+	int i, k;
+
+	memset(s->quadric, 0, s->count * sizeof *s->quadric);
+
+	for (i = 0; i < count; i += 3) {
+		float *p0 = local_position(s, tri[i]);
+		vec3 n;
+		float area;
+		vec_face_normal(n, p0, local_position(s, tri[i+1]), local_position(s, tri[i+2]));
+		area = vec_length(n);
+		if (area == 0)
+			continue;
+		vec_scale(n, n, 1 / area);
+		for (k = 0; k < 3; k++)
+			add_plane(s->quadric + tri[i+k], n, -vec_dot(n, p0), area);
+
+		/* hold open borders in place with a plane through the edge, across the face */
+		for (k = 0; k < 3; k++) {
+			unsigned int a = tri[i+k], b = tri[i+(k+1)%3];
+			vec3 e, m;
+			float len;
+			if (s->edge_use[i+k] != 1)
+				continue;
+			vec_sub(e, local_position(s, b), local_position(s, a));
+			vec_cross(m, e, n);
+			len = vec_length(m);
+			if (len == 0)
+				continue;
+			vec_scale(m, m, 1 / len);
+			add_plane(s->quadric + a, m, -vec_dot(m, local_position(s, a)), len * len * 10);
+			add_plane(s->quadric + b, m, -vec_dot(m, local_position(s, a)), len * len * 10);
+		}
+	}
+}
+
+static int can_collapse(struct simplify *s, unsigned int v, unsigned int w)
+{
+	if (v == w || s->kind[v] == KIND_LOCKED)
+		return 0;
+	if (s->kind[v] == KIND_BORDER)
+		return s->kind[w] != KIND_MANIFOLD && edge_use(s, v, w) == 1;
+	return 1;
+}
+
+static void build_adjacency(struct simplify *s, const unsigned int *tri, int count)
+{
+	int i, n = 0;
+	memset(s->adj_count, 0, s->count * sizeof *s->adj_count);
+	for (i = 0; i < count; i++)
+		s->adj_count[tri[i]]++;
+	for (i = 0; i < s->count; i++) {
+		s->adj_first[i] = n;
+		n += s->adj_count[i];
+		s->adj_count[i] = 0;
+	}
+	for (i = 0; i < count; i++)
+		s->adj[s->adj_first[tri[i]] + s->adj_count[tri[i]]++] = i / 3;
+}
+
+/* Would moving v onto w turn any of its triangles over? */
+static int flips(struct simplify *s, const unsigned int *tri, unsigned int v, unsigned int w)
+{
+	int i, k;
+	for (i = 0; i < s->adj_count[v]; i++) {
+		const unsigned int *t = tri + s->adj[s->adj_first[v] + i] * 3;
+		float *p[3], *q[3];
+		vec3 n0, n1;
+		if (t[0] == w || t[1] == w || t[2] == w)
+			continue; /* goes away */
+		for (k = 0; k < 3; k++) {
+			p[k] = local_position(s, t[k]);
+			q[k] = t[k] == v ? local_position(s, w) : p[k];
+		}
+		vec_face_normal(n0, p[0], p[1], p[2]);
+		vec_face_normal(n1, q[0], q[1], q[2]);
+		if (vec_dot(n0, n1) <= 0.25f * vec_length(n0) * vec_length(n1))
+			return 1;
+	}
+	return 0;
+}
+
+/* Collapse the cheapest edges that do not touch each other; returns the new index count. */
+static int simplify_pass(struct simplify *s, unsigned int *tri, int count, int target, float *error)
+{
+	int i, k, n = 0, removed = 0;
+
+	classify(s, tri, count);
+	build_adjacency(s, tri, count);
+
+	/* the cheapest collapse of each vertex */
+	for (i = 0; i < s->count; i++)
+		s->remap[i] = ~0u;
+	for (i = 0; i < count; i += 3) {
+		for (k = 0; k < 6; k++) { /* both ways along each edge */
+			unsigned int a = tri[i+k%3], b = tri[i+(k+1+k/3)%3];
+			float cost;
+			if (!can_collapse(s, a, b))
+				continue;
+			cost = quadric_error(s->quadric + a, local_position(s, b));
+			if (s->remap[a] == ~0u) {
+				s->remap[a] = n++;
+				s->collapse[s->remap[a]].cost = cost;
+				s->collapse[s->remap[a]].v = a;
+				s->collapse[s->remap[a]].w = b;
+			} else if (cost < s->collapse[s->remap[a]].cost) {
+				s->collapse[s->remap[a]].cost = cost;
+				s->collapse[s->remap[a]].w = b;
+			}
+		}
+	}
+
+	/* costs are not negative, so their bits sort like unsigned integers */
+	for (i = 0; i < n; i++) {
+		union { float f; unsigned int u; } cost = { s->collapse[i].cost };
+		s->order[i].key = (unsigned long long)cost.u << 32 | i;
+		s->order[i].corner = i;
+	}
+	sort_edges(s->order, s->sort, n);
+
+	memset(s->touched, 0, s->count);
+	for (i = 0; i < s->count; i++)
+		s->remap[i] = i;
+
+	for (i = 0; i < n && count - removed * 3 > target; i++) {
+		struct collapse *c = s->collapse + s->order[i].corner;
+		unsigned int v = c->v, w = c->w;
+		int j, shared = 0;
+
+		if (s->touched[v] || s->touched[w])
+			continue;
+		if (flips(s, tri, v, w))
+			continue;
+
+		for (j = 0; j < s->adj_count[v]; j++) {
+			const unsigned int *t = tri + s->adj[s->adj_first[v] + j] * 3;
+			if (t[0] == w || t[1] == w || t[2] == w)
+				shared++;
+			for (k = 0; k < 3; k++)
+				s->touched[t[k]] = 1;
+		}
+
+		s->remap[v] = w;
+		add_quadric(s->quadric + w, s->quadric + v);
+		*error = MAX(*error, c->cost);
+		removed += shared;
+	}
+
+	/* move the collapsed vertices and drop the triangles that have become degenerate */
+	n = 0;
+	for (i = 0; i < count; i += 3) {
+		unsigned int a = s->remap[tri[i]], b = s->remap[tri[i+1]], c = s->remap[tri[i+2]];
+		if (a != b && b != c && c != a) {
+			tri[n++] = a;
+			tri[n++] = b;
+			tri[n++] = c;
+		}
+	}
+	return n;
+}
+
+/* Number the vertices of a part locally, and allocate room for them. */
+static void begin_part(struct simplify *s, const unsigned int *index, int count, unsigned int *tri)
+{
+	int i;
+	s->count = 0;
+	for (i = 0; i < count; i++) {
+		unsigned int v = index[i];
+		if (s->local[v] < 0) {
+			s->global[s->count] = v;
+			s->local[v] = s->count++;
+		}
+		tri[i] = s->local[v];
+	}
+}
+
+static void end_part(struct simplify *s)
+{
+	int i;
+	for (i = 0; i < s->count; i++)
+		s->local[s->global[i]] = -1;
+}
+
+struct sorted_position {
+	vec3 p;
+	unsigned int v;
+};
+
+static int compare_position(const void *a, const void *b)
+{
+	const struct sorted_position *x = a, *y = b;
+	int c = memcmp(x->p, y->p, sizeof(vec3));
+	return c ? c : (int)x->v - (int)y->v;
+}
+
+/* Lock the vertices that share a position with another vertex, or are used by several parts. */
+static void find_locked(struct simplify *s, const struct mesh_data *mesh, const unsigned int *index)
+{
+	struct sorted_position *order = malloc(s->vertex_count * sizeof *order);
+	int *part_of = malloc(s->vertex_count * sizeof *part_of);
+	int i, j, k;
+
+	for (i = 0; i < s->vertex_count; i++) {
+		memcpy(order[i].p, s->position[i], sizeof(vec3));
+		order[i].v = i;
+	}
+	qsort(order, s->vertex_count, sizeof *order, compare_position);
+	for (i = 0; i < s->vertex_count; i = k) {
+		for (k = i + 1; k < s->vertex_count && !memcmp(order[i].p, order[k].p, sizeof(vec3)); k++)
+			;
+		for (j = i; j < k; j++) {
+			s->wedge[order[j].v] = order[i].v;
+			s->locked[order[j].v] = k - i > 1;
+		}
+	}
+
+	for (i = 0; i < s->vertex_count; i++)
+		part_of[i] = -1;
+	for (k = 0; k < mesh->part_count; k++) {
+		for (i = mesh->part[k].first; i < mesh->part[k].first + mesh->part[k].count; i++) {
+			unsigned int v = index[i];
+			if (part_of[v] >= 0 && part_of[v] != k)
+				s->locked[v] = 1;
+			part_of[v] = k;
+		}
+	}
+
+	free(part_of);
+	free(order);
+}
+
+struct level {
+	unsigned int *index;
+	int count, cap;
+	int *first, *part_count; /* for each part */
+	float error;
+};
+
+static void add_to_level(struct level *level, struct simplify *s, int part, const unsigned int *tri, int count)
+{
+	int i;
+	if (level->count + count > level->cap) {
+		level->cap = MAX(level->cap * 2, level->count + count);
+		level->index = realloc(level->index, level->cap * sizeof *level->index);
+	}
+	level->first[part] = level->count;
+	level->part_count[part] = count;
+	for (i = 0; i < count; i++)
+		level->index[level->count++] = s->global[tri[i]];
+}
+
+static void compute_bounds(struct mesh_data *mesh, const struct vertex_attrib *att)
+{
+	vec3 lo, hi, p;
+	int i, k;
+
+	vec_init(lo, 0, 0, 0);
+	vec_init(hi, 0, 0, 0);
+	for (i = 0; i < mesh->vertex_count; i++) {
+		get_vertex_position(mesh, att, i, p);
+		for (k = 0; k < 3; k++) {
+			if (i == 0 || p[k] < lo[k]) lo[k] = p[k];
+			if (i == 0 || p[k] > hi[k]) hi[k] = p[k];
+		}
+	}
+	vec_average(mesh->center, lo, hi);
+	mesh->radius = 0;
+	for (i = 0; i < mesh->vertex_count; i++) {
+		get_vertex_position(mesh, att, i, p);
+		mesh->radius = MAX(mesh->radius, vec_dist(mesh->center, p));
+	}
+}
+
+/* Append the simplified levels to the index buffer, each with its own parts. */
+static void append_levels(struct mesh_data *mesh, struct level *level, int level_count)
+{
+	int i, k, count = mesh->index_count, part_count = mesh->part_count;
+	unsigned char *data;
+
+	for (i = 1; i < level_count; i++)
+		count += level[i].count;
+	mesh->index_data = realloc(mesh->index_data, count * mesh->index_size);
+	mesh->part = realloc(mesh->part, part_count * level_count * sizeof *mesh->part);
+	data = mesh->index_data;
+
+	for (i = 1; i < level_count; i++) {
+		int base = mesh->index_count;
+		for (k = 0; k < level[i].count; k++) {
+			if (mesh->index_size == 4)
+				((unsigned int*)data)[base + k] = level[i].index[k];
+			else
+				((unsigned short*)data)[base + k] = level[i].index[k];
+		}
+		mesh->index_count += level[i].count;
+
+		mesh->lod[i].first = mesh->part_count;
+		mesh->lod[i].count = part_count;
+		mesh->lod[i].error = sqrtf(level[i].error);
+		for (k = 0; k < part_count; k++) {
+			struct part_data *part = mesh->part + mesh->part_count++;
+			*part = mesh->part[k];
+			part->material = mesh->part[k].material ? strdup(mesh->part[k].material) : NULL;
+			part->first = base + level[i].first[k];
+			part->count = level[i].part_count[k];
+		}
+	}
+	mesh->lod_count = level_count;
+}
+
+void build_mesh_lods(struct mesh_data *mesh)
+{
+	const struct vertex_attrib *position = find_position_attrib(mesh);
+	struct level level[MAXLOD];
+	struct simplify s;
+	unsigned int *index, *tri;
+	int i, k, n, max_part = 0, level_count;
+
+	mesh->lod_count = 1;
+	mesh->lod[0].first = 0;
+	mesh->lod[0].count = mesh->part_count;
+	mesh->lod[0].error = 0;
+	vec_init(mesh->center, 0, 0, 0);
+	mesh->radius = 0;
+
+	if (!position)
+		return;
+	compute_bounds(mesh, position);
+	if (lod_levels < 2 || mesh->mapping || mesh->index_count == 0)
+		return;
+
+	index = malloc(mesh->index_count * sizeof *index);
+	for (i = 0; i < mesh->index_count; i++)
+		index[i] = mesh->index_size == 4 ? ((unsigned int*)mesh->index_data)[i] : ((unsigned short*)mesh->index_data)[i];
+	for (k = 0; k < mesh->part_count; k++)
+		max_part = MAX(max_part, mesh->part[k].count);
+
+	memset(&s, 0, sizeof s);
+	s.vertex_count = mesh->vertex_count;
+	s.position = malloc(s.vertex_count * sizeof *s.position);
+	s.wedge = malloc(s.vertex_count * sizeof *s.wedge);
+	s.locked = malloc(s.vertex_count);
+	s.local = malloc(s.vertex_count * sizeof *s.local);
+	s.global = malloc(max_part * sizeof *s.global);
+	s.kind = malloc(max_part);
+	s.touched = malloc(max_part);
+	s.remap = malloc(max_part * sizeof *s.remap);
+	s.quadric = malloc(max_part * sizeof *s.quadric);
+	s.adj_first = malloc(max_part * sizeof *s.adj_first);
+	s.adj_count = malloc(max_part * sizeof *s.adj_count);
+	s.adj = malloc(max_part * sizeof *s.adj);
+	s.edge = malloc(max_part * sizeof *s.edge);
+	s.edge_use = malloc(max_part);
+	s.sort = malloc(max_part * sizeof *s.sort);
+	s.order = malloc(max_part * sizeof *s.order);
+	s.collapse = malloc(max_part * sizeof *s.collapse);
+	tri = malloc(max_part * sizeof *tri);
+
+	for (i = 0; i < s.vertex_count; i++) {
+		get_vertex_position(mesh, position, i, s.position[i]);
+		s.local[i] = -1;
+	}
+	find_locked(&s, mesh, index);
+
+	memset(level, 0, sizeof level);
+	for (i = 1; i < lod_levels; i++) {
+		level[i].first = calloc(mesh->part_count, sizeof *level[i].first);
+		level[i].part_count = calloc(mesh->part_count, sizeof *level[i].part_count);
+	}
+
+	for (k = 0; k < mesh->part_count; k++) {
+		int full = mesh->part[k].count / 3 * 3, count = full;
+		float error = 0;
+
+		begin_part(&s, index + mesh->part[k].first, full, tri);
+		classify(&s, tri, full);
+		init_quadrics(&s, tri, full);
+
+		for (i = 1; i < lod_levels; i++) {
+			int target = MAX(full / 3 >> i, 1) * 3;
+			while (count > target) {
+				n = simplify_pass(&s, tri, count, target, &error);
+				if (n == count || n > count - count / 100)
+					break; /* hardly anything left to collapse */
+				count = n;
+			}
+			add_to_level(level + i, &s, k, tri, count);
+			level[i].error = MAX(level[i].error, error);
+		}
+
+		end_part(&s);
+	}
+
+	/* keep the levels that are worth drawing */
+	n = mesh->index_count;
+	for (level_count = 1; level_count < lod_levels; level_count++) {
+		if (level[level_count].count > n * 3 / 4)
+			break;
+		n = level[level_count].count;
+		for (k = 0; k < mesh->part_count; k++)
+			optimize_vertex_cache(level[level_count].index + level[level_count].first[k],
+				level[level_count].part_count[k], mesh->vertex_count);
+	}
+	if (level_count > 1)
+		append_levels(mesh, level, level_count);
+
+	for (i = 1; i < lod_levels; i++) {
+		free(level[i].index);
+		free(level[i].first);
+		free(level[i].part_count);
+	}
+	free(tri);
+	free(s.position);
+	free(s.wedge);
+	free(s.locked);
+	free(s.local);
+	free(s.global);
+	free(s.kind);
+	free(s.touched);
+	free(s.remap);
+	free(s.quadric);
+	free(s.adj_first);
+	free(s.adj_count);
+	free(s.adj);
+	free(s.edge);
+	free(s.edge_use);
+	free(s.sort);
+	free(s.order);
+	free(s.collapse);
+	free(index);
+}
@@ -0,0 +1,240 @@
+#include "mio.h"
+
+/*
+ * Build the vertex buffer of a mesh from the arrays a loader has decoded.
+ *
+ * All attributes of a vertex are interleaved into one stream. Float arrays
+ * of the common attributes are quantized: positions to 16-bit unorm with a
+ * per-mesh scale and offset that the vertex shader undoes, normals and
+ * tangents to 2_10_10_10 snorm, and texture coordinates to half floats.
+ * Everything else is copied as is.
+ */
+
+static int vertex_quantize = VERTEX_QUANTIZE_ALL;
+
+void set_vertex_quantization(int mask)
+{
+	vertex_quantize = mask;
+}
+
+int vertex_quantization(void)
+{
+	return vertex_quantize;
+}
+
+static int size_of_type(int type)
+{
+	switch (type) {
+	case GL_BYTE: case GL_UNSIGNED_BYTE: return 1;
+	case GL_SHORT: case GL_UNSIGNED_SHORT: case GL_HALF_FLOAT: return 2;
+	case GL_INT: case GL_UNSIGNED_INT: case GL_FLOAT: return 4;
+	case GL_DOUBLE: return 8;
+	}
+	return 4;
+}
+
+static unsigned short float_to_half(float f)
+{
+	union { float f; unsigned int u; } v;
+	unsigned int sign, mant, h;
+	int exp;
+
+	v.f = f;
+	sign = (v.u >> 16) & 0x8000;
+	exp = (v.u >> 23) & 0xff;
+	mant = v.u & 0x7fffff;
+
+	if (exp == 0xff)
+		return sign | 0x7c00 | (mant ? 0x200 : 0);
+	exp = exp - 127 + 15;
+	if (exp >= 31)
+		return sign | 0x7c00;
+	if (exp <= 0) {
+		if (exp < -10)
+			return sign;
+		mant |= 0x800000;
+		h = mant >> (14 - exp);
+		if ((mant >> (13 - exp)) & 1)
+			h++;
+		return sign | h;
+	}
+	h = sign | exp << 10 | mant >> 13;
+	if (mant & 0x1000)
+		h++; /* a carry rounds up into the exponent, as it should */
+	return h;
+}
+
+static unsigned int pack_snorm_10(float x)
+{
+	int v = roundf(CLAMP(x, -1, 1) * 511);
+	return (unsigned int)v & 0x3ff; /* two's complement, so shifts stay unsigned */
+}
+
+/* The direction is what matters, so normalize rather than clamp long vectors. */
+static unsigned int pack_2_10_10_10(float x, float y, float z, float w)
+{
+	float len = sqrtf(x*x + y*y + z*z);
+	if (len > 0) {
+		x /= len;
+		y /= len;
+		z /= len;
+	}
+	return pack_snorm_10(x) | pack_snorm_10(y) << 10 | pack_snorm_10(z) << 20 | ((w < 0 ? 3u : 1u) << 30);
+}
+
+static const float *float_at(const struct vertex_array *a, int i)
+{
+	int stride = a->stride ? a->stride : a->size * sizeof(float);
+	return (const float*)((const unsigned char*)a->data + i * stride);
+}
+
+/* Pick how the array is stored in the vertex buffer, and return its size in bytes. */
+static int choose_format(const struct vertex_array *a, struct vertex_attrib *att)
+{
+	att->index = a->index;
+	att->size = a->size;
+	att->type = a->type;
+	att->normalize = a->normalize;
+
+	if (a->type == GL_FLOAT) {
+		if (a->index == ATT_POSITION && a->size == 3 && (vertex_quantize & VERTEX_QUANTIZE_POSITION)) {
+			att->type = GL_UNSIGNED_SHORT;
+			att->normalize = GL_TRUE;
+			return 8;
+		}
+		if ((a->index == ATT_NORMAL || a->index == ATT_TANGENT) && a->size >= 3 && (vertex_quantize & VERTEX_QUANTIZE_NORMAL)) {
+			att->size = 4;
+			att->type = GL_INT_2_10_10_10_REV;
+			att->normalize = GL_TRUE;
+			return 4;
+		}
+		if (a->index == ATT_TEXCOORD && a->size == 2 && (vertex_quantize & VERTEX_QUANTIZE_TEXCOORD)) {
+			att->type = GL_HALF_FLOAT;
+			att->normalize = GL_FALSE;
+			return 4;
+		}
+	}
+
+	return (a->size * size_of_type(a->type) + 3) & ~3;
+}
+
+static void quantize_positions(struct mesh_data *mesh, const struct vertex_array *a, unsigned char *out, int stride)
+{
+	vec3 lo, hi, inv;
+	int i, k;
+
+	vec_init(lo, 0, 0, 0);
+	vec_init(hi, 0, 0, 0);
+	for (i = 0; i < mesh->vertex_count; i++) {
+		const float *p = float_at(a, i);
+		for (k = 0; k < 3; k++) {
+			if (i == 0 || p[k] < lo[k]) lo[k] = p[k];
+			if (i == 0 || p[k] > hi[k]) hi[k] = p[k];
+		}
+	}
+
+	for (k = 0; k < 3; k++) {
+		mesh->position_offset[k] = lo[k];
+		mesh->position_scale[k] = hi[k] - lo[k]; /* the attribute is normalized to 0..1 */
+		inv[k] = hi[k] > lo[k] ? 65535 / (hi[k] - lo[k]) : 0;
+	}
+
+	for (i = 0; i < mesh->vertex_count; i++) {
+		const float *p = float_at(a, i);
+		unsigned short *q = (unsigned short*)(out + i * stride);
+		for (k = 0; k < 3; k++)
+			q[k] = CLAMP(roundf((p[k] - lo[k]) * inv[k]), 0, 65535);
+		q[3] = 0;
+	}
+}
+
+static void copy_array(struct mesh_data *mesh, const struct vertex_array *a, const struct vertex_attrib *att, unsigned char *out, int stride)
+{
+	int i, n = a->size * size_of_type(a->type);
+	int src_stride = a->stride ? a->stride : n;
+
+	for (i = 0; i < mesh->vertex_count; i++) {
+		const unsigned char *src = (const unsigned char*)a->data + i * src_stride;
+		const float *p = (const float*)src;
+		unsigned char *q = out + i * stride;
+		if (att->type == GL_INT_2_10_10_10_REV) {
+			unsigned int v = pack_2_10_10_10(p[0], p[1], p[2], a->size > 3 ? p[3] : 1);
+			memcpy(q, &v, 4);
+		} else if (att->type == GL_HALF_FLOAT && a->type == GL_FLOAT) {
+			unsigned short h[2] = { float_to_half(p[0]), float_to_half(p[1]) };
+			memcpy(q, h, 4);
+		} else {
+			memcpy(q, src, n);
+		}
+	}
+}
+
+/* Interleave the arrays into mesh->vertex_data; mesh->vertex_count must be set. */
+void build_vertex_layout(struct mesh_data *mesh, const struct vertex_array *arrays, int count)
+{
+	int i, stride = 0;
+
+	vec_init(mesh->position_scale, 1, 1, 1);
+	vec_init(mesh->position_offset, 0, 0, 0);
+
+	mesh->attrib_count = 0;
+	for (i = 0; i < count && mesh->attrib_count < MAXATTRIB; i++) {
+		struct vertex_attrib *att = mesh->attrib + mesh->attrib_count++;
+		att->offset = stride;
+		stride += choose_format(arrays + i, att);
+	}
+
+	mesh->vertex_len = mesh->vertex_count * stride;
+	mesh->vertex_data = malloc(MAX(mesh->vertex_len, 1));
+
+	for (i = 0; i < mesh->attrib_count; i++) {
+		struct vertex_attrib *att = mesh->attrib + i;
+		att->stride = stride;
+		if (att->index == ATT_POSITION && arrays[i].type == GL_FLOAT && att->type == GL_UNSIGNED_SHORT)
+			quantize_positions(mesh, arrays + i, mesh->vertex_data + att->offset, stride);
+		else
+			copy_array(mesh, arrays + i, att, mesh->vertex_data + att->offset, stride);
+	}
+}
+
+/* Return the position array if get_vertex_position can read it. */
+const struct vertex_attrib *find_position_attrib(const struct mesh_data *mesh)
+{
+	int i;
+	for (i = 0; i < mesh->attrib_count; i++) {
+		const struct vertex_attrib *att = mesh->attrib + i;
+		if (att->index == ATT_POSITION && att->size >= 3) {
+			switch (att->type) {
+			case GL_FLOAT: case GL_BYTE: case GL_UNSIGNED_BYTE: case GL_SHORT: case GL_UNSIGNED_SHORT:
+				return att;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Bytes of one vertex that the attribute covers, not counting padding. */
+int vertex_attrib_size(const struct vertex_attrib *att)
+{
+	if (att->type == GL_INT_2_10_10_10_REV)
+		return 4;
+	return att->size * size_of_type(att->type);
+}
+
+/* Read back a position the way the vertex shader sees it, undoing the quantization. */
+void get_vertex_position(const struct mesh_data *mesh, const struct vertex_attrib *att, int i, vec3 p)
+{
+	const unsigned char *src = mesh->vertex_data + att->offset + i * att->stride;
+	int k;
+	for (k = 0; k < 3; k++) {
+		float v;
+		switch (att->type) {
+		case GL_BYTE: v = ((const signed char*)src)[k]; if (att->normalize) v = MAX(v / 127, -1); break;
+		case GL_UNSIGNED_BYTE: v = src[k]; if (att->normalize) v /= 255; break;
+		case GL_SHORT: v = ((const short*)src)[k]; if (att->normalize) v = MAX(v / 32767, -1); break;
+		case GL_UNSIGNED_SHORT: v = ((const unsigned short*)src)[k]; if (att->normalize) v /= 65535; break;
+		default: v = ((const float*)src)[k]; break;
+		}
+		p[k] = v * mesh->position_scale[k] + mesh->position_offset[k];
+	}
+}
@@ -1,41 +1,107 @@
 #include "mio.h"
+#include "pak.h"
 
-// to get zlib decompressor prototypes
-#define STBI_NO_WRITE
-#define STBI_NO_HDR
-#define STBI_HEADER_FILE_ONLY
-#include "stb_image.c"
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define ZIP_LOCAL_FILE_SIG 0x04034b50
 #define ZIP_CENTRAL_DIRECTORY_SIG 0x02014b50
 #define ZIP_END_OF_CENTRAL_DIRECTORY_SIG 0x06054b50
+#define ZIP64_END_OF_CENTRAL_DIRECTORY_SIG 0x06064b50
+#define ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIG 0x07064b50
+#define ZIP64_EXTRA_FIELD_SIG 0x0001
+
+/*
+ * Archives are memory mapped read-only. Stored entries are handed out
+ * as pointers straight into the mapping; only compressed entries need
+ * a buffer of their own. Both zip files and our own pak files (see pak.h)
+ * are read into the same entry table.
+ */
+
+enum { METHOD_STORED, METHOD_DEFLATED, METHOD_LZ4, METHOD_UNKNOWN };
+
+/* I/O counters are kept for every directory and archive, and updated under stats_lock */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Sizes and checksums come from the central directory, since the local
+ * header may leave them zero when a data descriptor follows the file.
+ */
 
 struct entry {
 	char *name;
-	int offset;
+	int64_t offset; /* of the local header for zip, of the data for pak */
+	int64_t csize, usize;
+	int method;
+	unsigned int crc;
+	int verified; /* stored entry passed its crc check */
 };
 
 struct archive {
-	FILE *file;
+	char *name;
+	struct vfs_stats stats;
+	unsigned char *data;
+	int64_t size;
+	struct pakentry *pak_index; /* in the mapping; NULL for zip files */
+#ifdef _WIN32
+	HANDLE file, mapping;
+#endif
 	int count;
 	struct entry *table;
 	struct archive *next;
 };
 
-static inline int getshort(FILE *file)
+/* milliseconds */
+static double vfs_clock(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return now.QuadPart * 1000.0 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+static void count_read(struct vfs_stats *c, int64_t bytes, int64_t compressed, int64_t uncompressed, double time, int failed)
 {
-	int a = getc(file);
-	int b = getc(file);
-	return a | b << 8;
+	pthread_mutex_lock(&stats_lock);
+	c->opens++;
+	c->failed += failed;
+	c->bytes_read += bytes;
+	c->compressed += compressed;
+	c->uncompressed += uncompressed;
+	c->decode_time += time;
+	pthread_mutex_unlock(&stats_lock);
 }
 
-static inline int getlong(FILE *file)
+static inline int getshort(const unsigned char *p)
 {
-	int a = getc(file);
-	int b = getc(file);
-	int c = getc(file);
-	int d = getc(file);
-	return a | b << 8 | c << 16 | d << 24;
+	return p[0] | p[1] << 8;
+}
+
+static inline unsigned int getlong(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static inline int64_t getlonglong(const unsigned char *p)
+{
+	return (int64_t)getlong(p) | (int64_t)getlong(p + 4) << 32;
 }
 
 static int cmpentry(const void *a_, const void *b_)
@@ -45,200 +111,625 @@ static int cmpentry(const void *a_, const void *b_)
 	return strcmp(a->name, b->name);
 }
 
-static unsigned char *read_zip_file(FILE *file, int offset, int *sizep)
+/*
+ * Decompressed archive entries and loose files are read into reference
+ * counted blobs, with the data following the header. Recently used blobs
+ * stay in a byte budgeted LRU cache, so loading them again costs a copy
+ * (or nothing, for views) instead of another read and decompression.
+ */
+
+#define BLOBHASH 1024
+
+struct blob
 {
-	int sig, method, csize, usize;
-	int namelength, extralength;
-	char *cdata, *udata;
+	char *name;
+	unsigned int hash;
+	int size;
+	int refs;
+	int cached;
+	struct blob *next;
+	TAILQ_ENTRY(blob) lru;
+};
+
+#define BLOB_DATA(b) ((unsigned char*)((b) + 1))
+#define DATA_BLOB(p) ((struct blob*)(p) - 1)
+
+static pthread_mutex_t blob_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct blob *blob_table[BLOBHASH];
+static TAILQ_HEAD(blob_list, blob) blob_lru = TAILQ_HEAD_INITIALIZER(blob_lru);
+static int blob_bytes = 0;
+static int blob_budget = 16 << 20;
+static int blob_hits = 0, blob_misses = 0;
 
-	fseek(file, offset, 0);
+static unsigned char *alloc_blob(int size)
+{
+	struct blob *b = malloc(sizeof(struct blob) + size);
+	b->name = NULL;
+	b->hash = 0;
+	b->size = size;
+	b->refs = 1;
+	b->cached = 0;
+	return BLOB_DATA(b);
+}
+
+/* Drop a blob from the cache; it is freed once the last view is released. */
+static void evict_blob(struct blob *b)
+{
+	struct blob **p = &blob_table[b->hash % BLOBHASH];
+	while (*p != b)
+		p = &(*p)->next;
+	*p = b->next;
+	TAILQ_REMOVE(&blob_lru, b, lru);
+	blob_bytes -= b->size;
+	b->cached = 0;
+	free(b->name);
+	b->name = NULL;
+	if (b->refs == 0)
+		free(b);
+}
+
+static void trim_blobs(int budget)
+{
+	while (blob_bytes > budget)
+		evict_blob(TAILQ_LAST(&blob_lru, blob_list));
+}
+
+static unsigned char *find_blob(const char *name, unsigned int hash, int *sizep)
+{
+	struct blob *b;
+	pthread_mutex_lock(&blob_lock);
+	for (b = blob_table[hash % BLOBHASH]; b; b = b->next) {
+		if (b->hash == hash && !strcmp(b->name, name)) {
+			b->refs++;
+			TAILQ_REMOVE(&blob_lru, b, lru);
+			TAILQ_INSERT_HEAD(&blob_lru, b, lru);
+			blob_hits++;
+			pthread_mutex_unlock(&blob_lock);
+			*sizep = b->size;
+			return BLOB_DATA(b);
+		}
+	}
+	pthread_mutex_unlock(&blob_lock);
+	return NULL;
+}
+
+static void cache_blob(unsigned char *data, const char *name, unsigned int hash)
+{
+	struct blob *b = DATA_BLOB(data), *x;
+	pthread_mutex_lock(&blob_lock);
+	blob_misses++;
+	/* large blobs would flush everything else */
+	if (b->size <= blob_budget / 4) {
+		for (x = blob_table[hash % BLOBHASH]; x; x = x->next)
+			if (x->hash == hash && !strcmp(x->name, name))
+				break;
+		if (!x) {
+			b->name = strdup(name);
+			b->hash = hash;
+			b->cached = 1;
+			b->next = blob_table[hash % BLOBHASH];
+			blob_table[hash % BLOBHASH] = b;
+			TAILQ_INSERT_HEAD(&blob_lru, b, lru);
+			blob_bytes += b->size;
+			trim_blobs(blob_budget);
+		}
+	}
+	pthread_mutex_unlock(&blob_lock);
+}
+
+static void release_blob(unsigned char *data)
+{
+	struct blob *b = DATA_BLOB(data);
+	pthread_mutex_lock(&blob_lock);
+	if (--b->refs == 0 && !b->cached)
+		free(b);
+	pthread_mutex_unlock(&blob_lock);
+}
+
+/* Turn a blob into a plain malloc'd buffer that the caller owns. */
+static unsigned char *take_blob(unsigned char *data)
+{
+	struct blob *b = DATA_BLOB(data);
+	unsigned char *copy;
+	int size = b->size;
+
+	pthread_mutex_lock(&blob_lock);
+	if (b->cached || b->refs > 1) {
+		pthread_mutex_unlock(&blob_lock);
+		copy = malloc(size);
+		memcpy(copy, data, size);
+		release_blob(data);
+		return copy;
+	}
+	pthread_mutex_unlock(&blob_lock);
+
+	/* sole owner: slide the data down over the header */
+	memmove(b, data, size);
+	copy = realloc(b, size > 0 ? size : 1);
+	return copy ? copy : (unsigned char*)b;
+}
 
-	sig = getlong(file);
-	if (sig != ZIP_LOCAL_FILE_SIG) {
-		warn("zip: wrong signature for local file");
+static void flush_blobs(void)
+{
+	pthread_mutex_lock(&blob_lock);
+	trim_blobs(0);
+	pthread_mutex_unlock(&blob_lock);
+}
+
+void set_file_cache_budget(int bytes)
+{
+	pthread_mutex_lock(&blob_lock);
+	blob_budget = MAX(bytes, 0);
+	trim_blobs(blob_budget);
+	pthread_mutex_unlock(&blob_lock);
+}
+
+void file_cache_stats(int *hits, int *misses, int *bytes, int *budget)
+{
+	pthread_mutex_lock(&blob_lock);
+	*hits = blob_hits;
+	*misses = blob_misses;
+	*bytes = blob_bytes;
+	*budget = blob_budget;
+	pthread_mutex_unlock(&blob_lock);
+}
+
+/* Find the entry data in the mapping, skipping the zip local header. */
+static unsigned char *entry_data(struct archive *zip, struct entry *entry)
+{
+	int64_t offset = entry->offset;
+	unsigned char *p;
+
+	if (!zip->pak_index) {
+		if (offset < 0 || offset + 30 > zip->size) {
+			warn("zip: bad offset for local file");
+			return NULL;
+		}
+		p = zip->data + offset;
+		if (getlong(p) != ZIP_LOCAL_FILE_SIG) {
+			warn("zip: wrong signature for local file");
+			return NULL;
+		}
+		offset += 30 + getshort(p + 26) + getshort(p + 28);
+	}
+
+	if (offset < 0 || entry->csize < 0 || offset + entry->csize > zip->size) {
+		warn("archive: truncated file: '%s'", entry->name);
 		return NULL;
 	}
+	return zip->data + offset;
+}
 
-	(void) getshort(file); /* version */
-	(void) getshort(file); /* general */
-	method = getshort(file);
-	(void) getshort(file); /* file time */
-	(void) getshort(file); /* file date */
-	(void) getlong(file); /* crc-32 */
-	csize = getlong(file); /* csize */
-	usize = getlong(file); /* usize */
-	namelength = getshort(file);
-	extralength = getshort(file);
+/* Return a pointer into the mapping for stored files; *mappedp tells the caller which kind it got. */
+static unsigned char *read_entry(struct archive *zip, struct entry *entry, int *sizep, int *mappedp)
+{
+	int csize = entry->csize;
+	int usize = entry->usize;
+	unsigned char *p, *udata;
+	double start;
+	int n;
+
+	if (entry->usize < 0 || entry->usize > INT32_MAX || entry->csize > INT32_MAX) {
+		warn("archive: file too large: '%s'", entry->name);
+		count_read(&zip->stats, 0, 0, 0, 0, 1);
+		return NULL;
+	}
 
-	fseek(file, namelength + extralength, 1);
+	p = entry_data(zip, entry);
+	if (!p) {
+		count_read(&zip->stats, 0, 0, 0, 0, 1);
+		return NULL;
+	}
 
-	if (method == 0 && csize == usize) {
-		cdata = malloc(csize);
-		fread(cdata, 1, csize, file);
+	if (entry->method == METHOD_STORED && csize == usize) {
+		if (!entry->verified) {
+			if (update_crc32(0, p, csize) != entry->crc) {
+				warn("archive: crc mismatch in '%s'", entry->name);
+				count_read(&zip->stats, csize, 0, 0, 0, 1);
+				return NULL;
+			}
+			entry->verified = 1;
+		}
+		count_read(&zip->stats, csize, 0, 0, 0, 0);
 		*sizep = csize;
-		return (unsigned char*) cdata;
+		*mappedp = 1;
+		return p;
 	}
 
-	if (method == 8) {
-		cdata = malloc(csize);
-		fread(cdata, 1, csize, file);
-		udata = malloc(usize);
-		usize = stbi_zlib_decode_noheader_buffer(udata, usize, cdata, csize);
-		free(cdata);
-		if (usize < 0) {
-			warn("zip: %s", stbi_failure_reason());
+	if (entry->method == METHOD_DEFLATED || entry->method == METHOD_LZ4) {
+		start = vfs_clock();
+		udata = alloc_blob(usize);
+		if (entry->method == METHOD_DEFLATED)
+			n = inflate_buffer(udata, usize, p, csize);
+		else
+			n = lz4_decompress(p, csize, udata, usize);
+		if (n != usize) {
+			warn("archive: corrupt compressed data in '%s'", entry->name);
+			count_read(&zip->stats, csize, 0, 0, 0, 1);
+			release_blob(udata);
+			return NULL;
+		}
+		if (update_crc32(0, udata, usize) != entry->crc) {
+			warn("archive: crc mismatch in '%s'", entry->name);
+			count_read(&zip->stats, csize, 0, 0, 0, 1);
+			release_blob(udata);
 			return NULL;
 		}
+		count_read(&zip->stats, csize, csize, usize, vfs_clock() - start, 0);
 		*sizep = usize;
-		return (unsigned char*) udata;
+		*mappedp = 0;
+		return udata;
 	}
 
-	warn("zip: unknown compression method");
+	warn("archive: unknown compression method: '%s'", entry->name);
+	count_read(&zip->stats, 0, 0, 0, 0, 1);
 	return NULL;
 }
 
-static int read_zip_dir_imp(struct archive *zip, int startoffset)
+/* Replace saturated 32-bit fields with their values from the zip64 extra field. */
+static int read_zip64_extra(struct entry *entry, const unsigned char *p, const unsigned char *end)
 {
-	FILE *file = zip->file;
-	int sig, offset, count;
+	int id, size;
+	while (p + 4 <= end) {
+		id = getshort(p);
+		size = getshort(p + 2);
+		p += 4;
+		if (p + size > end)
+			return -1;
+		if (id == ZIP64_EXTRA_FIELD_SIG) {
+			const unsigned char *q = p, *qend = p + size;
+			if (entry->usize == 0xFFFFFFFF) {
+				if (q + 8 > qend) return -1;
+				entry->usize = getlonglong(q);
+				q += 8;
+			}
+			if (entry->csize == 0xFFFFFFFF) {
+				if (q + 8 > qend) return -1;
+				entry->csize = getlonglong(q);
+				q += 8;
+			}
+			if (entry->offset == 0xFFFFFFFF) {
+				if (q + 8 > qend) return -1;
+				entry->offset = getlonglong(q);
+			}
+			return 0;
+		}
+		p += size;
+	}
+	return 0;
+}
+
+/* Find the zip64 end of central directory record from the locator in front of the 32-bit one. */
+static int read_zip64_eocd(struct archive *zip, int64_t startoffset, int64_t *countp, int64_t *offsetp)
+{
+	unsigned char *p;
+	int64_t offset;
+
+	if (startoffset < 20)
+		return 0;
+	p = zip->data + startoffset - 20;
+	if (getlong(p) != ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIG)
+		return 0;
+
+	offset = getlonglong(p + 8);
+	if (offset < 0 || offset + 56 > zip->size) {
+		warn("zip: bad offset for zip64 end of central directory");
+		return -1;
+	}
+
+	p = zip->data + offset;
+	if (getlong(p) != ZIP64_END_OF_CENTRAL_DIRECTORY_SIG) {
+		warn("zip: wrong signature for zip64 end of central directory");
+		return -1;
+	}
+
+	*countp = getlonglong(p + 24); /* entries in central directory on this disk */
+	*offsetp = getlonglong(p + 48); /* offset to central directory */
+	return 0;
+}
+
+static int read_zip_dir_imp(struct archive *zip, int64_t startoffset)
+{
+	unsigned char *p = zip->data + startoffset;
+	unsigned char *end = zip->data + zip->size;
+	int64_t offset, count;
 	int namesize, metasize, commentsize;
 	int i, k;
 
-	fseek(file, startoffset, 0);
+	if (startoffset + 22 > zip->size) {
+		warn("zip: truncated end of central directory");
+		return -1;
+	}
 
-	sig = getlong(file);
-	if (sig != ZIP_END_OF_CENTRAL_DIRECTORY_SIG) {
+	if (getlong(p) != ZIP_END_OF_CENTRAL_DIRECTORY_SIG) {
 		warn("zip: wrong signature for end of central directory");
 		return -1;
 	}
 
-	(void) getshort(file); /* this disk */
-	(void) getshort(file); /* start disk */
-	(void) getshort(file); /* entries in this disk */
-	count = getshort(file); /* entries in central directory disk */
-	(void) getlong(file); /* size of central directory */
-	offset = getlong(file); /* offset to central directory */
+	count = getshort(p + 10); /* entries in central directory disk */
+	offset = getlong(p + 16); /* offset to central directory */
+
+	if (read_zip64_eocd(zip, startoffset, &count, &offset) < 0)
+		return -1;
+
+	/* every central directory record is at least 46 bytes */
+	if (offset < 0 || offset > zip->size || count < 0 || count > (zip->size - offset) / 46 || count > INT32_MAX) {
+		warn("zip: bad central directory");
+		return -1;
+	}
 
 	zip->count = count;
 	zip->table = calloc(count, sizeof(struct entry));
 
-	fseek(file, offset, 0);
+	p = zip->data + offset;
 
 	for (i = 0; i < count; i++)
 	{
 		struct entry *entry = zip->table + i;
 
-		sig = getlong(file);
-		if (sig != ZIP_CENTRAL_DIRECTORY_SIG) {
-			for (k = 0; k < i; k++)
-				free(zip->table[k].name);
-			free(zip->table);
-			warn("zip: wrong signature for central directory");
-			return -1;
-		}
+		if (p + 46 > end || getlong(p) != ZIP_CENTRAL_DIRECTORY_SIG ||
+				p + 46 + getshort(p + 28) + getshort(p + 30) > end)
+			goto error;
 
-		(void) getshort(file); /* version made by */
-		(void) getshort(file); /* version to extract */
-		(void) getshort(file); /* general */
-		(void) getshort(file); /* method */
-		(void) getshort(file); /* last mod file time */
-		(void) getshort(file); /* last mod file date */
-		(void) getlong(file); /* crc-32 */
-		(void) getlong(file); /* csize */
-		(void) getlong(file); /* usize */
-		namesize = getshort(file);
-		metasize = getshort(file);
-		commentsize = getshort(file);
-		(void) getshort(file); /* disk number start */
-		(void) getshort(file); /* int file atts */
-		(void) getlong(file); /* ext file atts */
-		entry->offset = getlong(file);
+		namesize = getshort(p + 28);
+		metasize = getshort(p + 30);
+		commentsize = getshort(p + 32);
+		switch (getshort(p + 10)) {
+		case 0: entry->method = METHOD_STORED; break;
+		case 8: entry->method = METHOD_DEFLATED; break;
+		default: entry->method = METHOD_UNKNOWN; break;
+		}
+		entry->crc = getlong(p + 16);
+		entry->csize = getlong(p + 20);
+		entry->usize = getlong(p + 24);
+		entry->offset = getlong(p + 42);
 
+		p += 46;
 		entry->name = malloc(namesize + 1);
-		fread(entry->name, 1, namesize, file);
+		memcpy(entry->name, p, namesize);
 		entry->name[namesize] = 0;
 
-		fseek(file, metasize, 1);
-		fseek(file, commentsize, 1);
+		if (read_zip64_extra(entry, p + namesize, p + namesize + metasize) < 0)
+			goto error;
+
+		p += namesize + metasize + commentsize;
 	}
 
 	qsort(zip->table, count, sizeof(struct entry), cmpentry);
 
 	return 0;
+
+error:
+	for (k = 0; k <= i && k < count; k++)
+		free(zip->table[k].name);
+	free(zip->table);
+	zip->table = NULL;
+	zip->count = 0;
+	warn("zip: wrong signature for central directory");
+	return -1;
 }
 
 static int read_zip_dir(struct archive *zip)
 {
-	FILE *file = zip->file;
-	unsigned char buf[512];
-	int filesize, back, maxback;
-	int i, n;
+	int64_t i, maxback;
 
-	fseek(file, 0, 2);
-	filesize = ftell(file);
+	maxback = MIN(zip->size, 0xFFFF + 22);
 
-	maxback = MIN(filesize, 0xFFFF + sizeof buf);
-	back = MIN(maxback, sizeof buf);
+	for (i = zip->size - 22; i >= zip->size - maxback; i--)
+		if (!memcmp(zip->data + i, "PK\5\6", 4))
+			return read_zip_dir_imp(zip, i);
 
-	while (back < maxback) {
-		fseek(file, filesize - back, 0);
-		n = fread(buf, 1, sizeof buf, file);
-		if (n < 0) {
-			warn("zip: cannot read end of central directory");
+	warn("zip: cannot find end of central directory");
+	return -1;
+}
+
+static int read_pak_dir(struct archive *zip)
+{
+	struct pakheader *hdr = (void*)zip->data;
+	struct pakentry *index;
+	const char *names;
+	int i;
+
+	if (zip->size < sizeof *hdr || hdr->version != PAK_VERSION) {
+		warn("pak: unsupported version");
+		return -1;
+	}
+
+	if (hdr->ofs_entries % 8 || hdr->ofs_entries > zip->size ||
+			hdr->num_entries > (zip->size - hdr->ofs_entries) / sizeof *index ||
+			hdr->ofs_names > zip->size || hdr->num_names > zip->size - hdr->ofs_names ||
+			(hdr->num_names > 0 && zip->data[hdr->ofs_names + hdr->num_names - 1] != 0)) {
+		warn("pak: bad index");
+		return -1;
+	}
+
+	index = (void*)(zip->data + hdr->ofs_entries);
+	names = (const char*)zip->data + hdr->ofs_names;
+
+	zip->count = hdr->num_entries;
+	zip->table = calloc(zip->count, sizeof(struct entry));
+	zip->pak_index = index;
+
+	for (i = 0; i < zip->count; i++) {
+		struct entry *entry = zip->table + i;
+		if (index[i].name >= hdr->num_names) {
+			while (i--)
+				free(zip->table[i].name);
+			free(zip->table);
+			zip->table = NULL;
+			zip->count = 0;
+			warn("pak: bad name in index");
 			return -1;
 		}
+		entry->name = strdup(names + index[i].name);
+		entry->offset = index[i].offset;
+		entry->csize = index[i].csize;
+		entry->usize = index[i].usize;
+		entry->crc = index[i].crc;
+		switch (index[i].codec) {
+		case PAK_STORED: entry->method = METHOD_STORED; break;
+		case PAK_LZ4: entry->method = METHOD_LZ4; break;
+		default: entry->method = METHOD_UNKNOWN; break;
+		}
+	}
 
-		for (i = n - 4; i > 0; i--)
-			if (!memcmp(buf + i, "PK\5\6", 4))
-				return read_zip_dir_imp(zip, filesize - back + i);
+	return 0;
+}
 
-		back += sizeof buf - 4;
+static int map_archive(struct archive *zip, const char *filename)
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	zip->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (zip->file == INVALID_HANDLE_VALUE)
+		return -1;
+	if (!GetFileSizeEx(zip->file, &size) || size.QuadPart == 0 || size.QuadPart > SIZE_MAX) {
+		CloseHandle(zip->file);
+		return -1;
 	}
-
-	warn("zip: cannot find end of central directory");
-	return -1;
+	zip->size = size.QuadPart;
+	zip->mapping = CreateFileMapping(zip->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!zip->mapping) {
+		CloseHandle(zip->file);
+		return -1;
+	}
+	zip->data = MapViewOfFile(zip->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!zip->data) {
+		CloseHandle(zip->mapping);
+		CloseHandle(zip->file);
+		return -1;
+	}
+	return 0;
+#else
+	struct stat info;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &info) < 0 || info.st_size == 0 || (uint64_t)info.st_size > SIZE_MAX) {
+		close(fd);
+		return -1;
+	}
+	zip->size = info.st_size;
+	zip->data = mmap(NULL, zip->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (zip->data == MAP_FAILED)
+		return -1;
+	return 0;
+#endif
 }
 
-struct archive *open_archive(const char *filename)
+static void unmap_archive(struct archive *zip)
 {
-	struct archive *zip;
-	FILE *file;
+#ifdef _WIN32
+	UnmapViewOfFile(zip->data);
+	CloseHandle(zip->mapping);
+	CloseHandle(zip->file);
+#else
+	munmap(zip->data, zip->size);
+#endif
+}
 
-	file = fopen(filename, "rb");
-	if (!file) {
-		warn("cannot open archive: '%s'", filename);
+/* Map a whole file outside of the VFS, read-only; for files we write ourselves. */
+const unsigned char *map_file(const char *filename, int *lenp)
+{
+	struct archive tmp;
+	if (map_archive(&tmp, filename) < 0)
+		return NULL;
+	if (tmp.size > INT32_MAX) {
+		unmap_archive(&tmp);
 		return NULL;
 	}
+#ifdef _WIN32
+	/* the view keeps the mapping alive */
+	CloseHandle(tmp.mapping);
+	CloseHandle(tmp.file);
+#endif
+	*lenp = tmp.size;
+	return tmp.data;
+}
+
+void unmap_file(const unsigned char *data, int len)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap((void*)data, len);
+#endif
+}
+
+struct archive *open_archive(const char *filename)
+{
+	struct archive *zip;
+	int error;
 
 	zip = malloc(sizeof(struct archive));
-	zip->file = file;
+	memset(&zip->stats, 0, sizeof zip->stats);
+	zip->name = NULL;
+	zip->data = NULL;
+	zip->size = 0;
 	zip->count = 0;
 	zip->table = NULL;
+	zip->pak_index = NULL;
 	zip->next = NULL;
 
-	if (read_zip_dir(zip) < 0) {
+	if (map_archive(zip, filename) < 0) {
+		warn("cannot open archive: '%s'", filename);
+		free(zip);
+		return NULL;
+	}
+
+	if (zip->size >= 8 && !memcmp(zip->data, PAK_MAGIC, 8))
+		error = read_pak_dir(zip);
+	else
+		error = read_zip_dir(zip);
+	if (error < 0) {
+		unmap_archive(zip);
 		free(zip);
-		fclose(file);
 		return NULL;
 	}
 
+	zip->name = strdup(filename);
+	zip->stats.name = zip->name;
 	return zip;
 }
 
 void close_archive(struct archive *zip)
 {
 	int i;
-	fclose(zip->file);
+	unmap_archive(zip);
 	for (i = 0; i < zip->count; i++)
 		free(zip->table[i].name);
 	free(zip->table);
+	free(zip->name);
 	free(zip);
 }
 
-unsigned char *read_archive(struct archive *zip, const char *filename, int *sizep)
+/* The pak index is sorted by hash; look for the first entry with the hash and scan from there. */
+static unsigned char *read_pak_imp(struct archive *zip, const char *filename, int *sizep, int *mappedp)
+{
+	uint32_t hash = pak_hash(filename);
+	int l = 0;
+	int r = zip->count;
+	while (l < r) {
+		int m = (l + r) >> 1;
+		if (zip->pak_index[m].hash < hash)
+			l = m + 1;
+		else
+			r = m;
+	}
+	for (; l < zip->count && zip->pak_index[l].hash == hash; l++)
+		if (!strcmp(filename, zip->table[l].name))
+			return read_entry(zip, zip->table + l, sizep, mappedp);
+	return NULL;
+}
+
+static unsigned char *read_archive_imp(struct archive *zip, const char *filename, int *sizep, int *mappedp)
 {
 	int l = 0;
 	int r = zip->count - 1;
+	if (zip->pak_index)
+		return read_pak_imp(zip, filename, sizep, mappedp);
 	while (l <= r) {
 		int m = (l + r) >> 1;
 		int c = strcmp(filename, zip->table[m].name);
@@ -247,42 +738,258 @@ unsigned char *read_archive(struct archive *zip, const char *filename, int *size
 		else if (c > 0)
 			l = m + 1;
 		else
-			return read_zip_file(zip->file, zip->table[m].offset, sizep);
+			return read_entry(zip, zip->table + m, sizep, mappedp);
 	}
 	return NULL;
 }
 
-unsigned char *read_file(const char *filename, int *lenp)
+int archive_entry_count(struct archive *zip)
+{
+	return zip->count;
+}
+
+const char *archive_entry_name(struct archive *zip, int i)
+{
+	return zip->table[i].name;
+}
+
+unsigned char *read_archive(struct archive *zip, const char *filename, int *sizep)
+{
+	unsigned char *data, *copy;
+	int mapped, size;
+	data = read_archive_imp(zip, filename, &size, &mapped);
+	if (data && mapped) {
+		copy = malloc(size);
+		memcpy(copy, data, size);
+		data = copy;
+	} else if (data) {
+		data = take_blob(data);
+	}
+	if (data && sizep) *sizep = size;
+	return data;
+}
+
+static unsigned char *read_file(const char *filename, int *lenp, struct vfs_stats *stats)
 {
 	unsigned char *data;
 	int len;
 	FILE *file = fopen(filename, "rb");
 	if (!file) {
+		count_read(stats, 0, 0, 0, 0, 1);
 		return NULL;
 	}
 	fseek(file, 0, 2);
 	len = ftell(file);
 	fseek(file, 0, 0);
-	data = malloc(len);
+	data = alloc_blob(len);
 	fread(data, 1, len, file);
 	fclose(file);
+	count_read(stats, len, 0, 0, 0, 0);
 	if (lenp) *lenp = len;
 	return data;
 }
 
 /*
- * Virtual filesystem -- look for files in registered directories and archives.
+ * Virtual filesystem -- every registered directory and archive is indexed
+ * in one hash table that maps path names to the source holding the file.
+ * Directories take precedence over archives, and within each kind the most
+ * recently registered source wins. Names that could not be found are kept
+ * in a separate table so repeated probes for missing files cost nothing.
+ *
+ * A directory is indexed once, when it is registered; files created in it
+ * later are not found until rescan_directories is called.
  */
 
+#define MAXMISS 4096
+
 struct directory
 {
 	char *name;
+	int rank;
+	struct vfs_stats stats;
 	struct directory *next;
 };
 
+struct source
+{
+	char *name;
+	unsigned int hash;
+	int rank;
+	struct directory *dir;
+	struct archive *zip;
+	struct entry *entry;
+};
+
+struct miss
+{
+	char *name;
+	unsigned int hash;
+};
+
+static pthread_mutex_t vfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct directory *dir_head = NULL;
 static struct archive *zip_head = NULL;
 
+static struct source *vfs_table = NULL;
+static int vfs_cap = 0, vfs_len = 0;
+static int vfs_rank = 0;
+
+static struct miss *miss_table = NULL;
+static int miss_cap = 0, miss_len = 0;
+
+static unsigned int hash_name(const char *s)
+{
+	unsigned int h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static struct source *find_source(const char *name, unsigned int hash)
+{
+	unsigned int mask = vfs_cap - 1;
+	unsigned int i = hash & mask;
+	if (!vfs_cap)
+		return NULL;
+	while (vfs_table[i].name) {
+		if (vfs_table[i].hash == hash && !strcmp(vfs_table[i].name, name))
+			return vfs_table + i;
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+static void put_source(struct source *src)
+{
+	unsigned int mask = vfs_cap - 1;
+	unsigned int i = src->hash & mask;
+	while (vfs_table[i].name)
+		i = (i + 1) & mask;
+	vfs_table[i] = *src;
+}
+
+static void grow_sources(void)
+{
+	struct source *old = vfs_table;
+	int i, oldcap = vfs_cap;
+	vfs_cap = vfs_cap ? vfs_cap * 2 : 1024;
+	vfs_table = calloc(vfs_cap, sizeof(struct source));
+	for (i = 0; i < oldcap; i++)
+		if (old[i].name)
+			put_source(old + i);
+	free(old);
+}
+
+static void add_source(const char *name, int rank, struct directory *dir, struct archive *zip, struct entry *entry)
+{
+	unsigned int hash = hash_name(name);
+	struct source *src = find_source(name, hash);
+	if (src) {
+		if (src->rank > rank)
+			return;
+	} else {
+		struct source tmp;
+		if ((vfs_len + 1) * 2 > vfs_cap)
+			grow_sources();
+		tmp.name = strdup(name);
+		tmp.hash = hash;
+		tmp.dir = NULL;
+		tmp.zip = NULL;
+		put_source(&tmp);
+		src = find_source(name, hash);
+		vfs_len++;
+	}
+	src->rank = rank;
+	src->dir = dir;
+	src->zip = zip;
+	src->entry = entry;
+}
+
+static void clear_misses(void)
+{
+	int i;
+	for (i = 0; i < miss_cap; i++)
+		free(miss_table[i].name);
+	free(miss_table);
+	miss_table = NULL;
+	miss_cap = miss_len = 0;
+}
+
+static int find_miss(const char *name, unsigned int hash)
+{
+	unsigned int mask = miss_cap - 1;
+	unsigned int i = hash & mask;
+	if (!miss_cap)
+		return 0;
+	while (miss_table[i].name) {
+		if (miss_table[i].hash == hash && !strcmp(miss_table[i].name, name))
+			return 1;
+		i = (i + 1) & mask;
+	}
+	return 0;
+}
+
+static void add_miss(const char *name, unsigned int hash)
+{
+	unsigned int mask;
+	unsigned int i;
+	if (miss_len >= MAXMISS)
+		clear_misses();
+	if (!miss_cap) {
+		miss_cap = MAXMISS * 2;
+		miss_table = calloc(miss_cap, sizeof(struct miss));
+	}
+	mask = miss_cap - 1;
+	i = hash & mask;
+	while (miss_table[i].name)
+		i = (i + 1) & mask;
+	miss_table[i].name = strdup(name);
+	miss_table[i].hash = hash;
+	miss_len++;
+}
+
+static void scan_directory(struct directory *dir, const char *prefix, int rank)
+{
+	char path[512], name[512];
+	struct stat info;
+	struct dirent *ent;
+	DIR *d;
+
+	strlcpy(path, dir->name, sizeof path);
+	strlcat(path, prefix, sizeof path);
+	d = opendir(path);
+	if (!d)
+		return;
+
+	while ((ent = readdir(d))) {
+		if (ent->d_name[0] == '.')
+			continue;
+		strlcpy(name, prefix, sizeof name);
+		strlcat(name, ent->d_name, sizeof name);
+		strlcpy(path, dir->name, sizeof path);
+		strlcat(path, name, sizeof path);
+#ifdef _WIN32
+		if (stat(path, &info) < 0)
+			continue;
+#else
+		/* links to directories are skipped, since they may lead back up the tree */
+		if (lstat(path, &info) < 0)
+			continue;
+		if (S_ISLNK(info.st_mode) && (stat(path, &info) < 0 || S_ISDIR(info.st_mode)))
+			continue;
+#endif
+		if (S_ISDIR(info.st_mode)) {
+			strlcat(name, "/", sizeof name);
+			scan_directory(dir, name, rank);
+		} else if (S_ISREG(info.st_mode)) {
+			add_source(name, rank, dir, NULL, NULL);
+		}
+	}
+
+	closedir(d);
+}
+
 void register_directory(const char *dirname)
 {
 	char buf[512];
@@ -292,39 +999,682 @@ void register_directory(const char *dirname)
 	if (n > 0 && buf[n-1] != '/')
 		strlcat(buf, "/", sizeof buf);
 	dir->name = strdup(buf);
+	memset(&dir->stats, 0, sizeof dir->stats);
+	dir->stats.name = dir->name;
+
+	pthread_mutex_lock(&vfs_lock);
 	dir->next = dir_head;
 	dir_head = dir;
+	/* directories always shadow archives */
+	dir->rank = 0x40000000 + ++vfs_rank;
+	scan_directory(dir, "", dir->rank);
+	clear_misses();
+	pthread_mutex_unlock(&vfs_lock);
+
+	/* cached blobs may now be shadowed */
+	flush_blobs();
+}
+
+/* Pick up files written to registered directories since they were scanned. */
+void rescan_directories(void)
+{
+	struct directory *dir;
+
+	pthread_mutex_lock(&vfs_lock);
+	for (dir = dir_head; dir; dir = dir->next)
+		scan_directory(dir, "", dir->rank);
+	clear_misses();
+	pthread_mutex_unlock(&vfs_lock);
+
+	flush_blobs();
 }
 
 void register_archive(const char *zipname)
 {
 	struct archive *zip = open_archive(zipname);
+	int i, rank;
 	if (zip) {
+		pthread_mutex_lock(&vfs_lock);
 		zip->next = zip_head;
 		zip_head = zip;
+		rank = ++vfs_rank;
+		for (i = 0; i < zip->count; i++)
+			add_source(zip->table[i].name, rank, NULL, zip, zip->table + i);
+		clear_misses();
+		pthread_mutex_unlock(&vfs_lock);
+		flush_blobs();
 	}
 }
 
-unsigned char *load_file(const char *filename, int *lenp)
+/*
+ * Statistics -- loads served from the blob cache and loose files outside
+ * any registered source have counters of their own. Opens count attempts,
+ * so probes for names that exist nowhere show up as failed loose files. The access log has one record per file
+ * name, in the order the files were first asked for.
+ */
+
+struct access
 {
-	struct directory *dir = dir_head;
-	struct archive *zip = zip_head;
-	unsigned char *data;
-	char buf[512];
+	char *name;
+	unsigned int hash;
+	const char *source;
+	int size;
+	int loads, hits, failed;
+	double time;
+};
+
+static struct vfs_stats cache_stats = { "(cache)" };
+static struct vfs_stats loose_stats = { "(files)" };
+
+static struct access *access_list = NULL;
+static int access_len = 0, access_cap = 0;
+static int *access_index = NULL; /* open addressing table of access_list positions + 1 */
+static int access_index_cap = 0;
+
+static void index_access(int k)
+{
+	unsigned int mask = access_index_cap - 1;
+	unsigned int i = access_list[k].hash & mask;
+	while (access_index[i])
+		i = (i + 1) & mask;
+	access_index[i] = k + 1;
+}
+
+static struct access *find_access(const char *name, unsigned int hash)
+{
+	unsigned int mask = access_index_cap - 1;
+	unsigned int i;
+	int k;
+
+	if (access_index_cap) {
+		for (i = hash & mask; (k = access_index[i]); i = (i + 1) & mask)
+			if (access_list[k-1].hash == hash && !strcmp(access_list[k-1].name, name))
+				return access_list + k - 1;
+	}
 
-	data = read_file(filename, lenp);
+	if (access_len == access_cap) {
+		access_cap = access_cap ? access_cap * 2 : 256;
+		access_list = realloc(access_list, access_cap * sizeof(struct access));
+	}
+	if ((access_len + 1) * 2 > access_index_cap) {
+		free(access_index);
+		access_index_cap = access_cap * 2;
+		access_index = calloc(access_index_cap, sizeof(int));
+		for (k = 0; k < access_len; k++)
+			index_access(k);
+	}
+
+	memset(access_list + access_len, 0, sizeof(struct access));
+	access_list[access_len].name = strdup(name);
+	access_list[access_len].hash = hash;
+	index_access(access_len);
+	return access_list + access_len++;
+}
 
-	while (!data && dir) {
-		strlcpy(buf, dir->name, sizeof buf);
+static void log_access(const char *name, unsigned int hash, const char *source, int size, int hit, double start)
+{
+	struct access *a;
+	double time = vfs_clock() - start;
+	pthread_mutex_lock(&stats_lock);
+	a = find_access(name, hash);
+	a->loads++;
+	if (source) {
+		if (!hit || !a->source)
+			a->source = source; /* keep where a cached file came from */
+		a->size = size;
+		a->hits += hit;
+	} else {
+		a->failed++;
+	}
+	a->time += time;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+int vfs_stats(struct vfs_stats *list, int max)
+{
+	struct directory *dir;
+	struct archive *zip;
+	int n = 0;
+
+	pthread_mutex_lock(&vfs_lock);
+	pthread_mutex_lock(&stats_lock);
+	for (dir = dir_head; dir && n < max; dir = dir->next)
+		list[n++] = dir->stats;
+	for (zip = zip_head; zip && n < max; zip = zip->next)
+		list[n++] = zip->stats;
+	if (n < max)
+		list[n++] = cache_stats;
+	if (n < max)
+		list[n++] = loose_stats;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_mutex_unlock(&vfs_lock);
+
+	return n;
+}
+
+void reset_vfs_stats(void)
+{
+	struct directory *dir;
+	struct archive *zip;
+	int i;
+
+	pthread_mutex_lock(&vfs_lock);
+	pthread_mutex_lock(&stats_lock);
+	for (dir = dir_head; dir; dir = dir->next) {
+		memset(&dir->stats, 0, sizeof dir->stats);
+		dir->stats.name = dir->name;
+	}
+	for (zip = zip_head; zip; zip = zip->next) {
+		memset(&zip->stats, 0, sizeof zip->stats);
+		zip->stats.name = zip->name;
+	}
+	memset(&cache_stats, 0, sizeof cache_stats);
+	cache_stats.name = "(cache)";
+	memset(&loose_stats, 0, sizeof loose_stats);
+	loose_stats.name = "(files)";
+	for (i = 0; i < access_len; i++)
+		free(access_list[i].name);
+	access_len = 0;
+	if (access_index)
+		memset(access_index, 0, access_index_cap * sizeof(int));
+	pthread_mutex_unlock(&stats_lock);
+	pthread_mutex_unlock(&vfs_lock);
+}
+
+void print_vfs_stats(void)
+{
+	struct vfs_stats list[64], total;
+	int i, n = vfs_stats(list, nelem(list));
+
+	memset(&total, 0, sizeof total);
+	console_printf("%-28s %6s %6s %9s %9s %9s %7s\n",
+		"source", "opens", "failed", "read KB", "packed KB", "unpack KB", "ms");
+	for (i = 0; i < n; i++) {
+		console_printf("%-28.28s %6d %6d %9d %9d %9d %7.1f\n", list[i].name,
+			list[i].opens, list[i].failed,
+			(int)(list[i].bytes_read >> 10), (int)(list[i].compressed >> 10),
+			(int)(list[i].uncompressed >> 10), list[i].decode_time);
+		total.opens += list[i].opens;
+		total.failed += list[i].failed;
+		total.bytes_read += list[i].bytes_read;
+		total.compressed += list[i].compressed;
+		total.uncompressed += list[i].uncompressed;
+		total.decode_time += list[i].decode_time;
+	}
+	console_printf("%-28s %6d %6d %9d %9d %9d %7.1f\n", "total",
+		total.opens, total.failed,
+		(int)(total.bytes_read >> 10), (int)(total.compressed >> 10),
+		(int)(total.uncompressed >> 10), total.decode_time);
+}
+
+/* Write the access log as tab separated text, in first access order. */
+int dump_vfs_log(const char *filename)
+{
+	FILE *file = fopen(filename, "w");
+	int i;
+	if (!file) {
+		warn("cannot write access log: '%s'", filename);
+		return -1;
+	}
+	pthread_mutex_lock(&stats_lock);
+	fprintf(file, "# name\tsource\tsize\tloads\tcached\tfailed\tms\n");
+	for (i = 0; i < access_len; i++) {
+		struct access *a = access_list + i;
+		fprintf(file, "%s\t%s\t%d\t%d\t%d\t%d\t%.3f\n", a->name,
+			a->source ? a->source : "-", a->size, a->loads, a->hits, a->failed, a->time);
+	}
+	pthread_mutex_unlock(&stats_lock);
+	fclose(file);
+	return 0;
+}
+
+/*
+ * Prefetch. Ask the kernel to start reading a file in the background, so
+ * the load that follows does not stall on the disk. Archive entries are
+ * madvised in the mapping; for zip files the local header size is not
+ * known without touching the page, so leave some room for it.
+ */
+
+#define PREFETCH_SLACK 1024
+
+void prefetch_file(const char *filename)
+{
+	unsigned int hash = hash_name(filename);
+	struct archive *zip = NULL;
+	struct source *src;
+	int64_t offset = 0, length = 0;
+	char buf[512];
+
+	buf[0] = 0;
+	pthread_mutex_lock(&vfs_lock);
+	src = find_source(filename, hash);
+	if (src && src->zip) {
+		zip = src->zip;
+		offset = src->entry->offset;
+		length = src->entry->csize;
+		if (!zip->pak_index)
+			length += 30 + strlen(src->entry->name) + PREFETCH_SLACK;
+	} else if (src) {
+		strlcpy(buf, src->dir->name, sizeof buf);
 		strlcat(buf, filename, sizeof buf);
-		data = read_file(buf, lenp);
-		dir = dir->next;
 	}
+	pthread_mutex_unlock(&vfs_lock);
+
+#ifndef _WIN32
+	if (zip) {
+		int64_t page = sysconf(_SC_PAGESIZE);
+		int64_t start = offset & ~(page - 1);
+		int64_t end = MIN(offset + length, zip->size);
+		if (start < end)
+			madvise(zip->data + start, end - start, MADV_WILLNEED);
+	} else if (buf[0]) {
+		int fd = open(buf, O_RDONLY);
+		if (fd >= 0) {
+#if defined(POSIX_FADV_WILLNEED)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+			struct stat st;
+			if (!fstat(fd, &st)) {
+				struct radvisory ra;
+				ra.ra_offset = 0;
+				ra.ra_count = MIN(st.st_size, 0x7fffffff);
+				fcntl(fd, F_RDADVISE, &ra);
+			}
+#endif
+			close(fd);
+		}
+	}
+#endif
+}
 
-	while (!data && zip) {
-		data = read_archive(zip, filename, lenp);
-		zip = zip->next;
+/* Prefetch every file named in an access log, in the order listed. */
+int prefetch_files(const char *logname)
+{
+	char line[1024];
+	FILE *file = fopen(logname, "r");
+	if (!file) {
+		warn("cannot open access log: '%s'", logname);
+		return -1;
+	}
+	while (fgets(line, sizeof line, file)) {
+		if (line[0] == '#')
+			continue;
+		line[strcspn(line, "\t\r\n")] = 0;
+		if (line[0])
+			prefetch_file(line);
 	}
+	fclose(file);
+	return 0;
+}
+
+static unsigned char *load_file_imp(const char *filename, int *lenp, int *mappedp)
+{
+	unsigned int hash = hash_name(filename);
+	double start = vfs_clock();
+	struct directory *dir = NULL;
+	struct archive *zip = NULL;
+	struct source *src;
+	const char *source = NULL;
+	unsigned char *data = NULL;
+	char buf[512];
+	struct entry *entry = NULL;
+	int miss;
+
+	*mappedp = 0;
 
+	data = find_blob(filename, hash, lenp);
+	if (data) {
+		count_read(&cache_stats, 0, 0, 0, 0, 0);
+		log_access(filename, hash, cache_stats.name, *lenp, 1, start);
+		return data;
+	}
+
+	pthread_mutex_lock(&vfs_lock);
+	src = find_source(filename, hash);
+	if (src) {
+		zip = src->zip;
+		entry = src->entry;
+		dir = src->dir;
+		if (!zip) {
+			strlcpy(buf, dir->name, sizeof buf);
+			strlcat(buf, filename, sizeof buf);
+		}
+	}
+	miss = !src && find_miss(filename, hash);
+	pthread_mutex_unlock(&vfs_lock);
+
+	if (zip) {
+		data = read_entry(zip, entry, lenp, mappedp);
+		source = zip->name;
+	} else if (dir) {
+		data = read_file(buf, lenp, &dir->stats);
+		source = dir->name;
+	} else if (miss) {
+		count_read(&loose_stats, 0, 0, 0, 0, 1);
+	} else {
+		/* not in any registered source; try the name as a plain path */
+		data = read_file(filename, lenp, &loose_stats);
+		source = loose_stats.name;
+		if (!data) {
+			pthread_mutex_lock(&vfs_lock);
+			add_miss(filename, hash);
+			pthread_mutex_unlock(&vfs_lock);
+		}
+	}
+
+	log_access(filename, hash, data ? source : NULL, data ? *lenp : 0, 0, start);
+
+	if (data && !*mappedp)
+		cache_blob(data, filename, hash);
+	return data;
+}
+
+unsigned char *load_file(const char *filename, int *lenp)
+{
+	unsigned char *data, *copy;
+	int mapped, len;
+	data = load_file_imp(filename, &len, &mapped);
+	if (data && mapped) {
+		copy = malloc(len);
+		memcpy(copy, data, len);
+		data = copy;
+	} else if (data) {
+		data = take_blob(data);
+	}
+	if (data && lenp) *lenp = len;
+	return data;
+}
+
+/*
+ * Read-only views. Stored archive entries point straight into the mapping,
+ * everything else is a shared blob. Release views with release_file_view.
+ */
+
+const unsigned char *load_file_view(const char *filename, int *lenp)
+{
+	int mapped, len;
+	unsigned char *data = load_file_imp(filename, &len, &mapped);
+	if (data && lenp) *lenp = len;
 	return data;
 }
+
+void release_file_view(const unsigned char *data)
+{
+	struct archive *zip;
+	if (!data)
+		return;
+	pthread_mutex_lock(&vfs_lock);
+	for (zip = zip_head; zip; zip = zip->next)
+		if (data >= zip->data && data < zip->data + zip->size)
+			break;
+	pthread_mutex_unlock(&vfs_lock);
+	if (!zip)
+		release_blob((unsigned char*)data);
+}
+
+/*
+ * Streams. Stored entries and cached blobs are read straight from memory,
+ * and loose files from disk, all with random access. Deflated entries are
+ * inflated on demand into a small window; seeking backwards past the
+ * window starts the inflate over. LZ4 entries are decoded whole.
+ * The crc of an archive entry is checked when it is read through from the
+ * start, since a stream may never see the whole file.
+ */
+
+#define WINDOW_HISTORY (32 << 10)
+#define WINDOW_SIZE (WINDOW_HISTORY + (32 << 10))
+
+struct vfs_stream
+{
+	int size, pos;
+	struct vfs_stats *stats;
+	const unsigned char *view;
+	int view_is_blob;
+	FILE *file;
+	int file_pos;
+	struct entry *entry; /* to check the crc */
+	unsigned int crc;
+	int crc_pos;
+	const unsigned char *in;
+	struct inflate *z;
+	unsigned char *window;
+	int window_start, window_len;
+	int64_t bytes_read, compressed, produced;
+	double decode_time;
+	int error;
+};
+
+static FILE *open_stream_file(struct vfs_stream *stm, const char *filename)
+{
+	FILE *file = fopen(filename, "rb");
+	if (!file)
+		return NULL;
+	fseek(file, 0, 2);
+	stm->size = ftell(file);
+	fseek(file, 0, 0);
+	stm->file = file;
+	return file;
+}
+
+static int open_stream_entry(struct vfs_stream *stm, struct archive *zip, struct entry *entry)
+{
+	int mapped;
+
+	if (entry->usize < 0 || entry->usize > INT32_MAX || entry->csize > INT32_MAX) {
+		warn("archive: file too large: '%s'", entry->name);
+		return -1;
+	}
+
+	if (entry->method == METHOD_STORED && entry->csize == entry->usize) {
+		stm->view = entry_data(zip, entry);
+		if (!stm->view)
+			return -1;
+		stm->size = entry->usize;
+		if (!entry->verified)
+			stm->entry = entry;
+		return 0;
+	}
+
+	if (entry->method == METHOD_DEFLATED) {
+		stm->in = entry_data(zip, entry);
+		if (!stm->in)
+			return -1;
+		stm->size = entry->usize;
+		stm->entry = entry;
+		stm->compressed = entry->csize;
+		stm->z = new_inflate(stm->in, entry->csize);
+		stm->window = malloc(WINDOW_SIZE);
+		return 0;
+	}
+
+	/* no random access into other codecs; decode the whole entry */
+	stm->view = read_entry(zip, entry, &stm->size, &mapped);
+	stm->view_is_blob = !mapped;
+	return stm->view ? 0 : -1;
+}
+
+struct vfs_stream *vfs_open(const char *filename)
+{
+	unsigned int hash = hash_name(filename);
+	double start = vfs_clock();
+	struct vfs_stream *stm = calloc(1, sizeof(struct vfs_stream));
+	struct directory *dir = NULL;
+	struct archive *zip = NULL;
+	struct entry *entry = NULL;
+	struct source *src;
+	const char *source = NULL;
+	char buf[512];
+	int miss, ok = 0;
+
+	stm->view = find_blob(filename, hash, &stm->size);
+	if (stm->view) {
+		stm->view_is_blob = 1;
+		stm->stats = &cache_stats;
+		log_access(filename, hash, cache_stats.name, stm->size, 1, start);
+		return stm;
+	}
+
+	pthread_mutex_lock(&vfs_lock);
+	src = find_source(filename, hash);
+	if (src) {
+		zip = src->zip;
+		entry = src->entry;
+		dir = src->dir;
+		if (!zip) {
+			strlcpy(buf, dir->name, sizeof buf);
+			strlcat(buf, filename, sizeof buf);
+		}
+	}
+	miss = !src && find_miss(filename, hash);
+	pthread_mutex_unlock(&vfs_lock);
+
+	if (zip) {
+		stm->stats = &zip->stats;
+		source = zip->name;
+		ok = open_stream_entry(stm, zip, entry) == 0;
+	} else if (dir) {
+		stm->stats = &dir->stats;
+		source = dir->name;
+		ok = open_stream_file(stm, buf) != NULL;
+	} else if (!miss) {
+		stm->stats = &loose_stats;
+		source = loose_stats.name;
+		ok = open_stream_file(stm, filename) != NULL;
+		if (!ok) {
+			pthread_mutex_lock(&vfs_lock);
+			add_miss(filename, hash);
+			pthread_mutex_unlock(&vfs_lock);
+		}
+	}
+
+	log_access(filename, hash, ok ? source : NULL, stm->size, 0, start);
+
+	if (!ok) {
+		count_read(stm->stats ? stm->stats : &loose_stats, 0, 0, 0, 0, 1);
+		free(stm);
+		return NULL;
+	}
+
+	return stm;
+}
+
+static int stream_inflate(struct vfs_stream *stm, unsigned char *buf, int at, int len)
+{
+	double start = vfs_clock();
+	int n, pos, status;
+
+	while (len > 0) {
+		if (at < stm->window_start) {
+			free_inflate(stm->z);
+			stm->z = new_inflate(stm->in, stm->entry->csize);
+			stm->window_start = stm->window_len = 0;
+		}
+
+		if (at < stm->window_start + stm->window_len) {
+			n = MIN(len, stm->window_start + stm->window_len - at);
+			memcpy(buf, stm->window + at - stm->window_start, n);
+			buf += n;
+			at += n;
+			len -= n;
+			continue;
+		}
+
+		/* keep the last 32K as history for back references */
+		if (stm->window_len == WINDOW_SIZE) {
+			memmove(stm->window, stm->window + WINDOW_SIZE - WINDOW_HISTORY, WINDOW_HISTORY);
+			stm->window_start += WINDOW_SIZE - WINDOW_HISTORY;
+			stm->window_len = WINDOW_HISTORY;
+		}
+
+		pos = stm->window_len;
+		status = run_inflate(stm->z, stm->window, &pos, WINDOW_SIZE);
+		if (status == INFLATE_ERROR || pos == stm->window_len) {
+			warn("archive: corrupt compressed data in '%s'", stm->entry->name);
+			return -1;
+		}
+		stm->produced += pos - stm->window_len;
+		stm->window_len = pos;
+	}
+
+	stm->decode_time += vfs_clock() - start;
+	return 0;
+}
+
+int vfs_read(struct vfs_stream *stm, void *buf, int len)
+{
+	if (stm->error)
+		return -1;
+
+	len = MIN(len, stm->size - stm->pos);
+	if (len <= 0)
+		return 0;
+
+	if (stm->view) {
+		memcpy(buf, stm->view + stm->pos, len);
+	} else if (stm->file) {
+		if (stm->file_pos != stm->pos && fseek(stm->file, stm->pos, 0) < 0)
+			stm->error = 1;
+		else if (fread(buf, 1, len, stm->file) != len)
+			stm->error = 1;
+		stm->file_pos = stm->pos + len;
+	} else if (stream_inflate(stm, buf, stm->pos, len) < 0) {
+		stm->error = 1;
+	}
+
+	if (stm->error)
+		return -1;
+
+	if (stm->entry && stm->crc_pos == stm->pos) {
+		stm->crc = update_crc32(stm->crc, buf, len);
+		stm->crc_pos += len;
+		if (stm->crc_pos == stm->size) {
+			if (stm->crc != stm->entry->crc) {
+				warn("archive: crc mismatch in '%s'", stm->entry->name);
+				stm->error = 1;
+				return -1;
+			}
+			stm->entry->verified = 1;
+		}
+	}
+
+	stm->bytes_read += len;
+	stm->pos += len;
+	return len;
+}
+
+int vfs_seek(struct vfs_stream *stm, int offset, int whence)
+{
+	int pos;
+	switch (whence) {
+	case SEEK_SET: pos = offset; break;
+	case SEEK_CUR: pos = stm->pos + offset; break;
+	case SEEK_END: pos = stm->size + offset; break;
+	default: return -1;
+	}
+	if (pos < 0 || pos > stm->size)
+		return -1;
+	stm->pos = pos;
+	return pos;
+}
+
+int vfs_size(struct vfs_stream *stm)
+{
+	return stm->size;
+}
+
+void vfs_close(struct vfs_stream *stm)
+{
+	if (!stm)
+		return;
+	if (stm->z)
+		count_read(stm->stats, stm->compressed, stm->compressed, stm->produced, stm->decode_time, stm->error);
+	else
+		count_read(stm->stats, stm->bytes_read, 0, 0, 0, stm->error);
+	if (stm->view_is_blob)
+		release_blob((unsigned char*)stm->view);
+	if (stm->file)
+		fclose(stm->file);
+	free_inflate(stm->z);
+	free(stm->window);
+	free(stm);
+}